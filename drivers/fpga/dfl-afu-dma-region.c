@@ -9,8 +9,17 @@
  *   Xiao Guangrong <guangrong.xiao@linux.intel.com>
  */
 
+#include <linux/bitfield.h>
+#include <linux/bitmap.h>
+#include <linux/dma-buf.h>
 #include <linux/fpga-dfl.h>
+#include <linux/highmem.h>
+#include <linux/hmm.h>
+#include <linux/iommu.h>
+#include <linux/ktime.h>
 #include <linux/pfn.h>
+#include <linux/scatterlist.h>
+#include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
 #include <linux/uaccess.h>
 #include <linux/mm.h>
@@ -19,143 +28,362 @@
 #include "dfl-afu.h"
 #include "dfl-dma-cxl-common.h"
 
-void afu_dma_region_init(struct dfl_feature_dev_data *fdata)
+/*
+ * Pinned pages are not kept as one struct page pointer per page. They are
+ * pinned in batches and recorded as runs of physically continuous pages, so
+ * a region backed by THP or hugetlb pages only needs a few entries.
+ */
+#define AFU_DMA_PIN_BATCH	(PAGE_SIZE / sizeof(struct page *))
+
+/* a run is packed as its first pfn and its number of pages minus one */
+#define AFU_DMA_RUN_PFN		GENMASK_ULL(63, 20)
+#define AFU_DMA_RUN_NPAGES	GENMASK_ULL(19, 0)
+
+/* keep the length of a run within the length of a scatterlist entry */
+#define AFU_DMA_RUN_MAX_PAGES	min_t(u64, FIELD_MAX(AFU_DMA_RUN_NPAGES) + 1, \
+				      UINT_MAX >> PAGE_SHIFT)
+
+static inline unsigned long afu_dma_run_pfn(u64 run)
 {
-	struct dfl_afu *afu = dfl_fpga_fdata_get_private(fdata);
+	return FIELD_GET(AFU_DMA_RUN_PFN, run);
+}
 
-	afu->dma_regions = RB_ROOT;
+static inline unsigned long afu_dma_run_npages(u64 run)
+{
+	return FIELD_GET(AFU_DMA_RUN_NPAGES, run) + 1;
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 3, 0) && RHEL_RELEASE_CODE < 0x803
-static int afu_dma_pin_pages(struct dfl_feature_dev_data *fdata,
-			     struct dfl_afu_dma_region *region)
+static long afu_dma_lock_vm(struct device *dev, struct mm_struct *mm,
+			    long npages, bool incr)
 {
-	long npages = region->length >> PAGE_SHIFT;
-	struct device *dev = &fdata->dev->dev;
-	long ret, pinned;
+	return afu_dma_adjust_locked_vm(dev, npages, incr);
+}
 
-	ret = afu_dma_adjust_locked_vm(dev, npages, true);
-	if (ret)
-		return ret;
+static long afu_dma_pin_batch(struct dfl_afu_dma_region *region,
+			      unsigned long addr, long npages,
+			      struct page **pages)
+{
+	return get_user_pages_fast(addr, npages,
+				   (region->direction != DMA_TO_DEVICE),
+				   pages);
+}
 
-	region->pages = kcalloc(npages, sizeof(struct page *), GFP_KERNEL);
-	if (!region->pages) {
-		afu_dma_adjust_locked_vm(dev, npages, false);
-		return -ENOMEM;
-	}
+#else /* < KERNEL_VERSION(5, 3, 0) */
+
+static long afu_dma_lock_vm(struct device *dev, struct mm_struct *mm,
+			    long npages, bool incr)
+{
+	return account_locked_vm(mm, npages, incr);
+}
+
+static long afu_dma_pin_batch(struct dfl_afu_dma_region *region,
+			      unsigned long addr, long npages,
+			      struct page **pages)
+{
+	unsigned int flags = FOLL_LONGTERM;
+
+	if (region->direction != DMA_TO_DEVICE)
+		flags |= FOLL_WRITE;
+
+	return pin_user_pages_fast(addr, npages, flags, pages);
+}
+
+#endif /* < KERNEL_VERSION(5, 3, 0) */
+
+/**
+ * afu_dma_runs_add - record physically continuous pages
+ * @region: dma memory region
+ * @pfn: first page frame number
+ * @npages: number of pages
+ *
+ * Return 0 for success or negative error code.
+ */
+static int afu_dma_runs_add(struct dfl_afu_dma_region *region,
+			    unsigned long pfn, unsigned long npages)
+{
+	unsigned long n, max_runs;
+	u64 *runs, *last;
+
+	while (npages) {
+		if (region->nr_runs) {
+			last = &region->runs[region->nr_runs - 1];
+			n = afu_dma_run_npages(*last);
+			if (afu_dma_run_pfn(*last) + n == pfn &&
+			    n < AFU_DMA_RUN_MAX_PAGES) {
+				n = min_t(unsigned long, npages,
+					  AFU_DMA_RUN_MAX_PAGES - n);
+				/* the number of pages is in the low bits */
+				*last += n;
+				pfn += n;
+				npages -= n;
+				continue;
+			}
+		}
+
+		if (region->nr_runs == region->max_runs) {
+			max_runs = max_t(unsigned long, 2 * region->max_runs,
+					 AFU_DMA_PIN_BATCH);
+			runs = kvmalloc_array(max_runs, sizeof(*runs),
+					      GFP_KERNEL);
+			if (!runs)
+				return -ENOMEM;
+
+			if (region->runs)
+				memcpy(runs, region->runs,
+				       region->nr_runs * sizeof(*runs));
+			kvfree(region->runs);
+			region->runs = runs;
+			region->max_runs = max_runs;
+		}
 
-	pinned = get_user_pages_fast(region->user_addr, npages,
-				     (region->direction != DMA_TO_DEVICE),
-				     region->pages);
-	if (pinned < 0) {
-		ret = pinned;
-		goto err_put_pages;
-	} else if (pinned != npages) {
-		ret = -EFAULT;
-		goto err;
+		n = min_t(unsigned long, npages, AFU_DMA_RUN_MAX_PAGES);
+		region->runs[region->nr_runs++] =
+			FIELD_PREP(AFU_DMA_RUN_PFN, pfn) |
+			FIELD_PREP(AFU_DMA_RUN_NPAGES, n - 1);
+		pfn += n;
+		npages -= n;
 	}
 
-	dev_dbg(dev, "%ld pages pinned\n", pinned);
+	return 0;
+}
+
+/**
+ * afu_dma_runs_add_pages - record pinned pages as runs of continuous pages
+ * @region: dma memory region
+ * @pages: pinned pages, in order of their user address
+ * @npages: number of @pages
+ *
+ * Return 0 for success or negative error code.
+ */
+static int afu_dma_runs_add_pages(struct dfl_afu_dma_region *region,
+				  struct page **pages, long npages)
+{
+	long i;
+	int ret;
+
+	for (i = 0; i < npages; i++) {
+		ret = afu_dma_runs_add(region, page_to_pfn(pages[i]), 1);
+		if (ret)
+			return ret;
+	}
 
 	return 0;
+}
 
-err_put_pages:
-	put_user_pages(region->pages, pinned);
-err:
-	kfree(region->pages);
-	afu_dma_adjust_locked_vm(dev, npages, false);
-	return ret;
+/**
+ * afu_dma_unpin_runs - unpin all recorded runs of given dma memory region
+ * @region: dma memory region
+ */
+static void afu_dma_unpin_runs(struct dfl_afu_dma_region *region)
+{
+	unsigned long i, npages, pfn;
+	struct page *page;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0) && RHEL_RELEASE_CODE < 0x900
+	unsigned long j;
+#endif
+
+	for (i = 0; i < region->nr_runs; i++) {
+		pfn = afu_dma_run_pfn(region->runs[i]);
+		npages = afu_dma_run_npages(region->runs[i]);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0) && RHEL_RELEASE_CODE < 0x900
+		for (j = 0; j < npages; j++) {
+			page = pfn_to_page(pfn + j);
+			unpin_user_pages(&page, 1);
+		}
+#else
+		page = pfn_to_page(pfn);
+		unpin_user_page_range_dirty_lock(page, npages, false);
+#endif
+	}
+
+	kvfree(region->runs);
+	region->runs = NULL;
+	region->nr_runs = 0;
+	region->max_runs = 0;
 }
 
-static void afu_dma_unpin_pages(struct dfl_feature_dev_data *fdata,
-				struct dfl_afu_dma_region *region)
+/**
+ * afu_dma_pin_runs - pin the user range of given dma memory region
+ * @region: dma memory region, its runs are empty
+ * @nr_huge: pointer of the number of pinned pages which are part of huge pages
+ *
+ * Pin all the pages of the user range of the region in the address space of
+ * current, and record them in the runs of the region. Nothing is accounted,
+ * the pins are released by afu_dma_unpin_runs().
+ * Return 0 for success or negative error code.
+ */
+static long afu_dma_pin_runs(struct dfl_afu_dma_region *region,
+			     unsigned long *nr_huge)
 {
-	long npages = region->length >> PAGE_SHIFT;
-	struct device *dev = &fdata->dev->dev;
+	long npages = PFN_DOWN(region->length);
+	long pinned = 0, nr, i;
+	struct page **batch;
+	unsigned long addr;
+	long ret;
 
-	put_user_pages(region->pages, npages);
-	kfree(region->pages);
-	afu_dma_adjust_locked_vm(dev, npages, false);
+	batch = (struct page **)__get_free_page(GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
 
-	dev_dbg(dev, "%ld pages unpinned\n", npages);
-}
+	while (pinned < npages) {
+		nr = min_t(long, npages - pinned, AFU_DMA_PIN_BATCH);
+		addr = region->user_addr + (pinned << PAGE_SHIFT);
 
-#else /* < KERNEL_VERSION(5, 3, 0) */
+		nr = afu_dma_pin_batch(region, addr, nr, batch);
+		if (nr <= 0) {
+			ret = nr ? nr : -EFAULT;
+			goto unpin_pages;
+		}
+
+		for (i = 0; i < nr; i++)
+			if (PageCompound(batch[i]))
+				(*nr_huge)++;
+
+		ret = afu_dma_runs_add_pages(region, batch, nr);
+		if (ret) {
+			unpin_user_pages(batch, nr);
+			goto unpin_pages;
+		}
+
+		pinned += nr;
+	}
+
+	free_page((unsigned long)batch);
+
+	return 0;
+
+unpin_pages:
+	afu_dma_unpin_runs(region);
+	free_page((unsigned long)batch);
+	return ret;
+}
 
 /**
  * afu_dma_pin_pages - pin pages of given dma memory region
- * @fdata: feature dev data
+ * @ctx: port file context
  * @region: dma memory region to be pinned
  *
  * Pin all the pages of given dfl_afu_dma_region.
  * Return 0 for success or negative error code.
  */
-static int afu_dma_pin_pages(struct dfl_feature_dev_data *fdata,
+static int afu_dma_pin_pages(struct dfl_afu_ctx *ctx,
 			     struct dfl_afu_dma_region *region)
 {
-	int npages = PFN_DOWN(region->length);
-	struct device *dev = &fdata->dev->dev;
-	unsigned int flags = FOLL_LONGTERM;
-	int ret, pinned;
+	long npages = PFN_DOWN(region->length);
+	struct device *dev = &ctx->fdata->dev->dev;
+	unsigned long nr_huge = 0;
+	long ret;
 
-	ret = account_locked_vm(current->mm, npages, true);
+	ret = afu_dma_lock_vm(dev, region->mm, npages, true);
 	if (ret)
 		return ret;
 
-	region->pages = kcalloc(npages, sizeof(struct page *), GFP_KERNEL);
-	if (!region->pages) {
-		ret = -ENOMEM;
-		goto unlock_vm;
+	ret = afu_dma_pin_runs(region, &nr_huge);
+	if (ret) {
+		afu_dma_lock_vm(dev, region->mm, npages, false);
+		return ret;
 	}
 
-	if (region->direction != DMA_TO_DEVICE)
-		flags |= FOLL_WRITE;
-
-	pinned = pin_user_pages_fast(region->user_addr, npages, flags,
-				     region->pages);
-	if (pinned < 0) {
-		ret = pinned;
-		goto free_pages;
-	} else if (pinned != npages) {
-		ret = -EFAULT;
-		goto unpin_pages;
-	}
+	atomic_long_add(npages, &ctx->dma_pinned);
 
-	dev_dbg(dev, "%d pages pinned\n", pinned);
+	dev_dbg(dev, "%ld pages pinned in %lu runs, %lu in huge pages\n",
+		npages, region->nr_runs, nr_huge);
 
 	return 0;
-
-unpin_pages:
-	unpin_user_pages(region->pages, pinned);
-free_pages:
-	kfree(region->pages);
-unlock_vm:
-	account_locked_vm(current->mm, npages, false);
-	return ret;
 }
 
 /**
  * afu_dma_unpin_pages - unpin pages of given dma memory region
- * @fdata: feature dev data
+ * @ctx: port file context
  * @region: dma memory region to be unpinned
  *
  * Unpin all the pages of given dfl_afu_dma_region.
- * Return 0 for success or negative error code.
  */
-static void afu_dma_unpin_pages(struct dfl_feature_dev_data *fdata,
+static void afu_dma_unpin_pages(struct dfl_afu_ctx *ctx,
 				struct dfl_afu_dma_region *region)
 {
 	long npages = PFN_DOWN(region->length);
-	struct device *dev = &fdata->dev->dev;
+	struct device *dev = &ctx->fdata->dev->dev;
 
-	unpin_user_pages(region->pages, npages);
-	kfree(region->pages);
-	account_locked_vm(current->mm, npages, false);
+	afu_dma_unpin_runs(region);
+	atomic_long_sub(npages, &ctx->dma_pinned);
+	afu_dma_lock_vm(dev, region->mm, npages, false);
 
 	dev_dbg(dev, "%ld pages unpinned\n", npages);
 }
 
-#endif /* < KERNEL_VERSION(5, 3, 0) */
+/**
+ * afu_dma_free_pages - free pages of given driver allocated dma region
+ * @region: dma memory region
+ *
+ * The pages stay valid as long as they are mapped to userspace.
+ */
+static void afu_dma_free_pages(struct dfl_afu_dma_region *region)
+{
+	unsigned long i, j, pfn;
+
+	for (i = 0; i < region->nr_runs; i++) {
+		pfn = afu_dma_run_pfn(region->runs[i]);
+		for (j = 0; j < afu_dma_run_npages(region->runs[i]); j++)
+			put_page(pfn_to_page(pfn + j));
+	}
+
+	kvfree(region->runs);
+	region->runs = NULL;
+	region->nr_runs = 0;
+	region->max_runs = 0;
+}
+
+/**
+ * afu_dma_alloc_pages - allocate pages for given driver allocated dma region
+ * @ctx: port file context
+ * @region: dma memory region
+ * @contig: allocate physically continuous chunks of the PMD size
+ *
+ * Pages are allocated from the NUMA node of the device. They are split into
+ * order 0 pages, so each of them can be mapped to userspace on its own.
+ * Return 0 for success or negative error code.
+ */
+static int afu_dma_alloc_pages(struct dfl_afu_ctx *ctx,
+			       struct dfl_afu_dma_region *region, bool contig)
+{
+	int nid = dev_to_node(dfl_fpga_fdata_to_parent(ctx->fdata));
+	struct device *dev = &ctx->fdata->dev->dev;
+	unsigned long npages = PFN_DOWN(region->length);
+	unsigned int order = contig ? PMD_SHIFT - PAGE_SHIFT : 0;
+	unsigned long done, i;
+	struct page *page;
+	int ret;
+
+	for (done = 0; done < npages; done += 1UL << order) {
+		page = alloc_pages_node(nid, GFP_KERNEL_ACCOUNT | __GFP_ZERO |
+					__GFP_NOWARN, order);
+		if (!page) {
+			ret = -ENOMEM;
+			goto free_pages;
+		}
+
+		split_page(page, order);
+
+		ret = afu_dma_runs_add(region, page_to_pfn(page), 1UL << order);
+		if (ret) {
+			for (i = 0; i < 1UL << order; i++)
+				put_page(page + i);
+			goto free_pages;
+		}
+	}
+
+	dev_dbg(dev, "%lu pages allocated on node %d in %lu runs\n",
+		npages, nid, region->nr_runs);
+
+	return 0;
+
+free_pages:
+	afu_dma_free_pages(region);
+	return ret;
+}
 
 /**
  * afu_dma_check_continuous_pages - check if pages are continuous
@@ -166,17 +394,135 @@ static void afu_dma_unpin_pages(struct dfl_feature_dev_data *fdata,
  */
 static bool afu_dma_check_continuous_pages(struct dfl_afu_dma_region *region)
 {
-	int npages = PFN_DOWN(region->length);
-	int i;
+	return region->nr_runs == 1;
+}
+
+/**
+ * afu_dma_check_continuous_iova - check if a scatterlist mapping is continuous
+ * @sgt: dma mapped scatter-gather table
+ *
+ * Return true if all segments of given scatter-gather table are mapped to
+ * continuous dma addresses, otherwise return false.
+ */
+static bool afu_dma_check_continuous_iova(struct sg_table *sgt)
+{
+	dma_addr_t next = sg_dma_address(sgt->sgl);
+	struct scatterlist *sg;
+	unsigned int i;
 
-	for (i = 0; i < npages - 1; i++)
-		if (page_to_pfn(region->pages[i]) + 1 !=
-				page_to_pfn(region->pages[i + 1]))
+	for_each_sgtable_dma_sg(sgt, sg, i) {
+		if (sg_dma_address(sg) != next)
 			return false;
+		next += sg_dma_len(sg);
+	}
 
 	return true;
 }
 
+/**
+ * afu_dma_runs_alloc_sgt - build a scatter-gather table from runs of pages
+ * @runs: runs of physically continuous pages
+ * @nr_runs: number of @runs
+ *
+ * Return the scatter-gather table with one entry per run, to be freed with
+ * sg_free_table() and kfree(), or ERR_PTR() on failure.
+ */
+static struct sg_table *afu_dma_runs_alloc_sgt(const u64 *runs,
+					       unsigned long nr_runs)
+{
+	struct scatterlist *sg;
+	struct sg_table *sgt;
+	unsigned int i;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = sg_alloc_table(sgt, nr_runs, GFP_KERNEL);
+	if (ret) {
+		kfree(sgt);
+		return ERR_PTR(ret);
+	}
+
+	for_each_sg(sgt->sgl, sg, nr_runs, i)
+		sg_set_page(sg, pfn_to_page(afu_dma_run_pfn(runs[i])),
+			    afu_dma_run_npages(runs[i]) << PAGE_SHIFT, 0);
+
+	return sgt;
+}
+
+/**
+ * afu_dma_map_sg - map pages of given dma memory region as a scatterlist
+ * @ctx: port file context
+ * @region: dma memory region to be mapped
+ *
+ * Map the pages of given dfl_afu_dma_region which are not physically
+ * continuous. The AFU is given a single dma address, so this only succeeds
+ * if the pages are mapped to continuous dma addresses, e.g. by an IOMMU.
+ * Return 0 for success or negative error code.
+ */
+static int afu_dma_map_sg(struct dfl_afu_ctx *ctx,
+			  struct dfl_afu_dma_region *region)
+{
+	struct device *parent = dfl_fpga_fdata_to_parent(ctx->fdata);
+	struct device *dev = &ctx->fdata->dev->dev;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = afu_dma_runs_alloc_sgt(region->runs, region->nr_runs);
+	if (IS_ERR(sgt))
+		return PTR_ERR(sgt);
+
+	ret = dma_map_sgtable(parent, sgt, region->direction, 0);
+	if (ret) {
+		dev_err(dev, "failed to map scatterlist for dma\n");
+		goto free_table;
+	}
+
+	if (!afu_dma_check_continuous_iova(sgt)) {
+		dev_err(dev, "pages are not continuous in dma address space\n");
+		ret = -EINVAL;
+		goto unmap_sgt;
+	}
+
+	dev_dbg(dev, "%u page runs mapped in %u dma segments\n",
+		sgt->orig_nents, sgt->nents);
+
+	region->iova = sg_dma_address(sgt->sgl);
+	region->sgt = sgt;
+
+	return 0;
+
+unmap_sgt:
+	dma_unmap_sgtable(parent, sgt, region->direction, 0);
+free_table:
+	sg_free_table(sgt);
+	kfree(sgt);
+	return ret;
+}
+
+/**
+ * afu_dma_unmap - unmap given dma memory region
+ * @ctx: port file context
+ * @region: dma memory region to be unmapped
+ */
+static void afu_dma_unmap(struct dfl_afu_ctx *ctx,
+			  struct dfl_afu_dma_region *region)
+{
+	struct device *parent = dfl_fpga_fdata_to_parent(ctx->fdata);
+
+	if (region->sgt) {
+		dma_unmap_sgtable(parent, region->sgt, region->direction, 0);
+		sg_free_table(region->sgt);
+		kfree(region->sgt);
+		region->sgt = NULL;
+	} else {
+		dma_unmap_page(parent, region->iova, region->length,
+			       region->direction);
+	}
+}
+
 /**
  * dma_region_check_iova - check if memory area is fully contained in the region
  * @region: dma memory region
@@ -196,24 +542,53 @@ static bool dma_region_check_iova(struct dfl_afu_dma_region *region,
 		(region->length + region->iova >= iova + size);
 }
 
+/**
+ * afu_dma_alloc_region_add - add driver allocated dma region to offset rbtree
+ * @ctx: port file context
+ * @region: driver allocated dma region
+ *
+ * The mmap offsets of driver allocated regions never overlap.
+ *
+ * Needs to be called with ctx->dma_lock held for write.
+ */
+static void afu_dma_alloc_region_add(struct dfl_afu_ctx *ctx,
+				     struct dfl_afu_dma_region *region)
+{
+	struct rb_node **new = &ctx->dma_alloc_regions.rb_node, *parent = NULL;
+	struct dfl_afu_dma_region *this;
+
+	while (*new) {
+		this = rb_entry(*new, struct dfl_afu_dma_region, alloc_node);
+		parent = *new;
+
+		if (region->offset < this->offset)
+			new = &((*new)->rb_left);
+		else
+			new = &((*new)->rb_right);
+	}
+
+	rb_link_node(&region->alloc_node, parent, new);
+	rb_insert_color(&region->alloc_node, &ctx->dma_alloc_regions);
+}
+
 /**
  * afu_dma_region_add - add given dma region to rbtree
- * @fdata: feature dev data
+ * @ctx: port file context
  * @region: dma region to be added
  *
  * Return 0 for success, -EEXIST if dma region has already been added.
  *
- * Needs to be called with fdata->lock held.
+ * Needs to be called with ctx->dma_lock held for write.
  */
-static int afu_dma_region_add(struct dfl_feature_dev_data *fdata,
+static int afu_dma_region_add(struct dfl_afu_ctx *ctx,
 			      struct dfl_afu_dma_region *region)
 {
-	struct dfl_afu *afu = dfl_fpga_fdata_get_private(fdata);
+	struct device *dev = &ctx->fdata->dev->dev;
 	struct rb_node **new, *parent = NULL;
 
-	dev_dbg(&fdata->dev->dev, "add region (iova = %llx)\n", region->iova);
+	dev_dbg(dev, "add region (iova = %llx)\n", region->iova);
 
-	new = &afu->dma_regions.rb_node;
+	new = &ctx->dma_regions.rb_node;
 
 	while (*new) {
 		struct dfl_afu_dma_region *this;
@@ -234,121 +609,1244 @@ static int afu_dma_region_add(struct dfl_feature_dev_data *fdata,
 	}
 
 	rb_link_node(&region->node, parent, new);
-	rb_insert_color(&region->node, &afu->dma_regions);
+	rb_insert_color(&region->node, &ctx->dma_regions);
+	ctx->dma_nr_regions++;
+
+	if (region->alloc)
+		afu_dma_alloc_region_add(ctx, region);
 
 	return 0;
 }
 
 /**
  * afu_dma_region_remove - remove given dma region from rbtree
- * @fdata: feature dev data
+ * @ctx: port file context
  * @region: dma region to be removed
  *
- * Needs to be called with fdata->lock held.
+ * Needs to be called with ctx->dma_lock held for write.
  */
-static void afu_dma_region_remove(struct dfl_feature_dev_data *fdata,
+static void afu_dma_region_remove(struct dfl_afu_ctx *ctx,
 				  struct dfl_afu_dma_region *region)
 {
-	struct dfl_afu *afu;
+	struct device *dev = &ctx->fdata->dev->dev;
+
+	dev_dbg(dev, "del region (iova = %llx)\n", region->iova);
 
-	dev_dbg(&fdata->dev->dev, "del region (iova = %llx)\n", region->iova);
+	rb_erase(&region->node, &ctx->dma_regions);
+	ctx->dma_nr_regions--;
 
-	afu = dfl_fpga_fdata_get_private(fdata);
-	rb_erase(&region->node, &afu->dma_regions);
+	if (region->alloc)
+		rb_erase(&region->alloc_node, &ctx->dma_alloc_regions);
 }
 
-/**
- * afu_dma_region_destroy - destroy all regions in rbtree
- * @fdata: feature dev data
- *
- * Needs to be called with fdata->lock held.
- */
-void afu_dma_region_destroy(struct dfl_feature_dev_data *fdata)
+static void afu_dma_cache_unregister(struct dfl_afu_dma_region *region)
 {
-	struct dfl_afu *afu = dfl_fpga_fdata_get_private(fdata);
-	struct rb_node *node = rb_first(&afu->dma_regions);
-	struct dfl_afu_dma_region *region;
+#ifdef DFL_AFU_DMA_CACHE
+	if (region->cache || region->ondemand)
+		mmu_interval_notifier_remove(&region->notifier);
+#endif
+}
 
-	while (node) {
-		region = container_of(node, struct dfl_afu_dma_region, node);
+static void afu_dma_ondemand_release(struct dfl_afu_ctx *ctx,
+				     struct dfl_afu_dma_region *region);
 
-		dev_dbg(&fdata->dev->dev, "del region (iova = %llx)\n",
-			region->iova);
+/**
+ * afu_dma_region_release - unmap, unpin and free given dma region
+ * @ctx: port file context
+ * @region: dma region to be released, not in any rbtree
+ */
+static void afu_dma_region_release(struct dfl_afu_ctx *ctx,
+				   struct dfl_afu_dma_region *region)
+{
+#ifdef DFL_AFU_DMA_BUF
+	if (region->attach) {
+		struct dma_buf *dmabuf = region->attach->dmabuf;
+
+		dma_buf_unmap_attachment_unlocked(region->attach, region->sgt,
+						  region->direction);
+		dma_buf_detach(dmabuf, region->attach);
+		dma_buf_put(dmabuf);
+		kfree(region);
+		return;
+	}
+#endif
+
+	if (region->ondemand) {
+		afu_dma_ondemand_release(ctx, region);
+	} else if (region->alloc) {
+		afu_dma_unmap(ctx, region);
+		afu_dma_free_pages(region);
+	} else {
+		afu_dma_unmap(ctx, region);
+		afu_dma_unpin_pages(ctx, region);
+		afu_dma_cache_unregister(region);
+		mmdrop(region->mm);
+	}
 
-		rb_erase(node, &afu->dma_regions);
+	kfree(region);
+}
 
-		if (region->iova)
-			dma_unmap_page(dfl_fpga_fdata_to_parent(fdata),
-				       region->iova, region->length,
-				       DMA_BIDIRECTIONAL);
+#ifdef DFL_AFU_DMA_CACHE
+/*
+ * The registration cache keeps regions mapped with DFL_DMA_MAP_FLAG_CACHE
+ * pinned and mapped after their last unmap, so that mapping the same user
+ * buffer again is a lookup. Each cached region has an mmu_interval_notifier
+ * on its user address range. An invalidation only bumps the notifier
+ * sequence, the regions are dropped from the cache by a work item as
+ * the notifier callback can't take dma_lock.
+ */
+static bool afu_dma_cache_invalidate(struct mmu_interval_notifier *mni,
+				     const struct mmu_notifier_range *range,
+				     unsigned long cur_seq)
+{
+	struct dfl_afu_dma_region *region =
+		container_of(mni, struct dfl_afu_dma_region, notifier);
 
-		if (region->pages)
-			afu_dma_unpin_pages(fdata, region);
+	mmu_interval_set_seq(mni, cur_seq);
+	schedule_work(&region->ctx->dma_cache_work);
 
-		node = rb_next(node);
-		kfree(region);
-	}
+	return true;
 }
 
+static const struct mmu_interval_notifier_ops afu_dma_cache_ops = {
+	.invalidate = afu_dma_cache_invalidate,
+};
+
+#ifdef DFL_AFU_DMA_ONDEMAND
 /**
- * afu_dma_region_find - find the dma region from rbtree based on iova and size
- * @fdata: feature dev data
- * @iova: address of the dma memory area
- * @size: size of the dma memory area
+ * afu_dma_ondemand_forget - drop the pages of an on-demand region
+ * @region: on-demand dma region, or temporary region of its new pages
+ * @dirty: the pages were mapped writable for the AFU
  *
- * It finds the dma region from the rbtree based on @iova and @size:
- * - if @size == 0, it finds the dma region which starts from @iova
- * - otherwise, it finds the dma region which fully contains
- *   [@iova, @iova+size)
- * If nothing is matched returns NULL.
- *
- * Needs to be called with fdata->lock held.
+ * No reference is held on the pages, so they are only marked dirty if the
+ * AFU may have written to them, while they are still mapped to the user
+ * range.
  */
-struct dfl_afu_dma_region *
-afu_dma_region_find(struct dfl_feature_dev_data *fdata, u64 iova, u64 size)
+static void afu_dma_ondemand_forget(struct dfl_afu_dma_region *region,
+				    bool dirty)
 {
-	struct dfl_afu *afu = dfl_fpga_fdata_get_private(fdata);
-	struct rb_node *node = afu->dma_regions.rb_node;
-	struct device *dev = &fdata->dev->dev;
-
-	while (node) {
-		struct dfl_afu_dma_region *region;
-
-		region = container_of(node, struct dfl_afu_dma_region, node);
+	unsigned long i, j, pfn;
 
-		if (dma_region_check_iova(region, iova, size)) {
-			dev_dbg(dev, "find region (iova = %llx)\n",
-				region->iova);
-			return region;
+	if (dirty && region->direction != DMA_TO_DEVICE) {
+		for (i = 0; i < region->nr_runs; i++) {
+			pfn = afu_dma_run_pfn(region->runs[i]);
+			for (j = 0; j < afu_dma_run_npages(region->runs[i]); j++)
+				set_page_dirty(pfn_to_page(pfn + j));
 		}
-
-		if (iova < region->iova)
-			node = node->rb_left;
-		else if (iova > region->iova)
-			node = node->rb_right;
-		else
-			/* the iova region is not fully covered. */
-			break;
 	}
 
-	dev_dbg(dev, "region with iova %llx and size %llx is not found\n", iova,
-		size);
-
-	return NULL;
+	kvfree(region->runs);
+	region->runs = NULL;
+	region->nr_runs = 0;
+	region->max_runs = 0;
 }
 
 /**
- * afu_dma_region_find_iova - find the dma region from rbtree by iova
- * @fdata: feature dev data
- * @iova: address of the dma region
+ * afu_dma_ondemand_quiesce - hold the port in reset for on-demand regions
+ * @ctx: port file context
  *
- * Needs to be called with fdata->lock held.
+ * Needs to be called with ctx->dma_notifier_lock held.
  */
-static struct dfl_afu_dma_region *
-afu_dma_region_find_iova(struct dfl_feature_dev_data *fdata, u64 iova)
+static void afu_dma_ondemand_quiesce(struct dfl_afu_ctx *ctx)
 {
-	return afu_dma_region_find(fdata, iova, 0);
-}
+	struct dfl_feature_dev_data *fdata = ctx->fdata;
+
+	if (ctx->dma_quiesced)
+		return;
+
+	if (__afu_port_disable(fdata))
+		dev_warn(&fdata->dev->dev, "failed to quiesce port for remap\n");
+	ctx->dma_quiesced = true;
+
+	dev_dbg(&fdata->dev->dev, "port quiesced for on-demand regions\n");
+}
+
+/**
+ * afu_dma_ondemand_resume - let the port out of reset for on-demand regions
+ * @ctx: port file context
+ *
+ * The port stays in reset as long as any on-demand region of the context
+ * has no mapped pages.
+ *
+ * Needs to be called with ctx->dma_notifier_lock held.
+ */
+static void afu_dma_ondemand_resume(struct dfl_afu_ctx *ctx)
+{
+	struct dfl_feature_dev_data *fdata = ctx->fdata;
+
+	if (!ctx->dma_quiesced || ctx->dma_ondemand_unmapped)
+		return;
+
+	__afu_port_enable(fdata);
+	ctx->dma_quiesced = false;
+
+	dev_dbg(&fdata->dev->dev, "port released for on-demand regions\n");
+}
+
+/*
+ * On-demand regions are tracked by the same notifier. Their pages are
+ * mirrored by hmm_range_fault() without any reference, so they are only
+ * valid until the next invalidation of the range. The AFU can't fault on a
+ * page, so an invalidation has to stop it before the pages go away: the port
+ * is quiesced and the region is unmapped before the callback returns. The
+ * cache work faults in and maps the range again once the invalidation is
+ * over. Protection changes, e.g. for NUMA balancing, leave the pages in
+ * place and only bump the notifier sequence.
+ *
+ * ctx->dma_notifier_lock is never held while memory is allocated or pages
+ * are faulted in, so it can be taken from reclaim.
+ */
+static bool afu_dma_ondemand_invalidate(struct mmu_interval_notifier *mni,
+					const struct mmu_notifier_range *range,
+					unsigned long cur_seq)
+{
+	struct dfl_afu_dma_region *region =
+		container_of(mni, struct dfl_afu_dma_region, notifier);
+	struct dfl_afu_ctx *ctx = region->ctx;
+
+	if (!mmu_notifier_range_blockable(range))
+		return false;
+
+	mutex_lock(&ctx->dma_notifier_lock);
+	mmu_interval_set_seq(mni, cur_seq);
+
+	switch (range->event) {
+	case MMU_NOTIFY_PROTECTION_VMA:
+	case MMU_NOTIFY_PROTECTION_PAGE:
+	case MMU_NOTIFY_SOFT_DIRTY:
+		break;
+	default:
+		if (!region->mapped)
+			break;
+
+		afu_dma_ondemand_quiesce(ctx);
+		afu_dma_unmap(ctx, region);
+		afu_dma_ondemand_forget(region, true);
+		region->mapped = false;
+		ctx->dma_ondemand_unmapped++;
+		schedule_work(&ctx->dma_cache_work);
+	}
+	mutex_unlock(&ctx->dma_notifier_lock);
+
+	return true;
+}
+
+static const struct mmu_interval_notifier_ops afu_dma_ondemand_ops = {
+	.invalidate = afu_dma_ondemand_invalidate,
+};
+#endif /* DFL_AFU_DMA_ONDEMAND */
+
+static bool afu_dma_cache_stale(struct dfl_afu_dma_region *region)
+{
+	return mmu_interval_check_retry(&region->notifier,
+					region->notifier_seq);
+}
+
+static int afu_dma_cache_cmp(struct dfl_afu_dma_region *region,
+			     struct mm_struct *mm, u64 user_addr, u64 length,
+			     enum dma_data_direction direction)
+{
+	if (mm != region->mm)
+		return mm < region->mm ? -1 : 1;
+
+	if (user_addr != region->user_addr)
+		return user_addr < region->user_addr ? -1 : 1;
+
+	if (length != region->length)
+		return length < region->length ? -1 : 1;
+
+	if (direction != region->direction)
+		return direction < region->direction ? -1 : 1;
+
+	return 0;
+}
+
+/**
+ * afu_dma_cache_add - add given dma region to the registration cache
+ * @ctx: port file context
+ * @region: dma region to be added
+ *
+ * Return 0 for success, -EEXIST if the same user range is already cached.
+ *
+ * Needs to be called with ctx->dma_lock held for write.
+ */
+static int afu_dma_cache_add(struct dfl_afu_ctx *ctx,
+			     struct dfl_afu_dma_region *region)
+{
+	struct rb_node **new = &ctx->dma_cache.rb_node, *parent = NULL;
+	struct dfl_afu_dma_region *this;
+	int cmp;
+
+	while (*new) {
+		this = rb_entry(*new, struct dfl_afu_dma_region, cache_node);
+		cmp = afu_dma_cache_cmp(this, region->mm, region->user_addr,
+					region->length, region->direction);
+
+		parent = *new;
+
+		if (cmp < 0)
+			new = &((*new)->rb_left);
+		else if (cmp > 0)
+			new = &((*new)->rb_right);
+		else
+			return -EEXIST;
+	}
+
+	rb_link_node(&region->cache_node, parent, new);
+	rb_insert_color(&region->cache_node, &ctx->dma_cache);
+
+	return 0;
+}
+
+/**
+ * afu_dma_cache_find - find the cached dma region of given user range
+ * @ctx: port file context
+ * @mm: user address space
+ * @user_addr: address of the memory region
+ * @length: size of the memory region
+ * @direction: dma data direction
+ *
+ * Needs to be called with ctx->dma_lock held for write.
+ */
+static struct dfl_afu_dma_region *
+afu_dma_cache_find(struct dfl_afu_ctx *ctx, struct mm_struct *mm,
+		   u64 user_addr, u64 length, enum dma_data_direction direction)
+{
+	struct rb_node *node = ctx->dma_cache.rb_node;
+	struct dfl_afu_dma_region *region;
+	int cmp;
+
+	while (node) {
+		region = rb_entry(node, struct dfl_afu_dma_region, cache_node);
+		cmp = afu_dma_cache_cmp(region, mm, user_addr, length,
+					direction);
+
+		if (cmp < 0)
+			node = node->rb_left;
+		else if (cmp > 0)
+			node = node->rb_right;
+		else
+			return region;
+	}
+
+	return NULL;
+}
+
+/**
+ * afu_dma_cache_drop - drop given dma region from the registration cache
+ * @ctx: port file context
+ * @region: cached dma region
+ * @release: list to queue the region on if it has to be released
+ *
+ * An idle region is removed from the dma region rbtree too and queued on
+ * @release, a region in use is released by its last unmap.
+ *
+ * Needs to be called with ctx->dma_lock held for write.
+ */
+static void afu_dma_cache_drop(struct dfl_afu_ctx *ctx,
+			       struct dfl_afu_dma_region *region,
+			       struct list_head *release)
+{
+
+	rb_erase(&region->cache_node, &ctx->dma_cache);
+	RB_CLEAR_NODE(&region->cache_node);
+
+	if (!atomic_read(&region->refcount)) {
+		afu_dma_region_remove(ctx, region);
+		list_move_tail(&region->lru, release);
+	}
+}
+
+static void afu_dma_cache_release(struct dfl_afu_ctx *ctx,
+				  struct list_head *release)
+{
+	struct dfl_afu_dma_region *region, *tmp;
+
+	list_for_each_entry_safe(region, tmp, release, lru)
+		afu_dma_region_release(ctx, region);
+}
+
+#ifdef DFL_AFU_DMA_ONDEMAND
+static int afu_dma_map_pages(struct dfl_afu_ctx *ctx,
+			     struct dfl_afu_dma_region *region);
+
+/**
+ * afu_dma_ondemand_fault - fault in the pages of an on-demand region
+ * @new: temporary region to record the pages in
+ * @mni: notifier of the user range of the on-demand region
+ * @seq: notifier sequence read before the pages are looked up
+ *
+ * The range is faulted in by hmm_range_fault() in batches, so the pfns of a
+ * batch fit in one page. The pages stay valid until @mni is invalidated after
+ * @seq, which has to be checked under ctx->dma_notifier_lock before they are
+ * used.
+ *
+ * Return 0 for success, -EAGAIN if the range was invalidated meanwhile,
+ * otherwise error code.
+ */
+static int afu_dma_ondemand_fault(struct dfl_afu_dma_region *new,
+				  struct mmu_interval_notifier *mni,
+				  unsigned long seq)
+{
+	unsigned long npages = PFN_DOWN(new->length), done, n, i;
+	struct hmm_range range = {
+		.notifier = mni,
+		.notifier_seq = seq,
+		.default_flags = HMM_PFN_REQ_FAULT,
+	};
+	int ret = 0;
+
+	if (new->direction != DMA_TO_DEVICE)
+		range.default_flags |= HMM_PFN_REQ_WRITE;
+
+	range.hmm_pfns = (unsigned long *)__get_free_page(GFP_KERNEL);
+	if (!range.hmm_pfns)
+		return -ENOMEM;
+
+	for (done = 0; done < npages; done += n) {
+		n = min_t(unsigned long, npages - done,
+			  PAGE_SIZE / sizeof(*range.hmm_pfns));
+		range.start = new->user_addr + (done << PAGE_SHIFT);
+		range.end = range.start + (n << PAGE_SHIFT);
+
+		mmap_read_lock(new->mm);
+		ret = hmm_range_fault(&range);
+		mmap_read_unlock(new->mm);
+		if (ret) {
+			if (ret == -EBUSY)
+				ret = -EAGAIN;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			ret = afu_dma_runs_add(new,
+				page_to_pfn(hmm_pfn_to_page(range.hmm_pfns[i])), 1);
+			if (ret)
+				break;
+		}
+		if (ret)
+			break;
+	}
+
+	free_page((unsigned long)range.hmm_pfns);
+	if (ret)
+		afu_dma_ondemand_forget(new, false);
+
+	return ret;
+}
+
+/**
+ * afu_dma_ondemand_commit - make newly mapped pages the pages of a region
+ * @ctx: port file context
+ * @region: on-demand dma region without mapped pages
+ * @new: temporary region with the newly faulted in and mapped pages
+ * @remap: @region was mapped before, the AFU has been given its iova
+ *
+ * Return 0 for success, -EADDRNOTAVAIL if the pages of a remapped region
+ * are not mapped at its iova.
+ *
+ * Needs to be called with ctx->dma_notifier_lock held.
+ */
+static int afu_dma_ondemand_commit(struct dfl_afu_ctx *ctx,
+				   struct dfl_afu_dma_region *region,
+				   struct dfl_afu_dma_region *new, bool remap)
+{
+	if (remap && new->iova != region->iova)
+		return -EADDRNOTAVAIL;
+
+	region->iova = new->iova;
+	region->runs = new->runs;
+	region->nr_runs = new->nr_runs;
+	region->max_runs = new->max_runs;
+	region->sgt = new->sgt;
+	region->mapped = true;
+
+	if (remap) {
+		ctx->dma_ondemand_unmapped--;
+		afu_dma_ondemand_resume(ctx);
+	}
+
+	return 0;
+}
+
+/**
+ * afu_dma_ondemand_map - fault in and map the pages of an on-demand region
+ * @ctx: port file context
+ * @region: on-demand dma region without mapped pages
+ * @remap: @region was mapped before, see afu_dma_ondemand_commit()
+ *
+ * The pages are faulted in and mapped without any lock held, as faulting
+ * takes mmap_lock, and mmap() takes ctx->dma_lock and fdata->lock under it.
+ * They are only committed to @region if its user range has not been
+ * invalidated meanwhile, otherwise they are dropped and the range is faulted
+ * in again.
+ *
+ * Needs a reference on the address space of @region.
+ * Return 0 for success, otherwise error code.
+ */
+static int afu_dma_ondemand_map(struct dfl_afu_ctx *ctx,
+				struct dfl_afu_dma_region *region, bool remap)
+{
+	struct dfl_afu_dma_region *new;
+	unsigned long seq;
+	int ret;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	new->user_addr = region->user_addr;
+	new->length = region->length;
+	new->direction = region->direction;
+	new->mm = region->mm;
+
+	do {
+		seq = mmu_interval_read_begin(&region->notifier);
+
+		ret = afu_dma_ondemand_fault(new, &region->notifier, seq);
+		if (ret == -EAGAIN)
+			continue;
+		if (ret)
+			break;
+
+		ret = afu_dma_map_pages(ctx, new);
+		if (ret) {
+			afu_dma_ondemand_forget(new, false);
+			break;
+		}
+
+		mutex_lock(&ctx->dma_notifier_lock);
+		if (mmu_interval_read_retry(&region->notifier, seq))
+			ret = -EAGAIN;
+		else
+			ret = afu_dma_ondemand_commit(ctx, region, new, remap);
+		mutex_unlock(&ctx->dma_notifier_lock);
+
+		if (!ret)
+			break;
+
+		afu_dma_unmap(ctx, new);
+		afu_dma_ondemand_forget(new, false);
+	} while (ret == -EAGAIN);
+
+	kfree(new);
+
+	return ret;
+}
+
+/**
+ * afu_dma_ondemand_remap - remap an invalidated on-demand region
+ * @ctx: port file context
+ * @region: on-demand dma region without mapped pages
+ *
+ * The AFU has been given the iova of the region, so the region only stays
+ * valid if its new pages are mapped at the same iova. Otherwise it is marked
+ * invalid, and the port stays in reset until the region is released by
+ * afu_dma_unmap_region().
+ *
+ * Needs to be called with ctx->dma_remap_lock held.
+ */
+static void afu_dma_ondemand_remap(struct dfl_afu_ctx *ctx,
+				   struct dfl_afu_dma_region *region)
+{
+	int ret = -ESRCH;
+
+	if (mmget_not_zero(region->mm)) {
+		ret = afu_dma_ondemand_map(ctx, region, true);
+		mmput(region->mm);
+	}
+
+	if (!ret)
+		return;
+
+	dev_warn(&ctx->fdata->dev->dev,
+		 "on-demand region (iova = %llx) can't be remapped: %d\n",
+		 region->iova, ret);
+
+	mutex_lock(&ctx->dma_notifier_lock);
+	region->invalid = true;
+	mutex_unlock(&ctx->dma_notifier_lock);
+}
+
+/**
+ * afu_dma_ondemand_next - find an on-demand region to be remapped
+ * @ctx: port file context
+ *
+ * Return the region, or NULL if all valid on-demand regions are mapped.
+ */
+static struct dfl_afu_dma_region *
+afu_dma_ondemand_next(struct dfl_afu_ctx *ctx)
+{
+	struct dfl_afu_dma_region *region = NULL;
+	struct rb_node *node;
+
+	down_read(&ctx->dma_lock);
+	mutex_lock(&ctx->dma_notifier_lock);
+	for (node = rb_first(&ctx->dma_regions); node; node = rb_next(node)) {
+		region = container_of(node, struct dfl_afu_dma_region, node);
+
+		if (region->ondemand && !region->mapped && !region->invalid)
+			break;
+
+		region = NULL;
+	}
+	mutex_unlock(&ctx->dma_notifier_lock);
+	up_read(&ctx->dma_lock);
+
+	return region;
+}
+
+/**
+ * afu_dma_ondemand_work - remap the invalidated on-demand regions
+ * @ctx: port file context
+ *
+ * A region stays valid after it is found in the rbtree while
+ * ctx->dma_remap_lock is held, as afu_dma_ondemand_release() takes it too.
+ */
+static void afu_dma_ondemand_work(struct dfl_afu_ctx *ctx)
+{
+	struct dfl_afu_dma_region *region;
+
+	mutex_lock(&ctx->dma_remap_lock);
+	while ((region = afu_dma_ondemand_next(ctx)))
+		afu_dma_ondemand_remap(ctx, region);
+	mutex_unlock(&ctx->dma_remap_lock);
+}
+
+/**
+ * afu_dma_ondemand_release - unmap an on-demand region
+ * @ctx: port file context
+ * @region: on-demand dma region, not in any rbtree
+ *
+ * Lets the port out of reset if this was the last on-demand region without
+ * mapped pages.
+ */
+static void afu_dma_ondemand_release(struct dfl_afu_ctx *ctx,
+				     struct dfl_afu_dma_region *region)
+{
+	/* no remap or invalidation of the region runs after this */
+	mutex_lock(&ctx->dma_remap_lock);
+	mmu_interval_notifier_remove(&region->notifier);
+
+	mutex_lock(&ctx->dma_notifier_lock);
+	if (region->mapped) {
+		afu_dma_unmap(ctx, region);
+		afu_dma_ondemand_forget(region, true);
+	} else {
+		ctx->dma_ondemand_unmapped--;
+		afu_dma_ondemand_resume(ctx);
+	}
+	mutex_unlock(&ctx->dma_notifier_lock);
+	mutex_unlock(&ctx->dma_remap_lock);
+
+	mmdrop(region->mm);
+}
+
+/**
+ * afu_dma_ondemand_register - start tracking the user range of an on-demand
+ *			       dma region
+ * @ctx: port file context
+ * @region: dma region, not pinned yet
+ *
+ * An invalidation of the region holds the whole port in reset, so on-demand
+ * regions are only allowed on a port opened exclusively by this context. The
+ * exclusive open can't go away while this context is open.
+ *
+ * Return 0 for success, -EBUSY if the port is not opened exclusively,
+ * otherwise error code.
+ */
+static int afu_dma_ondemand_register(struct dfl_afu_ctx *ctx,
+				     struct dfl_afu_dma_region *region)
+{
+	if (!READ_ONCE(ctx->fdata->excl_open))
+		return -EBUSY;
+
+	/* the notifier may be called as soon as it is inserted */
+	region->ctx = ctx;
+	region->ondemand = true;
+
+	return mmu_interval_notifier_insert(&region->notifier, region->mm,
+					    region->user_addr, region->length,
+					    &afu_dma_ondemand_ops);
+}
+
+#else /* DFL_AFU_DMA_ONDEMAND */
+
+static void afu_dma_ondemand_work(struct dfl_afu_ctx *ctx)
+{
+}
+
+static void afu_dma_ondemand_release(struct dfl_afu_ctx *ctx,
+				     struct dfl_afu_dma_region *region)
+{
+}
+
+static int afu_dma_ondemand_register(struct dfl_afu_ctx *ctx,
+				     struct dfl_afu_dma_region *region)
+{
+	return -EOPNOTSUPP;
+}
+
+static int afu_dma_ondemand_map(struct dfl_afu_ctx *ctx,
+				struct dfl_afu_dma_region *region, bool remap)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* DFL_AFU_DMA_ONDEMAND */
+
+static void afu_dma_cache_work(struct work_struct *work)
+{
+	struct dfl_afu_ctx *ctx = container_of(work, struct dfl_afu_ctx,
+					       dma_cache_work);
+	struct dfl_afu_dma_region *region;
+	struct rb_node *node;
+	LIST_HEAD(release);
+
+	afu_dma_ondemand_work(ctx);
+
+	down_write(&ctx->dma_lock);
+	node = rb_first(&ctx->dma_cache);
+	while (node) {
+		region = rb_entry(node, struct dfl_afu_dma_region, cache_node);
+		node = rb_next(node);
+
+		if (afu_dma_cache_stale(region))
+			afu_dma_cache_drop(ctx, region, &release);
+	}
+	up_write(&ctx->dma_lock);
+
+	afu_dma_cache_release(ctx, &release);
+}
+
+/**
+ * afu_dma_cache_evict - release all idle cached dma regions
+ * @ctx: port file context
+ *
+ * Return true if any region is released.
+ */
+static bool afu_dma_cache_evict(struct dfl_afu_ctx *ctx)
+{
+	struct dfl_afu_dma_region *region, *tmp;
+	LIST_HEAD(release);
+
+	down_write(&ctx->dma_lock);
+	list_for_each_entry_safe(region, tmp, &ctx->dma_cache_idle, lru)
+		afu_dma_cache_drop(ctx, region, &release);
+	up_write(&ctx->dma_lock);
+
+	if (list_empty(&release))
+		return false;
+
+	dev_dbg(&ctx->fdata->dev->dev, "evict idle cached regions\n");
+	afu_dma_cache_release(ctx, &release);
+
+	return true;
+}
+
+/**
+ * afu_dma_cache_hold - take a reference on a cached dma region
+ * @region: dma region
+ *
+ * Concurrent holders only serialize on dma_cache_lock when the region is
+ * idle, to take it off the idle list.
+ *
+ * Needs to be called with ctx->dma_lock held for read or write.
+ */
+static void afu_dma_cache_hold(struct dfl_afu_dma_region *region)
+{
+	struct dfl_afu_ctx *ctx = region->ctx;
+
+	if (!region->cache || atomic_inc_not_zero(&region->refcount))
+		return;
+
+	spin_lock(&ctx->dma_cache_lock);
+	if (atomic_inc_return(&region->refcount) == 1)
+		list_del_init(&region->lru);
+	spin_unlock(&ctx->dma_cache_lock);
+}
+
+/**
+ * afu_dma_cache_lookup - find a cached dma region and take a reference on it
+ * @ctx: port file context
+ * @user_addr: address of the memory region
+ * @length: size of the memory region
+ * @direction: dma data direction
+ *
+ * Return the cached region, or NULL if the user range is not cached. A stale
+ * region is left to the cache work, which has been scheduled by its
+ * invalidation.
+ *
+ * Needs to be called with ctx->dma_lock held for read or write.
+ */
+static struct dfl_afu_dma_region *
+afu_dma_cache_lookup(struct dfl_afu_ctx *ctx, u64 user_addr,
+		     u64 length, enum dma_data_direction direction)
+{
+	struct dfl_afu_dma_region *region;
+
+	region = afu_dma_cache_find(ctx, current->mm, user_addr, length,
+				    direction);
+	if (!region || afu_dma_cache_stale(region))
+		return NULL;
+
+	afu_dma_cache_hold(region);
+
+	return region;
+}
+
+/**
+ * afu_dma_cache_put - drop a reference on a cached dma region
+ * @ctx: port file context
+ * @region: dma region
+ *
+ * Return 1 if the region stays mapped, 0 if it has to be released, or
+ * -EINVAL if it is an idle cached region.
+ *
+ * Needs to be called with ctx->dma_lock held for write.
+ */
+static int afu_dma_cache_put(struct dfl_afu_ctx *ctx,
+			     struct dfl_afu_dma_region *region)
+{
+
+	if (!region->cache)
+		return 0;
+
+	if (!atomic_read(&region->refcount))
+		return -EINVAL;
+
+	if (!atomic_dec_and_test(&region->refcount))
+		return 1;
+
+	if (RB_EMPTY_NODE(&region->cache_node))
+		return 0;
+
+	list_add_tail(&region->lru, &ctx->dma_cache_idle);
+
+	return 1;
+}
+
+/**
+ * afu_dma_cache_register - start tracking the user range of a new dma region
+ * @ctx: port file context
+ * @region: dma region, not pinned yet
+ *
+ * Return 0 for success, otherwise error code.
+ */
+static int afu_dma_cache_register(struct dfl_afu_ctx *ctx,
+				  struct dfl_afu_dma_region *region)
+{
+	int ret;
+
+	/* the notifier may be called as soon as it is inserted */
+	region->ctx = ctx;
+	region->cache = true;
+	atomic_set(&region->refcount, 1);
+	RB_CLEAR_NODE(&region->cache_node);
+	INIT_LIST_HEAD(&region->lru);
+
+	ret = mmu_interval_notifier_insert(&region->notifier, region->mm,
+					   region->user_addr, region->length,
+					   &afu_dma_cache_ops);
+	if (ret)
+		return ret;
+
+	region->notifier_seq = mmu_interval_read_begin(&region->notifier);
+
+	return 0;
+}
+
+/**
+ * afu_dma_cache_insert - add a new mapped dma region to the cache
+ * @ctx: port file context
+ * @region: dma region
+ *
+ * The region stays uncached if its user range has changed since it was
+ * registered, or if the same range has been cached meanwhile. An on-demand
+ * region which has been invalidated since it was mapped is remapped by the
+ * cache work, which may have missed it while it was not in the rbtree yet.
+ *
+ * Needs to be called with ctx->dma_lock held for write.
+ */
+static void afu_dma_cache_insert(struct dfl_afu_ctx *ctx,
+				 struct dfl_afu_dma_region *region)
+{
+	if (region->ondemand) {
+		mutex_lock(&ctx->dma_notifier_lock);
+		if (!region->mapped)
+			schedule_work(&ctx->dma_cache_work);
+		mutex_unlock(&ctx->dma_notifier_lock);
+	}
+
+	if (region->cache && !afu_dma_cache_stale(region))
+		afu_dma_cache_add(ctx, region);
+}
+
+#else /* DFL_AFU_DMA_CACHE */
+
+static void afu_dma_cache_hold(struct dfl_afu_dma_region *region)
+{
+}
+
+static struct dfl_afu_dma_region *
+afu_dma_cache_lookup(struct dfl_afu_ctx *ctx, u64 user_addr,
+		     u64 length, enum dma_data_direction direction)
+{
+	return NULL;
+}
+
+static int afu_dma_cache_put(struct dfl_afu_ctx *ctx,
+			     struct dfl_afu_dma_region *region)
+{
+	return 0;
+}
+
+static bool afu_dma_cache_evict(struct dfl_afu_ctx *ctx)
+{
+	return false;
+}
+
+static int afu_dma_cache_register(struct dfl_afu_ctx *ctx,
+				  struct dfl_afu_dma_region *region)
+{
+	return -EOPNOTSUPP;
+}
+
+static int afu_dma_ondemand_register(struct dfl_afu_ctx *ctx,
+				     struct dfl_afu_dma_region *region)
+{
+	return -EOPNOTSUPP;
+}
+
+static int afu_dma_ondemand_map(struct dfl_afu_ctx *ctx,
+				struct dfl_afu_dma_region *region, bool remap)
+{
+	return -EOPNOTSUPP;
+}
+
+static void afu_dma_ondemand_release(struct dfl_afu_ctx *ctx,
+				     struct dfl_afu_dma_region *region)
+{
+}
+
+static void afu_dma_cache_insert(struct dfl_afu_ctx *ctx,
+				 struct dfl_afu_dma_region *region)
+{
+}
+
+#endif /* DFL_AFU_DMA_CACHE */
+
+#ifdef DFL_AFU_SVA
+/**
+ * __afu_dma_sva_bound - check if the address space of current is bound
+ * @ctx: port file context
+ *
+ * The AFU accesses a bound address space by virtual address, tagged with the
+ * PASID of the binding, so its memory needs neither pinning nor dma mapping.
+ *
+ * Needs to be called with ctx->dma_lock held for read or write.
+ */
+static bool __afu_dma_sva_bound(struct dfl_afu_ctx *ctx)
+{
+	return ctx->sva && ctx->sva_mm == current->mm;
+}
+
+/**
+ * afu_dma_sva_bind - bind the address space of current to the context
+ * @ctx: port file context
+ * @pasid: pointer of the PASID of the binding
+ *
+ * The binding is kept until the device fd is closed. Binding the same
+ * address space again only returns its PASID.
+ * Return 0 for success, -EBUSY if another address space is bound already,
+ * otherwise error code.
+ */
+int afu_dma_sva_bind(struct dfl_afu_ctx *ctx, u32 *pasid)
+{
+	struct device *parent = dfl_fpga_fdata_to_parent(ctx->fdata);
+	struct iommu_sva *handle;
+	int ret = 0;
+
+	if (!current->mm)
+		return -EINVAL;
+
+	/*
+	 * The binding takes mmap_lock, and mmap() takes dma_lock under it, so
+	 * the address space is bound before dma_lock is taken. A binding that
+	 * lost the race with another one is dropped again.
+	 */
+	handle = iommu_sva_bind_device(parent, current->mm);
+	if (IS_ERR_OR_NULL(handle))
+		return handle ? PTR_ERR(handle) : -ENODEV;
+
+	down_write(&ctx->dma_lock);
+	if (ctx->sva) {
+		if (ctx->sva_mm != current->mm)
+			ret = -EBUSY;
+		goto out;
+	}
+
+	mmgrab(current->mm);
+	ctx->sva_mm = current->mm;
+	ctx->sva = handle;
+	handle = NULL;
+
+	dev_dbg(&ctx->fdata->dev->dev, "bind pid %d, pasid = %u\n",
+		task_pid_nr(current), (u32)iommu_sva_get_pasid(ctx->sva));
+out:
+	if (!ret)
+		*pasid = iommu_sva_get_pasid(ctx->sva);
+	up_write(&ctx->dma_lock);
+
+	if (handle)
+		iommu_sva_unbind_device(handle);
+
+	return ret;
+}
+
+/**
+ * afu_dma_sva_get_pasid - get the PASID of the context
+ * @ctx: port file context
+ * @pasid: pointer of the PASID of the binding
+ *
+ * Return 0 for success, -ENODEV if no address space is bound.
+ */
+int afu_dma_sva_get_pasid(struct dfl_afu_ctx *ctx, u32 *pasid)
+{
+	int ret = -ENODEV;
+
+	down_read(&ctx->dma_lock);
+	if (ctx->sva) {
+		*pasid = iommu_sva_get_pasid(ctx->sva);
+		ret = 0;
+	}
+	up_read(&ctx->dma_lock);
+
+	return ret;
+}
+
+/**
+ * __afu_dma_sva_addr - check if an iova is memory of the bound address space
+ * @ctx: port file context
+ * @iova: dma address
+ *
+ * DMA map requests of a bound address space return the page aligned user
+ * address as iova, anything else was never mapped.
+ *
+ * Needs to be called with ctx->dma_lock held for read or write.
+ */
+static bool __afu_dma_sva_addr(struct dfl_afu_ctx *ctx, u64 iova)
+{
+	return __afu_dma_sva_bound(ctx) && PAGE_ALIGNED(iova) &&
+	       iova < TASK_SIZE;
+}
+
+/*
+ * Check if any address space is bound to the context.
+ * Needs to be called with ctx->dma_lock held for read or write.
+ */
+static bool afu_dma_sva_used(struct dfl_afu_ctx *ctx)
+{
+	return ctx->sva;
+}
+
+/*
+ * The AFU has to stop using the PASID before it is released, the port is
+ * held in reset for that by the last user, see afu_dma_region_destroy().
+ */
+static void afu_dma_sva_unbind(struct dfl_afu_ctx *ctx)
+{
+	if (!ctx->sva)
+		return;
+
+	iommu_sva_unbind_device(ctx->sva);
+	mmdrop(ctx->sva_mm);
+	ctx->sva = NULL;
+	ctx->sva_mm = NULL;
+}
+#else
+static bool __afu_dma_sva_bound(struct dfl_afu_ctx *ctx)
+{
+	return false;
+}
+
+int afu_dma_sva_bind(struct dfl_afu_ctx *ctx, u32 *pasid)
+{
+	return -EOPNOTSUPP;
+}
+
+int afu_dma_sva_get_pasid(struct dfl_afu_ctx *ctx, u32 *pasid)
+{
+	return -ENODEV;
+}
+
+static bool __afu_dma_sva_addr(struct dfl_afu_ctx *ctx, u64 iova)
+{
+	return false;
+}
+
+static bool afu_dma_sva_used(struct dfl_afu_ctx *ctx)
+{
+	return false;
+}
+
+static void afu_dma_sva_unbind(struct dfl_afu_ctx *ctx)
+{
+}
+#endif /* DFL_AFU_SVA */
+
+static bool afu_dma_sva_bound(struct dfl_afu_ctx *ctx)
+{
+	bool bound;
+
+	down_read(&ctx->dma_lock);
+	bound = __afu_dma_sva_bound(ctx);
+	up_read(&ctx->dma_lock);
+
+	return bound;
+}
+
+void afu_dma_region_init(struct dfl_afu_ctx *ctx)
+{
+	ctx->dma_regions = RB_ROOT;
+	ctx->dma_alloc_regions = RB_ROOT;
+	init_rwsem(&ctx->dma_lock);
+	ctx->dma_alloc_offset = AFU_DMA_ALLOC_OFFSET;
+#ifdef DFL_AFU_DMA_CACHE
+	spin_lock_init(&ctx->dma_cache_lock);
+	mutex_init(&ctx->dma_notifier_lock);
+	mutex_init(&ctx->dma_remap_lock);
+	ctx->dma_cache = RB_ROOT;
+	INIT_LIST_HEAD(&ctx->dma_cache_idle);
+	INIT_WORK(&ctx->dma_cache_work, afu_dma_cache_work);
+#endif
+}
+
+/**
+ * afu_dma_region_destroy - destroy all regions in rbtree
+ * @ctx: port file context
+ * @quiesce: hold the port in reset while the regions are torn down
+ *
+ * The regions are taken out of the rbtree under ctx->dma_lock and released
+ * after it is dropped. The last user of the port holds it in reset while its
+ * regions and SVA binding are torn down, so the AFU can't access them anymore
+ * once they are unmapped. Other users of the port would lose their dma to the
+ * reset, so the regions of any other context are only unmapped: the AFU must
+ * have stopped using them, further accesses fault in the iommu.
+ *
+ * Needs to be called without fdata->lock held: the release of an on-demand
+ * region waits for the remap work, which pins pages under mmap_lock, and
+ * mmap() takes fdata->lock under mmap_lock.
+ */
+void afu_dma_region_destroy(struct dfl_afu_ctx *ctx, bool quiesce)
+{
+	struct dfl_feature_dev_data *fdata = ctx->fdata;
+	struct dfl_afu_dma_region *region;
+	struct rb_root regions;
+	struct rb_node *node;
+
+	down_write(&ctx->dma_lock);
+	quiesce &= !RB_EMPTY_ROOT(&ctx->dma_regions) || afu_dma_sva_used(ctx);
+	if (quiesce && __afu_port_disable(fdata))
+		dev_warn(&fdata->dev->dev, "failed to quiesce port for dma teardown\n");
+
+	regions = ctx->dma_regions;
+	ctx->dma_regions = RB_ROOT;
+	ctx->dma_alloc_regions = RB_ROOT;
+	ctx->dma_nr_regions = 0;
+#ifdef DFL_AFU_DMA_CACHE
+	ctx->dma_cache = RB_ROOT;
+	INIT_LIST_HEAD(&ctx->dma_cache_idle);
+#endif
+	afu_dma_sva_unbind(ctx);
+	up_write(&ctx->dma_lock);
+
+	while ((node = rb_first(&regions))) {
+		region = container_of(node, struct dfl_afu_dma_region, node);
+
+		dev_dbg(&ctx->fdata->dev->dev, "del region (iova = %llx)\n",
+			region->iova);
+
+		rb_erase(&region->node, &regions);
+		afu_dma_region_release(ctx, region);
+	}
+
+	if (quiesce)
+		__afu_port_enable(fdata);
+}
+
+/**
+ * afu_dma_region_flush - wait for pending registration cache updates
+ * @ctx: port file context
+ *
+ * Needs to be called after afu_dma_region_destroy() and before the afu
+ * context is freed, without fdata->lock or dma_lock held.
+ */
+void afu_dma_region_flush(struct dfl_afu_ctx *ctx)
+{
+#ifdef DFL_AFU_DMA_CACHE
+	cancel_work_sync(&ctx->dma_cache_work);
+#endif
+}
+
+/**
+ * afu_dma_region_find - find the dma region from rbtree based on iova and size
+ * @ctx: port file context
+ * @iova: address of the dma memory area
+ * @size: size of the dma memory area
+ *
+ * It finds the dma region from the rbtree based on @iova and @size:
+ * - if @size == 0, it finds the dma region which starts from @iova
+ * - otherwise, it finds the dma region which fully contains
+ *   [@iova, @iova+size)
+ * If nothing is matched returns NULL.
+ *
+ * Needs to be called with ctx->dma_lock held for read or write.
+ */
+struct dfl_afu_dma_region *
+afu_dma_region_find(struct dfl_afu_ctx *ctx, u64 iova, u64 size)
+{
+	struct rb_node *node = ctx->dma_regions.rb_node;
+	struct device *dev = &ctx->fdata->dev->dev;
+
+	while (node) {
+		struct dfl_afu_dma_region *region;
+
+		region = container_of(node, struct dfl_afu_dma_region, node);
+
+		if (dma_region_check_iova(region, iova, size)) {
+			dev_dbg(dev, "find region (iova = %llx)\n",
+				region->iova);
+			return region;
+		}
+
+		if (iova < region->iova)
+			node = node->rb_left;
+		else if (iova > region->iova)
+			node = node->rb_right;
+		else
+			/* the iova region is not fully covered. */
+			break;
+	}
+
+	dev_dbg(dev, "region with iova %llx and size %llx is not found\n", iova,
+		size);
+
+	return NULL;
+}
+
+/**
+ * afu_dma_region_find_iova - find the dma region from rbtree by iova
+ * @ctx: port file context
+ * @iova: address of the dma region
+ *
+ * Needs to be called with ctx->dma_lock held for read or write.
+ */
+static struct dfl_afu_dma_region *
+afu_dma_region_find_iova(struct dfl_afu_ctx *ctx, u64 iova)
+{
+	return afu_dma_region_find(ctx, iova, 0);
+}
 
 static enum dma_data_direction dma_flag_to_dir(u32 flags)
 {
@@ -366,125 +1864,1132 @@ static enum dma_data_direction dma_flag_to_dir(u32 flags)
 		return DMA_FROM_DEVICE;
 	}
 
-	return DMA_BIDIRECTIONAL;
+	return DMA_BIDIRECTIONAL;
+}
+
+/**
+ * afu_dma_region_check - check user memory region to be mapped
+ * @user_addr: address of the memory region
+ * @length: size of the memory region
+ * @flags: dma mapping flags
+ *
+ * Only accept page-aligned user memory region with valid length.
+ * Return 0 for success, otherwise error code.
+ */
+static int afu_dma_region_check(u64 user_addr, u64 length, u32 flags)
+{
+	u32 mask = DFL_DMA_MAP_FLAG_READ | DFL_DMA_MAP_FLAG_WRITE |
+		   DFL_DMA_MAP_FLAG_CACHE | DFL_DMA_MAP_FLAG_ONDEMAND;
+
+	if (flags & ~mask)
+		return -EINVAL;
+
+	/* an on-demand region is never cached */
+	if ((flags & DFL_DMA_MAP_FLAG_CACHE) &&
+	    (flags & DFL_DMA_MAP_FLAG_ONDEMAND))
+		return -EINVAL;
+
+	if (!PAGE_ALIGNED(user_addr) || !PAGE_ALIGNED(length) || !length)
+		return -EINVAL;
+
+	/* Check overflow */
+	if (user_addr + length < user_addr)
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * afu_dma_map_pages - map pages of given dma region for dma
+ * @ctx: port file context
+ * @region: dma region
+ *
+ * Return 0 for success, otherwise error code.
+ */
+static int afu_dma_map_pages(struct dfl_afu_ctx *ctx,
+			     struct dfl_afu_dma_region *region)
+{
+	struct device *parent = dfl_fpga_fdata_to_parent(ctx->fdata);
+	struct page *page;
+
+	/* Pages which are not continuous are mapped as a scatterlist */
+	if (!afu_dma_check_continuous_pages(region))
+		return afu_dma_map_sg(ctx, region);
+
+	/* As pages are continuous then map them as a whole */
+	page = pfn_to_page(afu_dma_run_pfn(region->runs[0]));
+	region->iova = dma_map_page(parent, page, 0, region->length,
+				    region->direction);
+	if (dma_mapping_error(parent, region->iova)) {
+		dev_err(&ctx->fdata->dev->dev, "failed to map for dma\n");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/**
+ * afu_dma_region_create - pin and map a new dma region
+ * @ctx: port file context
+ * @user_addr: address of the memory region
+ * @length: size of the memory region
+ * @flags: dma mapping flags
+ * @pregion: pointer of the new dma region, not added to the rbtree yet
+ *
+ * Return 0 for success, otherwise error code.
+ */
+static int afu_dma_region_create(struct dfl_afu_ctx *ctx,
+				 u64 user_addr, u64 length, u32 flags,
+				 struct dfl_afu_dma_region **pregion)
+{
+	struct device *dev = &ctx->fdata->dev->dev;
+	struct dfl_afu_dma_region *region;
+	ktime_t start = ktime_get();
+	int ret;
+
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if (!region)
+		return -ENOMEM;
+
+	region->user_addr = user_addr;
+	region->length = length;
+	region->direction = dma_flag_to_dir(flags);
+	region->mm = current->mm;
+	mmgrab(region->mm);
+
+	if (flags & DFL_DMA_MAP_FLAG_CACHE) {
+		ret = afu_dma_cache_register(ctx, region);
+		if (ret)
+			goto drop_mm;
+	} else if (flags & DFL_DMA_MAP_FLAG_ONDEMAND) {
+		ret = afu_dma_ondemand_register(ctx, region);
+		if (ret)
+			goto drop_mm;
+	}
+
+	if (region->ondemand) {
+		/* pinned and mapped against concurrent invalidations */
+		ret = afu_dma_ondemand_map(ctx, region, false);
+		if (ret) {
+			dev_err(dev, "failed to map on-demand memory region\n");
+			goto unregister;
+		}
+	} else {
+		/*
+		 * Pin the user memory region, release idle cached regions and
+		 * retry if the locked memory limit is reached.
+		 */
+		ret = afu_dma_pin_pages(ctx, region);
+		if (ret == -ENOMEM && afu_dma_cache_evict(ctx))
+			ret = afu_dma_pin_pages(ctx, region);
+		if (ret) {
+			dev_err(dev, "failed to pin memory region\n");
+			goto unregister;
+		}
+
+		ret = afu_dma_map_pages(ctx, region);
+		if (ret)
+			goto unpin_pages;
+	}
+
+	dev_dbg(dev, "%llu bytes mapped in %lld us\n", length,
+		ktime_us_delta(ktime_get(), start));
+
+	*pregion = region;
+
+	return 0;
+
+unpin_pages:
+	afu_dma_unpin_pages(ctx, region);
+unregister:
+	afu_dma_cache_unregister(region);
+drop_mm:
+	mmdrop(region->mm);
+	kfree(region);
+	return ret;
+}
+
+/**
+ * afu_dma_map_region - map memory region for dma
+ * @ctx: port file context
+ * @user_addr: address of the memory region
+ * @length: size of the memory region
+ * @flags: dma mapping flags
+ * @iova: pointer of iova address
+ *
+ * Map memory region defined by @user_addr and @length, and return dma address
+ * of the memory region via @iova.
+ * Return 0 for success, otherwise error code.
+ */
+int afu_dma_map_region(struct dfl_afu_ctx *ctx,
+		       u64 user_addr, u64 length, u32 flags, u64 *iova)
+{
+	struct device *dev = &ctx->fdata->dev->dev;
+	struct dfl_afu_dma_region *region;
+	int ret;
+
+	ret = afu_dma_region_check(user_addr, length, flags);
+	if (ret)
+		return ret;
+
+	if (afu_dma_sva_bound(ctx)) {
+		/* only user memory is shared with the device */
+		if (user_addr + length > TASK_SIZE)
+			return -EINVAL;
+
+		*iova = user_addr;
+		return 0;
+	}
+
+	/* A cached region is mapped already */
+	if (flags & DFL_DMA_MAP_FLAG_CACHE) {
+		down_read(&ctx->dma_lock);
+		region = afu_dma_cache_lookup(ctx, user_addr, length,
+					      dma_flag_to_dir(flags));
+		if (region)
+			*iova = region->iova;
+		up_read(&ctx->dma_lock);
+
+		if (region)
+			return 0;
+	}
+
+	ret = afu_dma_region_create(ctx, user_addr, length, flags, &region);
+	if (ret)
+		return ret;
+
+	*iova = region->iova;
+
+	down_write(&ctx->dma_lock);
+	ret = afu_dma_region_add(ctx, region);
+	if (!ret)
+		afu_dma_cache_insert(ctx, region);
+	up_write(&ctx->dma_lock);
+	if (ret) {
+		dev_err(dev, "failed to add dma region\n");
+		afu_dma_region_release(ctx, region);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * afu_dma_map_regions - map a batch of memory regions for dma
+ * @ctx: port file context
+ * @entries: memory regions to be mapped
+ * @count: number of @entries
+ *
+ * Map all memory regions of @entries, and return their dma addresses via
+ * entries[].iova. Either all regions are mapped, or none: on failure, the
+ * result of the entry which failed is its error code and the result of all
+ * other entries is -ECANCELED.
+ * Return 0 for success, otherwise error code.
+ */
+int afu_dma_map_regions(struct dfl_afu_ctx *ctx,
+			struct dfl_fpga_port_dma_map_entry *entries, u32 count)
+{
+	struct dfl_afu_dma_region **regions;
+	struct device *dev = &ctx->fdata->dev->dev;
+	unsigned long *created;
+	u32 i, failed = 0;
+	int ret = 0;
+
+	for (i = 0; i < count; i++)
+		entries[i].result = -ECANCELED;
+
+	for (i = 0; i < count; i++) {
+		ret = afu_dma_region_check(entries[i].user_addr,
+					   entries[i].length, entries[i].flags);
+		if (ret) {
+			entries[i].result = ret;
+			return ret;
+		}
+	}
+
+	if (afu_dma_sva_bound(ctx)) {
+		/* only user memory is shared with the device */
+		for (i = 0; i < count; i++) {
+			if (entries[i].user_addr + entries[i].length >
+			    TASK_SIZE) {
+				entries[i].result = -EINVAL;
+				return -EINVAL;
+			}
+		}
+
+		for (i = 0; i < count; i++) {
+			entries[i].iova = entries[i].user_addr;
+			entries[i].result = 0;
+		}
+		return 0;
+	}
+
+	regions = kvcalloc(count, sizeof(*regions), GFP_KERNEL);
+	if (!regions)
+		return -ENOMEM;
+
+	created = bitmap_zalloc(count, GFP_KERNEL);
+	if (!created) {
+		ret = -ENOMEM;
+		goto free_regions;
+	}
+
+	/* Cached regions are mapped already */
+	down_read(&ctx->dma_lock);
+	for (i = 0; i < count; i++) {
+		if (!(entries[i].flags & DFL_DMA_MAP_FLAG_CACHE))
+			continue;
+
+		regions[i] = afu_dma_cache_lookup(ctx, entries[i].user_addr,
+						  entries[i].length,
+						  dma_flag_to_dir(entries[i].flags));
+	}
+	up_read(&ctx->dma_lock);
+
+	for (i = 0; i < count; i++) {
+		if (regions[i])
+			continue;
+
+		ret = afu_dma_region_create(ctx, entries[i].user_addr,
+					    entries[i].length, entries[i].flags,
+					    &regions[i]);
+		if (ret) {
+			failed = i;
+			goto rollback;
+		}
+
+		__set_bit(i, created);
+	}
+
+	down_write(&ctx->dma_lock);
+	for_each_set_bit(i, created, count) {
+		ret = afu_dma_region_add(ctx, regions[i]);
+		if (ret) {
+			dev_err(dev, "failed to add dma region\n");
+			failed = i;
+			break;
+		}
+	}
+
+	if (ret) {
+		for_each_set_bit(i, created, failed)
+			afu_dma_region_remove(ctx, regions[i]);
+		up_write(&ctx->dma_lock);
+		goto rollback;
+	}
+
+	for_each_set_bit(i, created, count)
+		afu_dma_cache_insert(ctx, regions[i]);
+	up_write(&ctx->dma_lock);
+
+	for (i = 0; i < count; i++) {
+		entries[i].iova = regions[i]->iova;
+		entries[i].result = 0;
+	}
+
+	goto free_created;
+
+rollback:
+	entries[failed].result = ret;
+
+	down_write(&ctx->dma_lock);
+	for (i = 0; i < count; i++) {
+		if (!regions[i] || test_bit(i, created))
+			continue;
+
+		/* drop the references taken on cached regions */
+		if (!afu_dma_cache_put(ctx, regions[i])) {
+			afu_dma_region_remove(ctx, regions[i]);
+			__set_bit(i, created);
+		}
+	}
+	up_write(&ctx->dma_lock);
+
+	for_each_set_bit(i, created, count)
+		afu_dma_region_release(ctx, regions[i]);
+
+free_created:
+	bitmap_free(created);
+free_regions:
+	kvfree(regions);
+	return ret;
+}
+
+/**
+ * __afu_dma_unmap_region - drop a mapping of the dma region of given iova
+ * @ctx: port file context
+ * @iova: dma address of the region
+ * @pregion: pointer of the dma region
+ *
+ * Return 1 if the region is removed from the rbtree and has to be released,
+ * 0 if it stays mapped or if @iova is memory of a bound address space, which
+ * has no region, -EINVAL if @iova is neither.
+ *
+ * Needs to be called with ctx->dma_lock held for write.
+ */
+static int __afu_dma_unmap_region(struct dfl_afu_ctx *ctx,
+				  u64 iova, struct dfl_afu_dma_region **pregion)
+{
+	struct dfl_afu_dma_region *region;
+	int ret;
+
+	region = afu_dma_region_find_iova(ctx, iova);
+	if (!region) {
+		/* memory of a bound address space was never mapped */
+		*pregion = NULL;
+		return __afu_dma_sva_addr(ctx, iova) ? 0 : -EINVAL;
+	}
+
+	if (region->in_use)
+		return -EBUSY;
+
+	/* A cached region stays mapped after its last unmap */
+	ret = afu_dma_cache_put(ctx, region);
+	if (ret < 0)
+		return ret;
+
+	*pregion = region;
+	if (ret)
+		return 0;
+
+	afu_dma_region_remove(ctx, region);
+
+	return 1;
+}
+
+/**
+ * afu_dma_unmap_region - unmap dma memory region
+ * @ctx: port file context
+ * @iova: dma address of the region
+ *
+ * Unmap dma memory region based on @iova.
+ * Return 0 for success, otherwise error code.
+ */
+int afu_dma_unmap_region(struct dfl_afu_ctx *ctx, u64 iova)
+{
+	struct dfl_afu_dma_region *region;
+	int ret;
+
+	down_write(&ctx->dma_lock);
+	ret = __afu_dma_unmap_region(ctx, iova, &region);
+	up_write(&ctx->dma_lock);
+
+	if (ret <= 0)
+		return ret;
+
+	afu_dma_region_release(ctx, region);
+
+	return 0;
+}
+
+/**
+ * afu_dma_unmap_regions - unmap a batch of dma memory regions
+ * @ctx: port file context
+ * @entries: dma addresses of the regions
+ * @count: number of @entries
+ *
+ * Unmap the dma memory regions of all @entries. Either all regions are
+ * unmapped, or none: on failure, the result of the entry which failed is its
+ * error code and the result of all other entries is -ECANCELED.
+ * Return 0 for success, otherwise error code.
+ */
+int afu_dma_unmap_regions(struct dfl_afu_ctx *ctx,
+			  struct dfl_fpga_port_dma_unmap_entry *entries,
+			  u32 count)
+{
+	struct dfl_afu_dma_region **regions;
+	unsigned long *removed;
+	int ret = 0;
+	u32 i;
+
+	for (i = 0; i < count; i++)
+		entries[i].result = -ECANCELED;
+
+	regions = kvcalloc(count, sizeof(*regions), GFP_KERNEL);
+	if (!regions)
+		return -ENOMEM;
+
+	removed = bitmap_zalloc(count, GFP_KERNEL);
+	if (!removed) {
+		kvfree(regions);
+		return -ENOMEM;
+	}
+
+	down_write(&ctx->dma_lock);
+	for (i = 0; i < count; i++) {
+		ret = __afu_dma_unmap_region(ctx, entries[i].iova,
+					     &regions[i]);
+		if (ret < 0)
+			break;
+
+		if (ret)
+			__set_bit(i, removed);
+	}
+
+	if (ret < 0) {
+		entries[i].result = ret;
+
+		/* undo in reverse order, a region may be listed more than once */
+		while (i--) {
+			if (!regions[i])
+				continue;
+			if (test_bit(i, removed))
+				afu_dma_region_add(ctx, regions[i]);
+			afu_dma_cache_hold(regions[i]);
+		}
+		up_write(&ctx->dma_lock);
+		goto free;
+	}
+	up_write(&ctx->dma_lock);
+
+	for (i = 0; i < count; i++)
+		entries[i].result = 0;
+
+	for_each_set_bit(i, removed, count)
+		afu_dma_region_release(ctx, regions[i]);
+
+	ret = 0;
+free:
+	bitmap_free(removed);
+	kvfree(regions);
+	return ret;
 }
 
 /**
- * afu_dma_map_region - map memory region for dma
- * @fdata: feature dev data
- * @user_addr: address of the memory region
- * @length: size of the memory region
- * @flags: dma mapping flags
+ * afu_dma_alloc_region - allocate a dma region and map it for dma
+ * @ctx: port file context
+ * @length: size of the dma region
+ * @flags: dma mapping and allocation flags
  * @iova: pointer of iova address
+ * @offset: pointer of the offset to mmap the region from the device fd
  *
- * Map memory region defined by @user_addr and @length, and return dma address
- * of the memory region via @iova.
+ * Allocate a dma region from the NUMA node of the device, so it needs
+ * neither pinning nor locked memory accounting, and return its dma address
+ * via @iova. It is freed by afu_dma_unmap_region().
  * Return 0 for success, otherwise error code.
  */
-int afu_dma_map_region(struct dfl_feature_dev_data *fdata,
-		       u64 user_addr, u64 length, u32 flags, u64 *iova)
+int afu_dma_alloc_region(struct dfl_afu_ctx *ctx, u64 length,
+			 u32 flags, u64 *iova, u64 *offset)
 {
-	struct device *dev = &fdata->dev->dev;
+	u32 mask = DFL_DMA_MAP_FLAG_READ | DFL_DMA_MAP_FLAG_WRITE |
+		   DFL_DMA_ALLOC_FLAG_CONTIG;
+	bool contig = flags & DFL_DMA_ALLOC_FLAG_CONTIG;
+	struct device *dev = &ctx->fdata->dev->dev;
 	struct dfl_afu_dma_region *region;
 	int ret;
 
-	/*
-	 * Check Inputs, only accept page-aligned user memory region with
-	 * valid length.
-	 */
-	if (!PAGE_ALIGNED(user_addr) || !PAGE_ALIGNED(length) || !length)
-		return -EINVAL;
-
-	/* Check overflow */
-	if (user_addr + length < user_addr)
+	if (flags & ~mask || !length ||
+	    !IS_ALIGNED(length, contig ? PMD_SIZE : PAGE_SIZE))
 		return -EINVAL;
 
 	region = kzalloc(sizeof(*region), GFP_KERNEL);
 	if (!region)
 		return -ENOMEM;
 
-	region->user_addr = user_addr;
 	region->length = length;
 	region->direction = dma_flag_to_dir(flags);
+	region->alloc = true;
 
-	/* Pin the user memory region */
-	ret = afu_dma_pin_pages(fdata, region);
+	ret = afu_dma_alloc_pages(ctx, region, contig);
 	if (ret) {
-		dev_err(dev, "failed to pin memory region\n");
+		dev_err(dev, "failed to allocate memory region\n");
 		goto free_region;
 	}
 
-	/* Only accept continuous pages, return error else */
-	if (!afu_dma_check_continuous_pages(region)) {
-		dev_err(dev, "pages are not continuous\n");
-		ret = -EINVAL;
-		goto unpin_pages;
-	}
-
-	/* As pages are continuous then start to do DMA mapping */
-	region->iova = dma_map_page(dfl_fpga_fdata_to_parent(fdata),
-				    region->pages[0], 0,
-				    region->length,
-				    region->direction);
-	if (dma_mapping_error(dfl_fpga_fdata_to_parent(fdata), region->iova)) {
-		dev_err(dev, "failed to map for dma\n");
-		ret = -EFAULT;
-		goto unpin_pages;
-	}
-
-	*iova = region->iova;
+	ret = afu_dma_map_pages(ctx, region);
+	if (ret)
+		goto free_pages;
 
-	mutex_lock(&fdata->lock);
-	ret = afu_dma_region_add(fdata, region);
-	mutex_unlock(&fdata->lock);
+	down_write(&ctx->dma_lock);
+	region->offset = ctx->dma_alloc_offset;
+	ret = afu_dma_region_add(ctx, region);
+	if (!ret)
+		ctx->dma_alloc_offset += length;
+	up_write(&ctx->dma_lock);
 	if (ret) {
 		dev_err(dev, "failed to add dma region\n");
 		goto unmap_dma;
 	}
 
+	*iova = region->iova;
+	*offset = region->offset;
+
 	return 0;
 
 unmap_dma:
-	dma_unmap_page(dfl_fpga_fdata_to_parent(fdata),
-		       region->iova, region->length, region->direction);
-unpin_pages:
-	afu_dma_unpin_pages(fdata, region);
+	afu_dma_unmap(ctx, region);
+free_pages:
+	afu_dma_free_pages(region);
 free_region:
 	kfree(region);
 	return ret;
 }
 
 /**
- * afu_dma_unmap_region - unmap dma memory region
- * @fdata: feature dev data
+ * afu_dma_region_find_offset - find driver allocated dma region by mmap offset
+ * @ctx: port file context
+ * @offset: offset from start of the device fd
+ * @size: size of the mapping
+ *
+ * Needs to be called with ctx->dma_lock held for read or write.
+ */
+static struct dfl_afu_dma_region *
+afu_dma_region_find_offset(struct dfl_afu_ctx *ctx,
+			   u64 offset, u64 size)
+{
+	struct rb_node *node = ctx->dma_alloc_regions.rb_node;
+	struct dfl_afu_dma_region *region;
+
+	while (node) {
+		region = rb_entry(node, struct dfl_afu_dma_region, alloc_node);
+
+		if (offset < region->offset) {
+			node = node->rb_left;
+		} else if (offset >= region->offset + region->length) {
+			node = node->rb_right;
+		} else {
+			if (offset + size <= region->offset + region->length)
+				return region;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * afu_dma_runs_mmap - map runs of pages to userspace
+ * @runs: runs of physically continuous pages
+ * @nr_runs: number of @runs
+ * @pgoff: index of the first page of @runs to map
+ * @vma: virtual memory area to map the pages to
+ *
+ * Return 0 for success, otherwise error code.
+ */
+static int afu_dma_runs_mmap(const u64 *runs, unsigned long nr_runs,
+			     unsigned long pgoff, struct vm_area_struct *vma)
+{
+	unsigned long addr = vma->vm_start;
+	unsigned long i, npages;
+	int ret;
+
+	for (i = 0; i < nr_runs && addr < vma->vm_end; i++) {
+		npages = afu_dma_run_npages(runs[i]);
+		if (pgoff >= npages) {
+			pgoff -= npages;
+			continue;
+		}
+
+		for (; pgoff < npages && addr < vma->vm_end; pgoff++) {
+			ret = vm_insert_page(vma, addr,
+					     pfn_to_page(afu_dma_run_pfn(runs[i]) + pgoff));
+			if (ret)
+				return ret;
+
+			addr += PAGE_SIZE;
+		}
+
+		pgoff = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * afu_dma_region_mmap - map driver allocated dma region to userspace
+ * @ctx: port file context
+ * @vma: virtual memory area at an offset returned by afu_dma_alloc_region()
+ *
+ * Return 0 for success, otherwise error code.
+ */
+int afu_dma_region_mmap(struct dfl_afu_ctx *ctx,
+			struct vm_area_struct *vma)
+{
+	u64 size = vma->vm_end - vma->vm_start;
+	u64 offset = PFN_PHYS(vma->vm_pgoff);
+	struct dfl_afu_dma_region *region;
+	int ret;
+
+	down_read(&ctx->dma_lock);
+	region = afu_dma_region_find_offset(ctx, offset, size);
+	if (region)
+		ret = afu_dma_runs_mmap(region->runs, region->nr_runs,
+					PFN_DOWN(offset - region->offset), vma);
+	else
+		ret = -EINVAL;
+	up_read(&ctx->dma_lock);
+
+	return ret;
+}
+
+#ifdef DFL_AFU_DMA_BUF
+/**
+ * struct afu_dma_buf - dma-buf exported from a dma region
+ *
+ * @runs: runs of the pages of the region at export time, so the dma-buf
+ *	  outlives the region. The pages of a user memory region are pinned
+ *	  long-term by the dma-buf itself, the ones of a driver allocated region
+ *	  are held by a page reference.
+ * @nr_runs: number of @runs.
+ * @mm: address space the pages of a user memory region are charged to as
+ *	locked memory for the lifetime of the dma-buf, NULL for a driver
+ *	allocated region.
+ * @npages: number of pages charged to @mm.
+ */
+struct afu_dma_buf {
+	u64 *runs;
+	unsigned long nr_runs;
+	struct mm_struct *mm;
+	long npages;
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 3, 0) && RHEL_RELEASE_CODE < 0x803
+/* the last reference of a dma-buf may be dropped by any task */
+static long afu_dma_buf_lock_vm(struct mm_struct *mm, long npages, bool incr)
+{
+	unsigned long lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	long ret = 0;
+
+	down_write(&mm->mmap_sem);
+	if (!incr)
+		mm->locked_vm -= min_t(unsigned long, npages, mm->locked_vm);
+	else if (mm->locked_vm + npages > lock_limit && !capable(CAP_IPC_LOCK))
+		ret = -ENOMEM;
+	else
+		mm->locked_vm += npages;
+	up_write(&mm->mmap_sem);
+
+	return ret;
+}
+#else
+static long afu_dma_buf_lock_vm(struct mm_struct *mm, long npages, bool incr)
+{
+	return account_locked_vm(mm, npages, incr);
+}
+#endif
+
+static void afu_dma_buf_get_pages(struct afu_dma_buf *buf)
+{
+	unsigned long i, j;
+
+	for (i = 0; i < buf->nr_runs; i++)
+		for (j = 0; j < afu_dma_run_npages(buf->runs[i]); j++)
+			get_page(pfn_to_page(afu_dma_run_pfn(buf->runs[i]) + j));
+}
+
+static void afu_dma_buf_put_pages(struct afu_dma_buf *buf)
+{
+	struct dfl_afu_dma_region pinned = {
+		.runs = buf->runs,
+		.nr_runs = buf->nr_runs,
+	};
+	unsigned long i, j;
+
+	if (buf->mm) {
+		afu_dma_unpin_runs(&pinned);
+		buf->runs = NULL;
+		buf->nr_runs = 0;
+		return;
+	}
+
+	for (i = 0; i < buf->nr_runs; i++)
+		for (j = 0; j < afu_dma_run_npages(buf->runs[i]); j++)
+			put_page(pfn_to_page(afu_dma_run_pfn(buf->runs[i]) + j));
+}
+
+static struct page *afu_dma_buf_page(struct afu_dma_buf *buf,
+				     unsigned long pgoff)
+{
+	unsigned long i, npages;
+
+	for (i = 0; i < buf->nr_runs; i++) {
+		npages = afu_dma_run_npages(buf->runs[i]);
+		if (pgoff < npages)
+			return pfn_to_page(afu_dma_run_pfn(buf->runs[i]) + pgoff);
+
+		pgoff -= npages;
+	}
+
+	return NULL;
+}
+
+static struct sg_table *afu_dma_buf_map(struct dma_buf_attachment *attach,
+					enum dma_data_direction dir)
+{
+	struct afu_dma_buf *buf = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = afu_dma_runs_alloc_sgt(buf->runs, buf->nr_runs);
+	if (IS_ERR(sgt))
+		return sgt;
+
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret) {
+		sg_free_table(sgt);
+		kfree(sgt);
+		return ERR_PTR(ret);
+	}
+
+	return sgt;
+}
+
+static void afu_dma_buf_unmap(struct dma_buf_attachment *attach,
+			      struct sg_table *sgt,
+			      enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void afu_dma_buf_release(struct dma_buf *dmabuf)
+{
+	struct afu_dma_buf *buf = dmabuf->priv;
+
+	afu_dma_buf_put_pages(buf);
+	if (buf->mm) {
+		afu_dma_buf_lock_vm(buf->mm, buf->npages, false);
+		mmdrop(buf->mm);
+	}
+	kvfree(buf->runs);
+	kfree(buf);
+}
+
+static vm_fault_t afu_dma_buf_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct page *page;
+
+	page = afu_dma_buf_page(vma->vm_private_data, vmf->pgoff);
+	if (!page)
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vma, vmf->address, page_to_pfn(page));
+}
+
+static const struct vm_operations_struct afu_dma_buf_vm_ops = {
+	.fault = afu_dma_buf_fault,
+};
+
+/*
+ * Pages pinned from user memory are anonymous or page cache pages, which
+ * can't be inserted as pages of another mapping, so all pages of the dma-buf
+ * are mapped by pfn on fault. The mapping holds the file of the dma-buf, which
+ * keeps buf alive.
+ */
+static int afu_dma_buf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct afu_dma_buf *buf = dmabuf->priv;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	if (vma->vm_pgoff + vma_pages(vma) > PFN_DOWN(dmabuf->size))
+		return -EINVAL;
+
+	vma->vm_ops = &afu_dma_buf_vm_ops;
+	vma->vm_private_data = buf;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0) && RHEL_RELEASE_CODE < 0x905
+	vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+#else
+	vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+#endif
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0) && RHEL_RELEASE_CODE < 0x803
+/* the kmap callback is mandatory before 4.19, and only removed in 5.6 */
+static void *afu_dma_buf_kmap(struct dma_buf *dmabuf, unsigned long pgoff)
+{
+	struct page *page = afu_dma_buf_page(dmabuf->priv, pgoff);
+
+	return page ? kmap(page) : NULL;
+}
+
+static void afu_dma_buf_kunmap(struct dma_buf *dmabuf, unsigned long pgoff,
+			       void *vaddr)
+{
+	kunmap(afu_dma_buf_page(dmabuf->priv, pgoff));
+}
+#endif
+
+static const struct dma_buf_ops afu_dma_buf_ops = {
+	.map_dma_buf = afu_dma_buf_map,
+	.unmap_dma_buf = afu_dma_buf_unmap,
+	.release = afu_dma_buf_release,
+	.mmap = afu_dma_buf_mmap,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0) && RHEL_RELEASE_CODE < 0x803
+	.map = afu_dma_buf_kmap,
+	.unmap = afu_dma_buf_kunmap,
+#endif
+};
+
+/**
+ * afu_dma_buf_pin - pin the pages of a user memory region for a dma-buf
+ * @ctx: port file context
  * @iova: dma address of the region
+ * @buf: dma-buf to take the pins
  *
- * Unmap dma memory region based on @iova.
+ * Pin the user range of the region long-term again, so the dma-buf owns pins
+ * of its own which keep the pages out of movable memory, and charge them as
+ * locked memory. The pins are taken without dma_lock, which nests inside the
+ * mmap lock, so the range is checked to still hold the pages of the region
+ * afterwards.
  * Return 0 for success, otherwise error code.
  */
-int afu_dma_unmap_region(struct dfl_feature_dev_data *fdata, u64 iova)
+static int afu_dma_buf_pin(struct dfl_afu_ctx *ctx, u64 iova,
+			   struct afu_dma_buf *buf)
 {
+	struct dfl_afu_dma_region *region, pinned = { 0 };
+	unsigned long nr_huge = 0;
+	int ret;
+
+	down_read(&ctx->dma_lock);
+	region = afu_dma_region_find_iova(ctx, iova);
+	if (!region || region->iova != iova || region->mm != current->mm) {
+		up_read(&ctx->dma_lock);
+		return -EINVAL;
+	}
+
+	pinned.user_addr = region->user_addr;
+	pinned.length = region->length;
+	pinned.direction = region->direction;
+	up_read(&ctx->dma_lock);
+
+	buf->mm = current->mm;
+	buf->npages = PFN_DOWN(pinned.length);
+	mmgrab(buf->mm);
+
+	ret = afu_dma_buf_lock_vm(buf->mm, buf->npages, true);
+	if (ret)
+		goto drop_mm;
+
+	ret = afu_dma_pin_runs(&pinned, &nr_huge);
+	if (ret)
+		goto unlock_vm;
+
+	down_read(&ctx->dma_lock);
+	region = afu_dma_region_find_iova(ctx, iova);
+	if (!region || region->iova != iova ||
+	    region->user_addr != pinned.user_addr ||
+	    region->nr_runs != pinned.nr_runs ||
+	    memcmp(region->runs, pinned.runs,
+		   pinned.nr_runs * sizeof(*pinned.runs)))
+		ret = -EBUSY;
+	up_read(&ctx->dma_lock);
+
+	if (ret) {
+		afu_dma_unpin_runs(&pinned);
+		goto unlock_vm;
+	}
+
+	buf->runs = pinned.runs;
+	buf->nr_runs = pinned.nr_runs;
+
+	return 0;
+
+unlock_vm:
+	afu_dma_buf_lock_vm(buf->mm, buf->npages, false);
+drop_mm:
+	mmdrop(buf->mm);
+	buf->mm = NULL;
+	return ret;
+}
+
+/**
+ * afu_dma_export_region - export a dma region as a dma-buf
+ * @ctx: port file context
+ * @iova: dma address of the region
+ * @fd: pointer of the file descriptor of the dma-buf
+ *
+ * The dma-buf holds the pages of the region on its own, so it stays valid
+ * after the region is unmapped. The pages of a user memory region are pinned
+ * long-term again by the dma-buf, which must be exported by the process which
+ * mapped the region, and are charged as locked memory to its address space
+ * until the dma-buf is released, on top of the charge of the region while it
+ * is mapped. Regions imported from a dma-buf can't be exported again, and
+ * neither can on-demand regions, whose pages are replaced when their user
+ * range changes.
+ * Return 0 for success, otherwise error code.
+ */
+int afu_dma_export_region(struct dfl_afu_ctx *ctx, u64 iova, int *fd)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
 	struct dfl_afu_dma_region *region;
+	struct afu_dma_buf *buf;
+	struct dma_buf *dmabuf;
+	bool alloc;
+	int ret;
 
-	mutex_lock(&fdata->lock);
-	region = afu_dma_region_find_iova(fdata, iova);
-	if (!region) {
-		mutex_unlock(&fdata->lock);
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	down_read(&ctx->dma_lock);
+	region = afu_dma_region_find_iova(ctx, iova);
+	if (!region || region->attach || region->ondemand) {
+		up_read(&ctx->dma_lock);
+		ret = -EINVAL;
+		goto free_buf;
+	}
+
+	iova = region->iova;
+	alloc = region->alloc;
+	exp_info.size = region->length;
+
+	if (alloc) {
+		buf->runs = kvmalloc_array(region->nr_runs, sizeof(*buf->runs),
+					   GFP_KERNEL);
+		if (!buf->runs) {
+			up_read(&ctx->dma_lock);
+			ret = -ENOMEM;
+			goto free_buf;
+		}
+
+		memcpy(buf->runs, region->runs,
+		       region->nr_runs * sizeof(*buf->runs));
+		buf->nr_runs = region->nr_runs;
+		afu_dma_buf_get_pages(buf);
+	}
+	up_read(&ctx->dma_lock);
+
+	if (!alloc) {
+		ret = afu_dma_buf_pin(ctx, iova, buf);
+		if (ret)
+			goto free_buf;
+	}
+
+	exp_info.ops = &afu_dma_buf_ops;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = buf;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		goto put_pages;
+	}
+
+	/* from here on the pages and buf are released with the dma-buf */
+	ret = dma_buf_fd(dmabuf, O_CLOEXEC);
+	if (ret < 0) {
+		dma_buf_put(dmabuf);
+		return ret;
+	}
+
+	*fd = ret;
+
+	return 0;
+
+put_pages:
+	afu_dma_buf_put_pages(buf);
+	if (buf->mm) {
+		afu_dma_buf_lock_vm(buf->mm, buf->npages, false);
+		mmdrop(buf->mm);
+	}
+	kvfree(buf->runs);
+free_buf:
+	kfree(buf);
+	return ret;
+}
+
+/**
+ * afu_dma_import_region - import a dma-buf as a dma region
+ * @ctx: port file context
+ * @fd: file descriptor of the dma-buf
+ * @flags: dma mapping flags
+ * @iova: pointer of iova address
+ * @length: pointer of the length of the dma-buf
+ *
+ * Attach the dma-buf to the device and map it through the attachment. The
+ * AFU is given a single dma address, so this only succeeds if the dma-buf is
+ * mapped to continuous dma addresses. The region is released by
+ * afu_dma_unmap_region().
+ * Return 0 for success, otherwise error code.
+ */
+int afu_dma_import_region(struct dfl_afu_ctx *ctx, int fd,
+			  u32 flags, u64 *iova, u64 *length)
+{
+	u32 mask = DFL_DMA_MAP_FLAG_READ | DFL_DMA_MAP_FLAG_WRITE;
+	struct device *parent = dfl_fpga_fdata_to_parent(ctx->fdata);
+	struct device *dev = &ctx->fdata->dev->dev;
+	struct dma_buf_attachment *attach;
+	struct dfl_afu_dma_region *region;
+	struct dma_buf *dmabuf;
+	struct sg_table *sgt;
+	int ret;
+
+	if (flags & ~mask)
 		return -EINVAL;
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if (!region) {
+		ret = -ENOMEM;
+		goto put_dmabuf;
 	}
 
-	if (region->in_use) {
-		mutex_unlock(&fdata->lock);
-		return -EBUSY;
+	region->length = dmabuf->size;
+	region->direction = dma_flag_to_dir(flags);
+
+	attach = dma_buf_attach(dmabuf, parent);
+	if (IS_ERR(attach)) {
+		ret = PTR_ERR(attach);
+		goto free_region;
 	}
 
-	afu_dma_region_remove(fdata, region);
-	mutex_unlock(&fdata->lock);
+	sgt = dma_buf_map_attachment_unlocked(attach, region->direction);
+	if (IS_ERR(sgt)) {
+		ret = PTR_ERR(sgt);
+		goto detach;
+	}
 
-	dma_unmap_page(dfl_fpga_fdata_to_parent(fdata),
-		       region->iova, region->length, region->direction);
-	afu_dma_unpin_pages(fdata, region);
-	kfree(region);
+	if (!afu_dma_check_continuous_iova(sgt)) {
+		dev_err(dev, "dma-buf is not continuous in dma address space\n");
+		ret = -EINVAL;
+		goto unmap_attachment;
+	}
+
+	region->iova = sg_dma_address(sgt->sgl);
+	region->sgt = sgt;
+	region->attach = attach;
+
+	down_write(&ctx->dma_lock);
+	ret = afu_dma_region_add(ctx, region);
+	up_write(&ctx->dma_lock);
+	if (ret) {
+		dev_err(dev, "failed to add dma region\n");
+		goto unmap_attachment;
+	}
+
+	*iova = region->iova;
+	*length = region->length;
 
 	return 0;
+
+unmap_attachment:
+	dma_buf_unmap_attachment_unlocked(attach, sgt, region->direction);
+detach:
+	dma_buf_detach(dmabuf, attach);
+free_region:
+	kfree(region);
+put_dmabuf:
+	dma_buf_put(dmabuf);
+	return ret;
+}
+#else /* DFL_AFU_DMA_BUF */
+int afu_dma_export_region(struct dfl_afu_ctx *ctx, u64 iova, int *fd)
+{
+	return -EOPNOTSUPP;
+}
+
+int afu_dma_import_region(struct dfl_afu_ctx *ctx, int fd,
+			  u32 flags, u64 *iova, u64 *length)
+{
+	return -EOPNOTSUPP;
 }
+#endif /* DFL_AFU_DMA_BUF */
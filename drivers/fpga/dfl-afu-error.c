@@ -268,4 +268,6 @@ const struct dfl_feature_ops port_err_ops = {
 	.init = port_err_init,
 	.uinit = port_err_uinit,
 	.ioctl = port_err_ioctl,
+	.ioctl_nr_base = DFL_PORT_BASE + 5,
+	.ioctl_nr_count = 2,
 };
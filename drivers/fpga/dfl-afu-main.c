@@ -35,17 +35,21 @@
  * __afu_port_enable function should only be used after __afu_port_disable
  * function.
  *
- * The caller needs to hold lock for protection.
+ * The caller needs to hold lock for protection. The dma regions of a port
+ * file context quiesce the port without it, fdata->reset_lock serializes
+ * the disable count and the port reset bit with them.
  */
 int __afu_port_enable(struct dfl_feature_dev_data *fdata)
 {
 	void __iomem *base;
+	int ret = 0;
 	u64 v;
 
+	mutex_lock(&fdata->reset_lock);
 	WARN_ON(!fdata->disable_count);
 
 	if (--fdata->disable_count != 0)
-		return 0;
+		goto out;
 
 	base = dfl_get_feature_ioaddr_by_id(fdata, PORT_FEATURE_ID_HEADER);
 
@@ -63,10 +67,12 @@ int __afu_port_enable(struct dfl_feature_dev_data *fdata)
 			       RST_POLL_INVL, RST_POLL_TIMEOUT)) {
 		dev_err(fdata->dfl_cdev->parent,
 			"timeout, failure to enable device\n");
-		return -ETIMEDOUT;
+		ret = -ETIMEDOUT;
 	}
+out:
+	mutex_unlock(&fdata->reset_lock);
 
-	return 0;
+	return ret;
 }
 
 /**
@@ -75,15 +81,17 @@ int __afu_port_enable(struct dfl_feature_dev_data *fdata)
  *
  * Disable Port by setting the port soft reset bit, it puts the port into reset.
  *
- * The caller needs to hold lock for protection.
+ * The caller needs to hold lock for protection, see __afu_port_enable().
  */
 int __afu_port_disable(struct dfl_feature_dev_data *fdata)
 {
 	void __iomem *base;
+	int ret = 0;
 	u64 v;
 
+	mutex_lock(&fdata->reset_lock);
 	if (fdata->disable_count++ != 0)
-		return 0;
+		goto out;
 
 	base = dfl_get_feature_ioaddr_by_id(fdata, PORT_FEATURE_ID_HEADER);
 
@@ -102,10 +110,12 @@ int __afu_port_disable(struct dfl_feature_dev_data *fdata)
 			       RST_POLL_INVL, RST_POLL_TIMEOUT)) {
 		dev_err(fdata->dfl_cdev->parent,
 			"timeout, failure to disable device\n");
-		return -ETIMEDOUT;
+		ret = -ETIMEDOUT;
 	}
+out:
+	mutex_unlock(&fdata->reset_lock);
 
-	return 0;
+	return ret;
 }
 
 /*
@@ -509,6 +519,8 @@ static const struct dfl_feature_ops port_hdr_ops = {
 	.uinit = port_hdr_uinit,
 #endif
 	.ioctl = port_hdr_ioctl,
+	.ioctl_nr_base = DFL_PORT_BASE + 0,
+	.ioctl_nr_count = 1,
 };
 
 static ssize_t
@@ -575,7 +587,7 @@ static int port_afu_init(struct platform_device *pdev,
 				  DFL_PORT_REGION_INDEX_AFU,
 				  resource_size(res), res->start,
 				  DFL_PORT_REGION_MMAP | DFL_PORT_REGION_READ |
-				  DFL_PORT_REGION_WRITE);
+				  DFL_PORT_REGION_WRITE | DFL_PORT_REGION_MMAP_WC);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 4, 0) && RHEL_RELEASE_CODE < 0x803
 	if (ret)
@@ -648,13 +660,85 @@ port_uint_ioctl(struct platform_device *pdev, struct dfl_feature *feature,
 	}
 }
 
+static ssize_t
+uint_irq_affinity_show(struct device *dev, struct device_attribute *attr,
+		       char *buf)
+{
+	struct dfl_feature_dev_data *fdata = to_dfl_feature_dev_data(dev);
+
+	return dfl_feature_irq_affinity_show(dfl_get_feature_by_id(fdata,
+						PORT_FEATURE_ID_UINT), buf);
+}
+
+static ssize_t
+uint_irq_affinity_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct dfl_feature_dev_data *fdata = to_dfl_feature_dev_data(dev);
+
+	return dfl_feature_irq_affinity_store(dfl_get_feature_by_id(fdata,
+						PORT_FEATURE_ID_UINT),
+					      buf, count);
+}
+static DEVICE_ATTR_RW(uint_irq_affinity);
+
+static struct attribute *port_uint_attrs[] = {
+	&dev_attr_uint_irq_affinity.attr,
+	NULL
+};
+
+static umode_t port_uint_attrs_visible(struct kobject *kobj,
+				       struct attribute *attr, int n)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct dfl_feature_dev_data *fdata;
+	struct dfl_feature *feature;
+
+	fdata = to_dfl_feature_dev_data(dev);
+	/*
+	 * sysfs entries are visible only if related private feature is
+	 * enumerated and has interrupts.
+	 */
+	feature = dfl_get_feature_by_id(fdata, PORT_FEATURE_ID_UINT);
+	if (!feature || !feature->nr_irqs)
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group port_uint_group = {
+	.attrs      = port_uint_attrs,
+	.is_visible = port_uint_attrs_visible,
+};
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 4, 0) && RHEL_RELEASE_CODE < 0x803
+__ATTRIBUTE_GROUPS(port_uint);
+
+static int port_uint_init(struct platform_device *pdev,
+			  struct dfl_feature *feature)
+{
+	return device_add_groups(&pdev->dev, port_uint_groups);
+}
+
+static void port_uint_uinit(struct platform_device *pdev,
+			    struct dfl_feature *feature)
+{
+	device_remove_groups(&pdev->dev, port_uint_groups);
+}
+#endif
+
 static const struct dfl_feature_id port_uint_id_table[] = {
 	{.id = PORT_FEATURE_ID_UINT,},
 	{0,}
 };
 
 static const struct dfl_feature_ops port_uint_ops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 4, 0) && RHEL_RELEASE_CODE < 0x803
+	.init = port_uint_init,
+	.uinit = port_uint_uinit,
+#endif
 	.ioctl = port_uint_ioctl,
+	.ioctl_nr_base = DFL_PORT_BASE + 7,
+	.ioctl_nr_count = 2,
 };
 
 static struct dfl_feature_driver port_feature_drvs[] = {
@@ -687,44 +771,74 @@ static int afu_open(struct inode *inode, struct file *filp)
 {
 	struct dfl_feature_dev_data *fdata = dfl_fpga_inode_to_feature_dev_data(inode);
 	struct platform_device *fdev = fdata->dev;
+	struct dfl_afu_ctx *ctx;
 	int ret;
 
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->fdata = fdata;
+	afu_dma_region_init(ctx);
+
 	mutex_lock(&fdata->lock);
 	ret = dfl_feature_dev_use_begin(fdata, filp->f_flags & O_EXCL);
 	if (!ret) {
 		dev_dbg(&fdev->dev, "Device File Opened %d Times\n",
 			dfl_feature_dev_use_count(fdata));
-		filp->private_data = fdev;
+		filp->private_data = ctx;
 	}
 	mutex_unlock(&fdata->lock);
 
+	if (ret)
+		kfree(ctx);
+
 	return ret;
 }
 
+static void afu_ctx_report(struct dfl_afu_ctx *ctx)
+{
+	struct device *dev = &ctx->fdata->dev->dev;
+
+#ifdef DFL_AFU_MMIO_HUGE_FAULT
+	dev_dbg(dev, "%ld PMD and %ld PUD sized mmio mappings\n",
+		atomic_long_read(&ctx->mmio_huge_pmd),
+		atomic_long_read(&ctx->mmio_huge_pud));
+#endif
+	dev_dbg(dev, "%lu dma regions left at release\n", ctx->dma_nr_regions);
+}
+
 static int afu_release(struct inode *inode, struct file *filp)
 {
-	struct platform_device *pdev = filp->private_data;
-	struct dfl_feature_dev_data *fdata;
+	struct dfl_afu_ctx *ctx = filp->private_data;
+	struct dfl_feature_dev_data *fdata = ctx->fdata;
 	struct dfl_feature *feature;
+	bool last;
 
-	dev_dbg(&pdev->dev, "Device File Release\n");
+	dev_dbg(&fdata->dev->dev, "Device File Release\n");
 
-	fdata = to_dfl_feature_dev_data(&pdev->dev);
+	afu_ctx_report(ctx);
 
 	mutex_lock(&fdata->lock);
 	dfl_feature_dev_use_end(fdata);
 
-	if (!dfl_feature_dev_use_count(fdata)) {
+	last = !dfl_feature_dev_use_count(fdata);
+	if (last) {
 		dfl_fpga_dev_for_each_feature(fdata, feature)
 			dfl_fpga_set_irq_triggers(feature, 0,
 						  feature->nr_irqs, NULL);
 		if (get_port_rev(fdata) < 2)
 			__port_reset(fdata);
-
-		afu_dma_region_destroy(fdata);
 	}
+
 	mutex_unlock(&fdata->lock);
 
+	/* the port is only reset if no other fd uses it anymore */
+	afu_dma_region_destroy(ctx, last);
+	afu_dma_region_flush(ctx);
+	WARN_ON(atomic_long_read(&ctx->dma_pinned));
+	kfree(ctx);
+
 	return 0;
 }
 
@@ -736,11 +850,12 @@ static long afu_ioctl_check_extension(struct dfl_feature_dev_data *fdata,
 }
 
 static long
-afu_ioctl_get_info(struct dfl_feature_dev_data *fdata, void __user *arg)
+afu_ioctl_get_info(struct dfl_afu_ctx *ctx, void __user *arg)
 {
+	struct dfl_feature_dev_data *fdata = ctx->fdata;
 	struct dfl_fpga_port_info info;
+	unsigned long minsz, size;
 	struct dfl_afu *afu;
-	unsigned long minsz;
 
 	minsz = offsetofend(struct dfl_fpga_port_info, num_umsgs);
 
@@ -757,7 +872,13 @@ afu_ioctl_get_info(struct dfl_feature_dev_data *fdata, void __user *arg)
 	info.num_umsgs = afu->num_umsgs;
 	mutex_unlock(&fdata->lock);
 
-	if (copy_to_user(arg, &info, sizeof(info)))
+	info.pasid = 0;
+	if (!afu_dma_sva_get_pasid(ctx, &info.pasid))
+		info.flags |= DFL_PORT_INFO_SVA;
+
+	/* pasid is only returned to callers which know about it */
+	size = min_t(unsigned long, info.argsz, sizeof(info));
+	if (copy_to_user(arg, &info, size))
 		return -EFAULT;
 
 	return 0;
@@ -768,7 +889,7 @@ static long afu_ioctl_get_region_info(struct dfl_feature_dev_data *fdata,
 {
 	struct dfl_fpga_port_region_info rinfo;
 	struct dfl_afu_mmio_region region;
-	unsigned long minsz;
+	unsigned long minsz, size;
 	long ret;
 
 	minsz = offsetofend(struct dfl_fpga_port_region_info, offset);
@@ -786,17 +907,23 @@ static long afu_ioctl_get_region_info(struct dfl_feature_dev_data *fdata,
 	rinfo.flags = region.flags;
 	rinfo.size = region.size;
 	rinfo.offset = region.offset;
+	rinfo.wc_offset = 0;
+	if (region.flags & DFL_PORT_REGION_MMAP_WC)
+		rinfo.wc_offset = AFU_MMIO_WC_OFFSET + region.offset;
 
-	if (copy_to_user(arg, &rinfo, sizeof(rinfo)))
+	/* wc_offset is only returned to callers which know about it */
+	size = min_t(unsigned long, rinfo.argsz, sizeof(rinfo));
+	if (copy_to_user(arg, &rinfo, size))
 		return -EFAULT;
 
 	return 0;
 }
 
 static long
-afu_ioctl_dma_map(struct dfl_feature_dev_data *fdata, void __user *arg)
+afu_ioctl_dma_map(struct dfl_afu_ctx *ctx, void __user *arg)
 {
-	u32 dma_mask = DFL_DMA_MAP_FLAG_READ | DFL_DMA_MAP_FLAG_WRITE;
+	u32 dma_mask = DFL_DMA_MAP_FLAG_READ | DFL_DMA_MAP_FLAG_WRITE |
+		       DFL_DMA_MAP_FLAG_CACHE | DFL_DMA_MAP_FLAG_ONDEMAND;
 	struct dfl_fpga_port_dma_map map;
 	unsigned long minsz;
 	long ret;
@@ -809,24 +936,25 @@ afu_ioctl_dma_map(struct dfl_feature_dev_data *fdata, void __user *arg)
 	if (map.argsz < minsz || map.flags & ~dma_mask)
 		return -EINVAL;
 
-	ret = afu_dma_map_region(fdata, map.user_addr, map.length, map.flags,
+	ret = afu_dma_map_region(ctx, map.user_addr, map.length, map.flags,
 				 &map.iova);
 	if (ret)
 		return ret;
 
 	if (copy_to_user(arg, &map, sizeof(map))) {
-		afu_dma_unmap_region(fdata, map.iova);
+		afu_dma_unmap_region(ctx, map.iova);
 		return -EFAULT;
 	}
 
-	dev_dbg(&fdata->dev->dev, "dma map: ua=%llx, len=%llx, iova=%llx\n",
+	dev_dbg(&ctx->fdata->dev->dev,
+		"dma map: ua=%llx, len=%llx, iova=%llx\n",
 		map.user_addr, map.length, map.iova);
 
 	return 0;
 }
 
 static long
-afu_ioctl_dma_unmap(struct dfl_feature_dev_data *fdata, void __user *arg)
+afu_ioctl_dma_unmap(struct dfl_afu_ctx *ctx, void __user *arg)
 {
 	struct dfl_fpga_port_dma_unmap unmap;
 	unsigned long minsz;
@@ -839,52 +967,324 @@ afu_ioctl_dma_unmap(struct dfl_feature_dev_data *fdata, void __user *arg)
 	if (unmap.argsz < minsz || unmap.flags)
 		return -EINVAL;
 
-	return afu_dma_unmap_region(fdata, unmap.iova);
+	return afu_dma_unmap_region(ctx, unmap.iova);
 }
 
-static long afu_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static long
+afu_ioctl_dma_map_batch(struct dfl_afu_ctx *ctx, void __user *arg)
 {
-	struct platform_device *pdev = filp->private_data;
-	struct dfl_feature_dev_data *fdata;
-	struct dfl_feature *f;
+	struct dfl_fpga_port_dma_map_batch batch;
+	struct dfl_fpga_port_dma_map_entry *entries;
+	unsigned long minsz;
+	size_t size;
 	long ret;
+	u32 i;
 
-	dev_dbg(&pdev->dev, "%s cmd 0x%x\n", __func__, cmd);
+	minsz = offsetofend(struct dfl_fpga_port_dma_map_batch, padding);
 
-	fdata = to_dfl_feature_dev_data(&pdev->dev);
+	if (copy_from_user(&batch, arg, minsz))
+		return -EFAULT;
+
+	if (batch.flags || batch.padding || !batch.count ||
+	    batch.count > DFL_DMA_BATCH_MAX)
+		return -EINVAL;
+
+	size = array_size(batch.count, sizeof(*entries));
+	if (batch.argsz < minsz + size)
+		return -EINVAL;
+
+	entries = vmemdup_user(arg + minsz, size);
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	ret = afu_dma_map_regions(ctx, entries, batch.count);
+
+	if (copy_to_user(arg + minsz, entries, size)) {
+		if (!ret)
+			for (i = 0; i < batch.count; i++)
+				afu_dma_unmap_region(ctx, entries[i].iova);
+		ret = -EFAULT;
+	}
+
+	kvfree(entries);
+
+	return ret;
+}
+
+static long
+afu_ioctl_dma_unmap_batch(struct dfl_afu_ctx *ctx, void __user *arg)
+{
+	struct dfl_fpga_port_dma_unmap_batch batch;
+	struct dfl_fpga_port_dma_unmap_entry *entries;
+	unsigned long minsz;
+	size_t size;
+	long ret;
+
+	minsz = offsetofend(struct dfl_fpga_port_dma_unmap_batch, padding);
+
+	if (copy_from_user(&batch, arg, minsz))
+		return -EFAULT;
+
+	if (batch.flags || batch.padding || !batch.count ||
+	    batch.count > DFL_DMA_BATCH_MAX)
+		return -EINVAL;
+
+	size = array_size(batch.count, sizeof(*entries));
+	if (batch.argsz < minsz + size)
+		return -EINVAL;
+
+	entries = vmemdup_user(arg + minsz, size);
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	ret = afu_dma_unmap_regions(ctx, entries, batch.count);
+
+	if (copy_to_user(arg + minsz, entries, size))
+		ret = -EFAULT;
+
+	kvfree(entries);
+
+	return ret;
+}
+
+static long
+afu_ioctl_dma_alloc(struct dfl_afu_ctx *ctx, void __user *arg)
+{
+	struct dfl_fpga_port_dma_alloc alloc;
+	unsigned long minsz;
+	long ret;
+
+	minsz = offsetofend(struct dfl_fpga_port_dma_alloc, offset);
+
+	if (copy_from_user(&alloc, arg, minsz))
+		return -EFAULT;
+
+	if (alloc.argsz < minsz)
+		return -EINVAL;
+
+	ret = afu_dma_alloc_region(ctx, alloc.length, alloc.flags,
+				   &alloc.iova, &alloc.offset);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(arg, &alloc, sizeof(alloc))) {
+		afu_dma_unmap_region(ctx, alloc.iova);
+		return -EFAULT;
+	}
+
+	dev_dbg(&ctx->fdata->dev->dev,
+		"dma alloc: len=%llx, iova=%llx, offset=%llx\n",
+		alloc.length, alloc.iova, alloc.offset);
+
+	return 0;
+}
+
+static long
+afu_ioctl_dma_export(struct dfl_afu_ctx *ctx, void __user *arg)
+{
+	struct dfl_fpga_port_dma_export export;
+	unsigned long minsz;
+	int fd;
+	long ret;
+
+	minsz = offsetofend(struct dfl_fpga_port_dma_export, padding);
+
+	if (copy_from_user(&export, arg, minsz))
+		return -EFAULT;
+
+	if (export.argsz < minsz || export.flags)
+		return -EINVAL;
+
+	ret = afu_dma_export_region(ctx, export.iova, &fd);
+	if (ret)
+		return ret;
+
+	export.fd = fd;
+	export.padding = 0;
+
+	/* the fd is installed already, userspace has to close it on -EFAULT */
+	if (copy_to_user(arg, &export, minsz))
+		return -EFAULT;
+
+	dev_dbg(&ctx->fdata->dev->dev, "dma export: iova=%llx, fd=%d\n",
+		export.iova, fd);
+
+	return 0;
+}
+
+static long
+afu_ioctl_dma_import(struct dfl_afu_ctx *ctx, void __user *arg)
+{
+	struct dfl_fpga_port_dma_import import;
+	unsigned long minsz;
+	long ret;
+
+	minsz = offsetofend(struct dfl_fpga_port_dma_import, length);
+
+	if (copy_from_user(&import, arg, minsz))
+		return -EFAULT;
+
+	if (import.argsz < minsz || import.padding)
+		return -EINVAL;
+
+	ret = afu_dma_import_region(ctx, import.fd, import.flags,
+				    &import.iova, &import.length);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(arg, &import, minsz)) {
+		afu_dma_unmap_region(ctx, import.iova);
+		return -EFAULT;
+	}
+
+	dev_dbg(&ctx->fdata->dev->dev,
+		"dma import: fd=%d, len=%llx, iova=%llx\n",
+		import.fd, import.length, import.iova);
+
+	return 0;
+}
+
+static long afu_ioctl_sva_bind(struct dfl_afu_ctx *ctx)
+{
+	u32 pasid;
+	int ret;
+
+	ret = afu_dma_sva_bind(ctx, &pasid);
+	if (ret)
+		return ret;
+
+	return pasid;
+}
+
+static long
+afu_ioctl_irq_ring(struct file *filp, struct dfl_feature_dev_data *fdata,
+		   unsigned long arg)
+{
+	struct dfl_feature *feature;
+
+	feature = dfl_get_feature_by_id(fdata, PORT_FEATURE_ID_UINT);
+	if (!feature)
+		return -ENOENT;
+
+	return dfl_feature_ioctl_irq_ring(filp, feature, arg);
+}
+
+static long
+afu_ioctl_irq_moderation(struct dfl_feature_dev_data *fdata, unsigned long arg)
+{
+	struct dfl_feature *feature;
+
+	feature = dfl_get_feature_by_id(fdata, PORT_FEATURE_ID_UINT);
+	if (!feature)
+		return -ENOENT;
+
+	return dfl_feature_ioctl_irq_moderation(fdata->dev, feature, arg);
+}
+
+static long afu_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct dfl_afu_ctx *ctx = filp->private_data;
+	struct dfl_feature_dev_data *fdata = ctx->fdata;
+
+	dev_dbg(&fdata->dev->dev, "%s cmd 0x%x\n", __func__, cmd);
 
 	switch (cmd) {
 	case DFL_FPGA_GET_API_VERSION:
 		return DFL_FPGA_API_VERSION;
 	case DFL_FPGA_CHECK_EXTENSION:
 		return afu_ioctl_check_extension(fdata, arg);
+	case DFL_FPGA_GET_FEATURE_TREE:
+		return dfl_fpga_ioctl_get_feature_tree(fdata, (void __user *)arg);
 	case DFL_FPGA_PORT_GET_INFO:
-		return afu_ioctl_get_info(fdata, (void __user *)arg);
+		return afu_ioctl_get_info(ctx, (void __user *)arg);
 	case DFL_FPGA_PORT_GET_REGION_INFO:
 		return afu_ioctl_get_region_info(fdata, (void __user *)arg);
 	case DFL_FPGA_PORT_DMA_MAP:
-		return afu_ioctl_dma_map(fdata, (void __user *)arg);
+		return afu_ioctl_dma_map(ctx, (void __user *)arg);
 	case DFL_FPGA_PORT_DMA_UNMAP:
-		return afu_ioctl_dma_unmap(fdata, (void __user *)arg);
+		return afu_ioctl_dma_unmap(ctx, (void __user *)arg);
+	case DFL_FPGA_PORT_DMA_MAP_BATCH:
+		return afu_ioctl_dma_map_batch(ctx, (void __user *)arg);
+	case DFL_FPGA_PORT_DMA_UNMAP_BATCH:
+		return afu_ioctl_dma_unmap_batch(ctx, (void __user *)arg);
+	case DFL_FPGA_PORT_DMA_ALLOC:
+		return afu_ioctl_dma_alloc(ctx, (void __user *)arg);
+	case DFL_FPGA_PORT_DMA_EXPORT:
+		return afu_ioctl_dma_export(ctx, (void __user *)arg);
+	case DFL_FPGA_PORT_DMA_IMPORT:
+		return afu_ioctl_dma_import(ctx, (void __user *)arg);
+	case DFL_FPGA_PORT_SVA_BIND:
+		return afu_ioctl_sva_bind(ctx);
+	case DFL_FPGA_PORT_UINT_IRQ_RING:
+		return afu_ioctl_irq_ring(filp, fdata, arg);
+	case DFL_FPGA_PORT_UINT_IRQ_MODERATION:
+		return afu_ioctl_irq_moderation(fdata, arg);
 	default:
-		/*
-		 * Let sub-feature's ioctl function to handle the cmd
-		 * Sub-feature's ioctl returns -ENODEV when cmd is not
-		 * handled in this sub feature, and returns 0 and other
-		 * error code if cmd is handled.
-		 */
-		dfl_fpga_dev_for_each_feature(fdata, f)
-			if (f->ops && f->ops->ioctl) {
-				ret = f->ops->ioctl(pdev, f, cmd, arg);
-				if (ret != -ENODEV)
-					return ret;
-			}
+		/* Let sub-feature's ioctl function to handle the cmd */
+		return dfl_feature_dev_ioctl(fdata, cmd, arg);
+	}
+}
+
+#ifdef DFL_AFU_MMIO_HUGE_FAULT
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+
+#define afu_mmio_pfn_t(pfn)	__pfn_to_pfn_t(pfn, PFN_DEV)
+#else
+#define afu_mmio_pfn_t(pfn)	(pfn)
+#endif
+
+/*
+ * The vm_pgoff of an mmio mapping is the pfn of its start, so the pfn of
+ * a fault doesn't need a region lookup.
+ */
+static vm_fault_t afu_mmio_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct dfl_afu_ctx *ctx = vma->vm_private_data;
+	unsigned long addr = ALIGN_DOWN(vmf->address, PAGE_SIZE << order);
+	unsigned long pfn = vma->vm_pgoff + PFN_DOWN(addr - vma->vm_start);
+	vm_fault_t ret;
+
+	/* fall back to smaller mappings unless both pfn and address align */
+	if (order && (addr < vma->vm_start ||
+		      addr + (PAGE_SIZE << order) > vma->vm_end ||
+		      !IS_ALIGNED(pfn, 1UL << order)))
+		return VM_FAULT_FALLBACK;
+
+	switch (order) {
+	case 0:
+		return vmf_insert_pfn(vma, vmf->address, pfn);
+#ifdef CONFIG_ARCH_SUPPORTS_PMD_PFNMAP
+	case PMD_ORDER:
+		ret = vmf_insert_pfn_pmd(vmf, afu_mmio_pfn_t(pfn), false);
+		if (ret == VM_FAULT_NOPAGE)
+			atomic_long_inc(&ctx->mmio_huge_pmd);
+		return ret;
+#endif
+#ifdef CONFIG_ARCH_SUPPORTS_PUD_PFNMAP
+	case PUD_ORDER:
+		ret = vmf_insert_pfn_pud(vmf, afu_mmio_pfn_t(pfn), false);
+		if (ret == VM_FAULT_NOPAGE)
+			atomic_long_inc(&ctx->mmio_huge_pud);
+		return ret;
+#endif
+	default:
+		return VM_FAULT_FALLBACK;
 	}
+}
 
-	return -EINVAL;
+static vm_fault_t afu_mmio_fault(struct vm_fault *vmf)
+{
+	return afu_mmio_huge_fault(vmf, 0);
 }
+#endif /* DFL_AFU_MMIO_HUGE_FAULT */
 
 static const struct vm_operations_struct afu_vma_ops = {
+#ifdef DFL_AFU_MMIO_HUGE_FAULT
+	.fault = afu_mmio_fault,
+	.huge_fault = afu_mmio_huge_fault,
+#endif
 #ifdef CONFIG_HAVE_IOREMAP_PROT
 	.access = generic_access_phys,
 #endif
@@ -892,19 +1292,26 @@ static const struct vm_operations_struct afu_vma_ops = {
 
 static int afu_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct platform_device *pdev = filp->private_data;
+	struct dfl_afu_ctx *ctx = filp->private_data;
+	struct dfl_feature_dev_data *fdata = ctx->fdata;
 	u64 size = vma->vm_end - vma->vm_start;
-	struct dfl_feature_dev_data *fdata;
 	struct dfl_afu_mmio_region region;
+	bool wc = false;
 	u64 offset;
 	int ret;
 
 	if (!(vma->vm_flags & VM_SHARED))
 		return -EINVAL;
 
-	fdata = to_dfl_feature_dev_data(&pdev->dev);
-
 	offset = PFN_PHYS(vma->vm_pgoff);
+	if (offset >= AFU_DMA_ALLOC_OFFSET)
+		return afu_dma_region_mmap(ctx, vma);
+
+	if (offset >= AFU_MMIO_WC_OFFSET) {
+		offset -= AFU_MMIO_WC_OFFSET;
+		wc = true;
+	}
+
 	ret = afu_mmio_region_get_by_offset(fdata, offset, size, &region);
 	if (ret)
 		return ret;
@@ -912,6 +1319,13 @@ static int afu_mmap(struct file *filp, struct vm_area_struct *vma)
 	if (!(region.flags & DFL_PORT_REGION_MMAP))
 		return -EINVAL;
 
+	if (wc && !(region.flags & DFL_PORT_REGION_MMAP_WC))
+		return -EINVAL;
+
+	/* the kernel keeps the AFU header mapped uncached */
+	if (wc && offset - region.offset < PORT_AFU_HDR_SIZE)
+		return -EINVAL;
+
 	if ((vma->vm_flags & VM_READ) && !(region.flags & DFL_PORT_REGION_READ))
 		return -EPERM;
 
@@ -922,19 +1336,63 @@ static int afu_mmap(struct file *filp, struct vm_area_struct *vma)
 	/* Support debug access to the mapping */
 	vma->vm_ops = &afu_vma_ops;
 
-	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	if (wc)
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	else
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 
+#ifdef DFL_AFU_MMIO_HUGE_FAULT
+	/*
+	 * Map on fault, with huge mappings where the region is aligned. Pfns
+	 * inserted on fault only look up the memory type of their range, so
+	 * write-combined mappings are set up by remap_pfn_range(), which
+	 * reserves it.
+	 */
+	if (!wc) {
+		vma->vm_private_data = ctx;
+		vma->vm_pgoff = PFN_DOWN(region.phys +
+					 (offset - region.offset));
+		vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND |
+			     VM_DONTDUMP);
+
+		return 0;
+	}
+#endif
 	return remap_pfn_range(vma, vma->vm_start,
 			PFN_DOWN(region.phys + (offset - region.offset)),
 			size, vma->vm_page_prot);
 }
 
+#ifdef DFL_URING_CMD
+static const unsigned int afu_uring_cmds[] = {
+	DFL_FPGA_PORT_RESET,
+	DFL_FPGA_PORT_DMA_MAP,
+	DFL_FPGA_PORT_DMA_UNMAP,
+	DFL_FPGA_PORT_DMA_MAP_BATCH,
+	DFL_FPGA_PORT_DMA_UNMAP_BATCH,
+	DFL_FPGA_PORT_DMA_ALLOC,
+	DFL_FPGA_PORT_DMA_EXPORT,
+	DFL_FPGA_PORT_DMA_IMPORT,
+	DFL_FPGA_PORT_ERR_SET_IRQ,
+	DFL_FPGA_PORT_UINT_SET_IRQ,
+};
+
+static int afu_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	return dfl_fpga_uring_cmd(ioucmd, issue_flags, afu_uring_cmds,
+				  ARRAY_SIZE(afu_uring_cmds), afu_ioctl);
+}
+#endif
+
 static const struct file_operations afu_fops = {
 	.owner = THIS_MODULE,
 	.open = afu_open,
 	.release = afu_release,
 	.unlocked_ioctl = afu_ioctl,
 	.mmap = afu_mmap,
+#ifdef DFL_URING_CMD
+	.uring_cmd = afu_uring_cmd,
+#endif
 };
 
 static int afu_dev_init(struct platform_device *pdev)
@@ -949,7 +1407,6 @@ static int afu_dev_init(struct platform_device *pdev)
 	mutex_lock(&fdata->lock);
 	dfl_fpga_fdata_set_private(fdata, afu);
 	afu_mmio_region_init(fdata);
-	afu_dma_region_init(fdata);
 	mutex_unlock(&fdata->lock);
 
 	return 0;
@@ -961,7 +1418,6 @@ static int afu_dev_destroy(struct platform_device *pdev)
 
 	mutex_lock(&fdata->lock);
 	afu_mmio_region_destroy(fdata);
-	afu_dma_region_destroy(fdata);
 	dfl_fpga_fdata_set_private(fdata, NULL);
 	mutex_unlock(&fdata->lock);
 
@@ -1003,6 +1459,12 @@ static int afu_probe(struct platform_device *pdev)
 	if (ret)
 		goto dev_destroy;
 
+	/* private features of the AFU are not fatal for the port */
+	ret = __dfl_fpga_port_afu_rescan(to_dfl_feature_dev_data(&pdev->dev));
+	if (ret)
+		dev_warn(&pdev->dev, "failed to enumerate AFU features: %d\n",
+			 ret);
+
 	ret = dfl_fpga_dev_ops_register(pdev, &afu_fops, THIS_MODULE);
 	if (ret) {
 		dfl_fpga_dev_feature_uinit(pdev);
@@ -1039,6 +1501,7 @@ static const struct attribute_group *afu_dev_groups[] = {
 	&port_hdr_group,
 	&port_afu_group,
 	&port_err_group,
+	&port_uint_group,
 	NULL
 };
 #endif
@@ -1081,3 +1544,4 @@ MODULE_DESCRIPTION("FPGA Accelerated Function Unit driver");
 MODULE_AUTHOR("Intel Corporation");
 MODULE_LICENSE("GPL v2");
 MODULE_ALIAS("platform:dfl-port");
+MODULE_IMPORT_NS("DMA_BUF");
@@ -18,10 +18,54 @@
 #define __DFL_AFU_H
 
 #include <linux/dma-mapping.h>
+#include <linux/fpga-dfl.h>
 #include <linux/mm.h>
+#include <linux/mmu_notifier.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #include "dfl.h"
 
+/*
+ * The dma registration cache follows user address space changes through
+ * mmu_interval_notifier, which is only available since 5.5.
+ */
+#if IS_ENABLED(CONFIG_MMU_NOTIFIER) && \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0) || RHEL_RELEASE_CODE >= 0x803)
+#define DFL_AFU_DMA_CACHE
+#endif
+
+/*
+ * On-demand dma regions mirror their user range with hmm_range_fault()
+ * instead of pinning it, which needs HMM mirroring and the pfn array
+ * interface of hmm_range_fault() since 5.8.
+ */
+#if defined(DFL_AFU_DMA_CACHE) && IS_ENABLED(CONFIG_HMM_MIRROR) && \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0) || RHEL_RELEASE_CODE >= 0x900)
+#define DFL_AFU_DMA_ONDEMAND
+#endif
+
+/*
+ * mmio regions are mapped with PMD or PUD sized pfn mappings where possible,
+ * which needs huge pfnmap support of the architecture since 6.12.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0) && \
+	(defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) || \
+	 defined(CONFIG_ARCH_SUPPORTS_PUD_PFNMAP))
+#define DFL_AFU_MMIO_HUGE_FAULT
+#endif
+
+/* dma regions are exported and imported as dma-bufs if dma-buf is built in */
+#if IS_ENABLED(CONFIG_DMA_SHARED_BUFFER)
+#define DFL_AFU_DMA_BUF
+#endif
+
+/* the port fd can bind the address space of its user if the iommu has SVA */
+#if IS_ENABLED(CONFIG_IOMMU_SVA)
+#define DFL_AFU_SVA
+#endif
+
 /**
  * struct dfl_afu_mmio_region - afu mmio region data structure
  *
@@ -41,25 +85,85 @@ struct dfl_afu_mmio_region {
 	struct list_head node;
 };
 
+/*
+ * mmio regions which support write-combining are mmapped write-combined from
+ * the device fd at their offset plus this offset.
+ */
+#define AFU_MMIO_WC_OFFSET	BIT_ULL(39)
+
+/*
+ * Driver allocated dma regions are mmapped from the device fd above the mmio
+ * regions, starting at this offset.
+ */
+#define AFU_DMA_ALLOC_OFFSET	BIT_ULL(40)
+
 /**
  * struct dfl_afu_dma_region - afu DMA region data structure
  *
  * @user_addr: region userspace virtual address.
  * @length: region length.
  * @iova: region IO virtual address.
- * @pages: ptr to pages of this region.
+ * @runs: pinned pages of this region, as runs of physically continuous pages.
+ * @nr_runs: number of valid entries in @runs.
+ * @max_runs: number of entries allocated for @runs.
+ * @sgt: scatter-gather table of the pages if they are mapped as a scatterlist,
+ *	 NULL if they are physically contiguous and mapped as a whole.
  * @node: rb tree node.
  * @in_use: flag to indicate if this region is in_use.
  * @direction: dma data direction.
+ * @mm: address space of @user_addr, the pinned pages are accounted to it.
+ * @alloc: region is allocated by the driver rather than pinned user memory.
+ * @offset: offset to mmap a driver allocated region from the device fd.
+ * @alloc_node: node in the rb tree of driver allocated regions, keyed by
+ *		@offset.
+ * @ondemand: region mirrors its user range without pinning it, and is
+ *	      unmapped and remapped when the range is invalidated.
+ * @mapped: on-demand region has faulted in pages and a dma mapping, protected
+ *	    by ctx->dma_notifier_lock.
+ * @invalid: on-demand region which could not be remapped at the same iova,
+ *	     it has no pages and no dma mapping.
+ * @attach: attachment of the dma-buf of an imported region, NULL otherwise.
+ *	    @sgt is then the mapping of the attachment.
+ * @cache: region is managed by the registration cache.
+ * @refcount: number of users of a cached region, idle if 0. It is only
+ *	      incremented under ctx->dma_lock held for read.
+ * @ctx: context of a cached or on-demand region.
+ * @cache_node: node in the registration cache rb tree, cleared once the
+ *		region is dropped from the cache.
+ * @lru: node in the list of idle cached regions.
+ * @notifier: notifier of changes to the user address range.
+ * @notifier_seq: sequence of @notifier when a cached region was pinned.
  */
 struct dfl_afu_dma_region {
 	u64 user_addr;
 	u64 length;
 	u64 iova;
-	struct page **pages;
+	u64 *runs;
+	unsigned long nr_runs;
+	unsigned long max_runs;
+	struct sg_table *sgt;
 	struct rb_node node;
 	bool in_use;
 	enum dma_data_direction direction;
+	struct mm_struct *mm;
+	bool alloc;
+	u64 offset;
+	struct rb_node alloc_node;
+	bool ondemand;
+	bool mapped;
+	bool invalid;
+#ifdef DFL_AFU_DMA_BUF
+	struct dma_buf_attachment *attach;
+#endif
+#ifdef DFL_AFU_DMA_CACHE
+	bool cache;
+	atomic_t refcount;
+	struct dfl_afu_ctx *ctx;
+	struct rb_node cache_node;
+	struct list_head lru;
+	struct mmu_interval_notifier notifier;
+	unsigned long notifier_seq;
+#endif
 };
 
 /**
@@ -68,7 +172,6 @@ struct dfl_afu_dma_region {
  * @region_cur_offset: current region offset from start to the device fd.
  * @num_regions: num of mmio regions.
  * @regions: the mmio region linked list of this afu feature device.
- * @dma_regions: root of dma regions rb tree.
  * @num_umsgs: num of umsgs.
  */
 struct dfl_afu {
@@ -76,10 +179,75 @@ struct dfl_afu {
 	int num_regions;
 	u8 num_umsgs;
 	struct list_head regions;
+};
+
+/**
+ * struct dfl_afu_ctx - afu context of an open port device fd
+ *
+ * @fdata: feature dev data of this afu.
+ * @dma_regions: root of dma regions rb tree.
+ * @dma_lock: protects @dma_regions and the registration cache. Lookups take
+ *	      it for read, so they don't serialize on fdata->lock or on each
+ *	      other.
+ * @dma_alloc_regions: root of the rb tree of driver allocated dma regions,
+ *		       keyed by their mmap offset.
+ * @dma_alloc_offset: mmap offset of the next driver allocated dma region.
+ * @dma_nr_regions: number of dma regions in @dma_regions.
+ * @dma_pinned: number of user pages pinned for the dma regions.
+ * @mmio_huge_pmd: number of PMD sized mmio mappings of this context.
+ * @mmio_huge_pud: number of PUD sized mmio mappings of this context.
+ * @dma_cache: root of the registration cache rb tree, keyed by user address
+ *	       space, user address range and dma direction.
+ * @dma_cache_idle: cached regions without users, least recently used first.
+ * @dma_cache_lock: protects @dma_cache_idle against concurrent lookups.
+ * @dma_cache_work: work to release cached regions and to remap on-demand
+ *		    regions invalidated by the mm.
+ * @dma_notifier_lock: protects the on-demand regions against their notifier.
+ *		       It is never held while memory is allocated or pages are
+ *		       pinned, as the notifier may be called from reclaim.
+ * @dma_remap_lock: serializes the remap of on-demand regions with their
+ *		    release.
+ * @dma_ondemand_unmapped: number of on-demand regions without mapped pages.
+ * @dma_quiesced: the port is held in reset for on-demand regions.
+ * @sva: SVA binding of @sva_mm to the device, NULL if not bound.
+ * @sva_mm: address space bound to the device. DMA map requests from it are
+ *	    no-ops, the AFU accesses it by virtual address.
+ *
+ * Each open of the port device fd gets its own context, so dma mappings are
+ * private to the fd they were created on and released when it is closed.
+ */
+struct dfl_afu_ctx {
+	struct dfl_feature_dev_data *fdata;
 	struct rb_root dma_regions;
+	struct rw_semaphore dma_lock;
+	struct rb_root dma_alloc_regions;
+	u64 dma_alloc_offset;
+	unsigned long dma_nr_regions;
+	atomic_long_t dma_pinned;
+#ifdef DFL_AFU_MMIO_HUGE_FAULT
+	atomic_long_t mmio_huge_pmd;
+	atomic_long_t mmio_huge_pud;
+#endif
+#ifdef DFL_AFU_DMA_CACHE
+	struct rb_root dma_cache;
+	struct list_head dma_cache_idle;
+	spinlock_t dma_cache_lock;
+	struct work_struct dma_cache_work;
+	struct mutex dma_notifier_lock;
+	struct mutex dma_remap_lock;
+	unsigned long dma_ondemand_unmapped;
+	bool dma_quiesced;
+#endif
+#ifdef DFL_AFU_SVA
+	struct iommu_sva *sva;
+	struct mm_struct *sva_mm;
+#endif
 };
 
-/* hold fdata->lock when call __afu_port_enable/disable */
+/*
+ * hold fdata->lock when call __afu_port_enable/disable, except for the dma
+ * regions of a port file context, which only rely on fdata->reset_lock
+ */
 int __afu_port_enable(struct dfl_feature_dev_data *fdata);
 int __afu_port_disable(struct dfl_feature_dev_data *fdata);
 
@@ -93,14 +261,28 @@ int afu_mmio_region_get_by_index(struct dfl_feature_dev_data *fdata,
 int afu_mmio_region_get_by_offset(struct dfl_feature_dev_data *fdata,
 				  u64 offset, u64 size,
 				  struct dfl_afu_mmio_region *pregion);
-void afu_dma_region_init(struct dfl_feature_dev_data *fdata);
-void afu_dma_region_destroy(struct dfl_feature_dev_data *fdata);
-int afu_dma_map_region(struct dfl_feature_dev_data *fdata,
+void afu_dma_region_init(struct dfl_afu_ctx *ctx);
+void afu_dma_region_destroy(struct dfl_afu_ctx *ctx, bool quiesce);
+void afu_dma_region_flush(struct dfl_afu_ctx *ctx);
+int afu_dma_map_region(struct dfl_afu_ctx *ctx,
 		       u64 user_addr, u64 length, u32 flags, u64 *iova);
-int afu_dma_unmap_region(struct dfl_feature_dev_data *fdata, u64 iova);
+int afu_dma_unmap_region(struct dfl_afu_ctx *ctx, u64 iova);
+int afu_dma_map_regions(struct dfl_afu_ctx *ctx,
+			struct dfl_fpga_port_dma_map_entry *entries, u32 count);
+int afu_dma_unmap_regions(struct dfl_afu_ctx *ctx,
+			  struct dfl_fpga_port_dma_unmap_entry *entries,
+			  u32 count);
 struct dfl_afu_dma_region *
-afu_dma_region_find(struct dfl_feature_dev_data *fdata,
-		    u64 iova, u64 size);
+afu_dma_region_find(struct dfl_afu_ctx *ctx, u64 iova, u64 size);
+int afu_dma_alloc_region(struct dfl_afu_ctx *ctx, u64 length,
+			 u32 flags, u64 *iova, u64 *offset);
+int afu_dma_region_mmap(struct dfl_afu_ctx *ctx,
+			struct vm_area_struct *vma);
+int afu_dma_export_region(struct dfl_afu_ctx *ctx, u64 iova, int *fd);
+int afu_dma_import_region(struct dfl_afu_ctx *ctx, int fd,
+			  u32 flags, u64 *iova, u64 *length);
+int afu_dma_sva_bind(struct dfl_afu_ctx *ctx, u32 *pasid);
+int afu_dma_sva_get_pasid(struct dfl_afu_ctx *ctx, u32 *pasid);
 
 extern const struct dfl_feature_ops port_err_ops;
 extern const struct dfl_feature_id port_err_id_table[];
@@ -403,4 +403,6 @@ const struct dfl_feature_ops fme_global_err_ops = {
 	.init = fme_global_err_init,
 	.uinit = fme_global_err_uinit,
 	.ioctl = fme_global_error_ioctl,
+	.ioctl_nr_base = DFL_FME_BASE + 3,
+	.ioctl_nr_count = 2,
 };
@@ -204,6 +204,8 @@ static const struct dfl_feature_ops fme_hdr_ops = {
 	.uinit = fme_hdr_uinit,
 #endif
 	.ioctl = fme_hdr_ioctl,
+	.ioctl_nr_base = DFL_FME_BASE + 1,
+	.ioctl_nr_count = 2,
 };
 
 #define FME_THERM_THRESHOLD	0x8
@@ -658,8 +660,6 @@ static long fme_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct dfl_feature_dev_data *fdata = filp->private_data;
 	struct platform_device *pdev = fdata->dev;
-	struct dfl_feature *f;
-	long ret;
 
 	dev_dbg(&pdev->dev, "%s cmd 0x%x\n", __func__, cmd);
 
@@ -668,23 +668,12 @@ static long fme_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		return DFL_FPGA_API_VERSION;
 	case DFL_FPGA_CHECK_EXTENSION:
 		return fme_ioctl_check_extension(fdata, arg);
+	case DFL_FPGA_GET_FEATURE_TREE:
+		return dfl_fpga_ioctl_get_feature_tree(fdata, (void __user *)arg);
 	default:
-		/*
-		 * Let sub-feature's ioctl function to handle the cmd.
-		 * Sub-feature's ioctl returns -ENODEV when cmd is not
-		 * handled in this sub feature, and returns 0 or other
-		 * error code if cmd is handled.
-		 */
-		dfl_fpga_dev_for_each_feature(fdata, f) {
-			if (f->ops && f->ops->ioctl) {
-				ret = f->ops->ioctl(pdev, f, cmd, arg);
-				if (ret != -ENODEV)
-					return ret;
-			}
-		}
+		/* Let sub-feature's ioctl function to handle the cmd. */
+		return dfl_feature_dev_ioctl(fdata, cmd, arg);
 	}
-
-	return -EINVAL;
 }
 
 static int fme_dev_init(struct platform_device *pdev)
@@ -712,11 +701,27 @@ static void fme_dev_destroy(struct platform_device *pdev)
 	mutex_unlock(&fdata->lock);
 }
 
+#ifdef DFL_URING_CMD
+static const unsigned int fme_uring_cmds[] = {
+	DFL_FPGA_FME_PORT_PR,
+	DFL_FPGA_FME_ERR_SET_IRQ,
+};
+
+static int fme_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	return dfl_fpga_uring_cmd(ioucmd, issue_flags, fme_uring_cmds,
+				  ARRAY_SIZE(fme_uring_cmds), fme_ioctl);
+}
+#endif
+
 static const struct file_operations fme_fops = {
 	.owner		= THIS_MODULE,
 	.open		= fme_open,
 	.release	= fme_release,
 	.unlocked_ioctl = fme_ioctl,
+#ifdef DFL_URING_CMD
+	.uring_cmd	= fme_uring_cmd,
+#endif
 };
 
 static int fme_probe(struct platform_device *pdev)
@@ -17,6 +17,7 @@
  */
 
 #include <linux/perf_event.h>
+#include <linux/workqueue.h>
 #include "dfl.h"
 #include "dfl-fme.h"
 
@@ -130,6 +131,13 @@
 
 #define PERF_MAX_PORT_NUM		1U
 
+/* interval of the harvesting of the hardware counters, in ms */
+#define PERF_HARVEST_INTERVAL		10
+#define PERF_HARVEST_INTERVAL_MAX	10000
+
+/* number of counters harvested per hold of the lock with irqs disabled */
+#define PERF_HARVEST_BATCH		4
+
 /**
  * struct fme_perf_priv - priv data structure for fme perf driver
  *
@@ -137,9 +145,16 @@
  * @ioaddr: mapped base address of mmio region.
  * @pmu: pmu data structure for fme perf counters.
  * @id: id of this fme performance report private feature.
- * @fab_users: current user number on fabric counters.
+ * @fab_users: number of started events on fabric counters.
  * @fab_port_id: used to indicate current working mode of fabric counters.
- * @fab_lock: lock to protect fabric counters working mode.
+ * @lock: lock to protect fabric counters working mode, @freeze_count,
+ *	  @counters and all accesses to the counter registers. It is taken in
+ *	  perf callbacks with irqs disabled, so it is a raw spinlock.
+ * @freeze_count: number of nested freezes of the counters.
+ * @counters: counters of the started events, harvested by @harvest_work.
+ * @harvest_work: folds the hardware counters into the counters of the
+ *		  started events every @harvest_interval ms, on @cpu.
+ * @harvest_interval: interval of @harvest_work in ms.
  * @cpu: active CPU to which the PMU is bound for accesses.
  * @node: node for CPU hotplug notifier link.
  * @cpuhp_state: state for CPU hotplug notification;
@@ -152,25 +167,60 @@ struct fme_perf_priv {
 
 	u32 fab_users;
 	u32 fab_port_id;
-	spinlock_t fab_lock;
+	raw_spinlock_t lock;
+
+	unsigned int freeze_count;
+	struct list_head counters;
+	struct delayed_work harvest_work;
+	unsigned int harvest_interval;
 
 	unsigned int cpu;
 	struct hlist_node node;
 	enum cpuhp_state cpuhp_state;
 };
 
+/**
+ * struct fme_perf_counter - software counter of a fme perf event
+ *
+ * @node: node in the counters list of the pmu while the event is started.
+ * @event: the perf event.
+ * @hw_prev: hardware counter value at the last harvest.
+ * @hw_prev_valid: @hw_prev was read since the event was started. If not, the
+ *		   next harvest only sets it, without folding.
+ * @pending: harvested from the hardware counter, but not published to @count
+ *	     yet.
+ * @count: 64bit count of the event, folded from the hardware counter.
+ */
+struct fme_perf_counter {
+	struct list_head node;
+	struct perf_event *event;
+	u64 hw_prev;
+	bool hw_prev_valid;
+	u64 pending;
+	atomic64_t count;
+};
+
 /**
  * struct fme_perf_event_ops - callbacks for fme perf events
  *
  * @event_init: callback invoked during event init.
  * @event_destroy: callback invoked during event destroy.
+ * @event_add: callback invoked when perf schedules the event in, returns
+ *	       -EAGAIN if the counters can't count it at the moment.
+ * @event_del: callback invoked when perf schedules the event out.
  * @read_counter: callback to read hardware counters.
+ * @cntr_mask: mask of the valid bits of the value of @read_counter, which
+ *	       wraps around beyond it.
  */
 struct fme_perf_event_ops {
 	int (*event_init)(struct fme_perf_priv *priv, u32 event, u32 portid);
 	void (*event_destroy)(struct fme_perf_priv *priv, u32 event,
 			      u32 portid);
-	u64 (*read_counter)(struct fme_perf_priv *priv, u32 event, u32 portid);
+	int (*event_add)(struct fme_perf_priv *priv, u32 event, u32 portid);
+	void (*event_del)(struct fme_perf_priv *priv, u32 event, u32 portid);
+	int (*read_counter)(struct fme_perf_priv *priv, u32 event, u32 portid,
+			    u64 *count);
+	u64 cntr_mask;
 };
 
 #define to_fme_perf_priv(_pmu)	container_of(_pmu, struct fme_perf_priv, pmu)
@@ -187,8 +237,45 @@ static ssize_t cpumask_show(struct device *dev,
 }
 static DEVICE_ATTR_RO(cpumask);
 
+static ssize_t harvest_interval_ms_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct pmu *pmu = dev_get_drvdata(dev);
+	struct fme_perf_priv *priv;
+
+	priv = to_fme_perf_priv(pmu);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->harvest_interval));
+}
+
+static ssize_t harvest_interval_ms_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct pmu *pmu = dev_get_drvdata(dev);
+	struct fme_perf_priv *priv;
+	unsigned int interval;
+	int ret;
+
+	priv = to_fme_perf_priv(pmu);
+
+	ret = kstrtouint(buf, 0, &interval);
+	if (ret)
+		return ret;
+
+	if (!interval || interval > PERF_HARVEST_INTERVAL_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(priv->harvest_interval, interval);
+
+	return count;
+}
+static DEVICE_ATTR_RW(harvest_interval_ms);
+
 static struct attribute *fme_perf_cpumask_attrs[] = {
 	&dev_attr_cpumask.attr,
+	&dev_attr_harvest_interval_ms.attr,
 	NULL,
 };
 
@@ -293,12 +380,13 @@ static int basic_event_init(struct fme_perf_priv *priv, u32 event, u32 portid)
 	return -EINVAL;
 }
 
-static u64 basic_read_event_counter(struct fme_perf_priv *priv,
-				    u32 event, u32 portid)
+static int basic_read_event_counter(struct fme_perf_priv *priv,
+				    u32 event, u32 portid, u64 *count)
 {
 	void __iomem *base = priv->ioaddr;
 
-	return fme_read_perf_cntr_reg(base + CLK_CNTR);
+	*count = fme_read_perf_cntr_reg(base + CLK_CNTR);
+	return 0;
 }
 
 static int cache_event_init(struct fme_perf_priv *priv, u32 event, u32 portid)
@@ -310,12 +398,12 @@ static int cache_event_init(struct fme_perf_priv *priv, u32 event, u32 portid)
 	return -EINVAL;
 }
 
-static u64 cache_read_event_counter(struct fme_perf_priv *priv,
-				    u32 event, u32 portid)
+static int cache_read_event_counter(struct fme_perf_priv *priv,
+				    u32 event, u32 portid, u64 *count)
 {
 	void __iomem *base = priv->ioaddr;
-	u64 v, count;
 	u8 channel;
+	u64 v;
 
 	if (event == CACHE_EVNT_WR_HIT || event == CACHE_EVNT_WR_MISS ||
 	    event == CACHE_EVNT_DATA_WR_PORT_CONTEN ||
@@ -335,15 +423,15 @@ static u64 cache_read_event_counter(struct fme_perf_priv *priv,
 				      FIELD_GET(CACHE_CNTR_EVNT, v) == event,
 				      1, PERF_TIMEOUT)) {
 		dev_err(priv->dev, "timeout, unmatched cache event code in counter register.\n");
-		return 0;
+		return -ETIMEDOUT;
 	}
 
 	v = fme_read_perf_cntr_reg(base + CACHE_CNTR0);
-	count = FIELD_GET(CACHE_CNTR_EVNT_CNTR, v);
+	*count = FIELD_GET(CACHE_CNTR_EVNT_CNTR, v);
 	v = fme_read_perf_cntr_reg(base + CACHE_CNTR1);
-	count += FIELD_GET(CACHE_CNTR_EVNT_CNTR, v);
+	*count += FIELD_GET(CACHE_CNTR_EVNT_CNTR, v);
 
-	return count;
+	return 0;
 }
 
 static bool is_fabric_event_supported(struct fme_perf_priv *priv, u32 event,
@@ -361,26 +449,33 @@ static bool is_fabric_event_supported(struct fme_perf_priv *priv, u32 event,
 }
 
 static int fabric_event_init(struct fme_perf_priv *priv, u32 event, u32 portid)
+{
+	if (!is_fabric_event_supported(priv, event, portid))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int fabric_event_add(struct fme_perf_priv *priv, u32 event, u32 portid)
 {
 	void __iomem *base = priv->ioaddr;
+	unsigned long flags;
 	int ret = 0;
 	u64 v;
 
-	if (!is_fabric_event_supported(priv, event, portid))
-		return -EINVAL;
-
 	/*
 	 * as fabric counter set only can be in either overall or port mode.
 	 * In overall mode, it counts overall data for FPGA, and in port mode,
 	 * it is configured to monitor on one individual port.
 	 *
-	 * so every time, a new event is initialized, driver checks
-	 * current working mode and if someone is using this counter set.
+	 * so every time, an event is scheduled in, driver checks current
+	 * working mode and if a started event is using this counter set. If
+	 * it is, the event has to wait, and perf multiplexes it with the
+	 * events of the other mode.
 	 */
-	spin_lock(&priv->fab_lock);
+	raw_spin_lock_irqsave(&priv->lock, flags);
 	if (priv->fab_users && priv->fab_port_id != portid) {
-		dev_dbg(priv->dev, "conflict fabric event monitoring mode.\n");
-		ret = -EOPNOTSUPP;
+		ret = -EAGAIN;
 		goto exit;
 	}
 
@@ -407,20 +502,22 @@ static int fabric_event_init(struct fme_perf_priv *priv, u32 event, u32 portid)
 	writeq(v, base + FAB_CTRL);
 
 exit:
-	spin_unlock(&priv->fab_lock);
+	raw_spin_unlock_irqrestore(&priv->lock, flags);
 	return ret;
 }
 
-static void fabric_event_destroy(struct fme_perf_priv *priv, u32 event,
-				 u32 portid)
+static void fabric_event_del(struct fme_perf_priv *priv, u32 event,
+			     u32 portid)
 {
-	spin_lock(&priv->fab_lock);
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&priv->lock, flags);
 	priv->fab_users--;
-	spin_unlock(&priv->fab_lock);
+	raw_spin_unlock_irqrestore(&priv->lock, flags);
 }
 
-static u64 fabric_read_event_counter(struct fme_perf_priv *priv, u32 event,
-				     u32 portid)
+static int fabric_read_event_counter(struct fme_perf_priv *priv, u32 event,
+				     u32 portid, u64 *count)
 {
 	void __iomem *base = priv->ioaddr;
 	u64 v;
@@ -434,11 +531,12 @@ static u64 fabric_read_event_counter(struct fme_perf_priv *priv, u32 event,
 				      FIELD_GET(FAB_CNTR_EVNT, v) == event,
 				      1, PERF_TIMEOUT)) {
 		dev_err(priv->dev, "timeout, unmatched fab event code in counter register.\n");
-		return 0;
+		return -ETIMEDOUT;
 	}
 
 	v = fme_read_perf_cntr_reg(base + FAB_CNTR);
-	return FIELD_GET(FAB_CNTR_EVNT_CNTR, v);
+	*count = FIELD_GET(FAB_CNTR_EVNT_CNTR, v);
+	return 0;
 }
 
 static int vtd_event_init(struct fme_perf_priv *priv, u32 event, u32 portid)
@@ -450,8 +548,8 @@ static int vtd_event_init(struct fme_perf_priv *priv, u32 event, u32 portid)
 	return -EINVAL;
 }
 
-static u64 vtd_read_event_counter(struct fme_perf_priv *priv, u32 event,
-				  u32 portid)
+static int vtd_read_event_counter(struct fme_perf_priv *priv, u32 event,
+				  u32 portid, u64 *count)
 {
 	void __iomem *base = priv->ioaddr;
 	u64 v;
@@ -467,11 +565,12 @@ static u64 vtd_read_event_counter(struct fme_perf_priv *priv, u32 event,
 				      FIELD_GET(VTD_CNTR_EVNT, v) == event,
 				      1, PERF_TIMEOUT)) {
 		dev_err(priv->dev, "timeout, unmatched vtd event code in counter register.\n");
-		return 0;
+		return -ETIMEDOUT;
 	}
 
 	v = fme_read_perf_cntr_reg(base + VTD_CNTR);
-	return FIELD_GET(VTD_CNTR_EVNT_CNTR, v);
+	*count = FIELD_GET(VTD_CNTR_EVNT_CNTR, v);
+	return 0;
 }
 
 static int vtd_sip_event_init(struct fme_perf_priv *priv, u32 event, u32 portid)
@@ -483,8 +582,8 @@ static int vtd_sip_event_init(struct fme_perf_priv *priv, u32 event, u32 portid)
 	return -EINVAL;
 }
 
-static u64 vtd_sip_read_event_counter(struct fme_perf_priv *priv, u32 event,
-				      u32 portid)
+static int vtd_sip_read_event_counter(struct fme_perf_priv *priv, u32 event,
+				      u32 portid, u64 *count)
 {
 	void __iomem *base = priv->ioaddr;
 	u64 v;
@@ -498,25 +597,32 @@ static u64 vtd_sip_read_event_counter(struct fme_perf_priv *priv, u32 event,
 				      FIELD_GET(VTD_SIP_CNTR_EVNT, v) == event,
 				      1, PERF_TIMEOUT)) {
 		dev_err(priv->dev, "timeout, unmatched vtd sip event code in counter register\n");
-		return 0;
+		return -ETIMEDOUT;
 	}
 
 	v = fme_read_perf_cntr_reg(base + VTD_SIP_CNTR);
-	return FIELD_GET(VTD_SIP_CNTR_EVNT_CNTR, v);
+	*count = FIELD_GET(VTD_SIP_CNTR_EVNT_CNTR, v);
+	return 0;
 }
 
 static struct fme_perf_event_ops fme_perf_event_ops[] = {
 	[FME_EVTYPE_BASIC]	= {.event_init = basic_event_init,
-				   .read_counter = basic_read_event_counter,},
+				   .read_counter = basic_read_event_counter,
+				   .cntr_mask = U64_MAX,},
 	[FME_EVTYPE_CACHE]	= {.event_init = cache_event_init,
-				   .read_counter = cache_read_event_counter,},
+				   .read_counter = cache_read_event_counter,
+				   .cntr_mask = CACHE_CNTR_EVNT_CNTR,},
 	[FME_EVTYPE_FABRIC]	= {.event_init = fabric_event_init,
-				   .event_destroy = fabric_event_destroy,
-				   .read_counter = fabric_read_event_counter,},
+				   .event_add = fabric_event_add,
+				   .event_del = fabric_event_del,
+				   .read_counter = fabric_read_event_counter,
+				   .cntr_mask = FAB_CNTR_EVNT_CNTR,},
 	[FME_EVTYPE_VTD]	= {.event_init = vtd_event_init,
-				   .read_counter = vtd_read_event_counter,},
+				   .read_counter = vtd_read_event_counter,
+				   .cntr_mask = VTD_CNTR_EVNT_CNTR,},
 	[FME_EVTYPE_VTD_SIP]	= {.event_init = vtd_sip_event_init,
-				   .read_counter = vtd_sip_read_event_counter,},
+				   .read_counter = vtd_sip_read_event_counter,
+				   .cntr_mask = VTD_SIP_CNTR_EVNT_CNTR,},
 };
 
 static ssize_t fme_perf_event_show(struct device *dev,
@@ -781,6 +887,52 @@ static struct fme_perf_event_ops *get_event_ops(u32 evtype)
 	return &fme_perf_event_ops[evtype];
 }
 
+static void fme_perf_update_freeze(void __iomem *ctrl, u64 freeze_bit,
+				   bool freeze)
+{
+	u64 v;
+
+	v = readq(ctrl);
+	if (freeze)
+		v |= freeze_bit;
+	else
+		v &= ~freeze_bit;
+	writeq(v, ctrl);
+}
+
+/*
+ * freeze or unfreeze all counter sets of the feature which can be frozen, the
+ * clock counter can't. Only the fabric counters exist in the data path perf.
+ */
+static void fme_perf_set_freeze(struct fme_perf_priv *priv, bool freeze)
+{
+	void __iomem *base = priv->ioaddr;
+
+	fme_perf_update_freeze(base + FAB_CTRL, FAB_FREEZE_CNTR, freeze);
+
+	if (priv->id != FME_FEATURE_ID_GLOBAL_IPERF)
+		return;
+
+	fme_perf_update_freeze(base + CACHE_CTRL, CACHE_FREEZE_CNTR, freeze);
+	fme_perf_update_freeze(base + VTD_CTRL, VTD_FREEZE_CNTR, freeze);
+	fme_perf_update_freeze(base + VTD_SIP_CTRL, VTD_SIP_FREEZE_CNTR,
+			       freeze);
+}
+
+/* caller needs to hold priv->lock */
+static void fme_perf_freeze(struct fme_perf_priv *priv)
+{
+	if (!priv->freeze_count++)
+		fme_perf_set_freeze(priv, true);
+}
+
+/* caller needs to hold priv->lock */
+static void fme_perf_unfreeze(struct fme_perf_priv *priv)
+{
+	if (!WARN_ON_ONCE(!priv->freeze_count) && !--priv->freeze_count)
+		fme_perf_set_freeze(priv, false);
+}
+
 static void fme_perf_event_destroy(struct perf_event *event)
 {
 	struct fme_perf_event_ops *ops = get_event_ops(event->hw.event_base);
@@ -788,6 +940,38 @@ static void fme_perf_event_destroy(struct perf_event *event)
 
 	if (ops->event_destroy)
 		ops->event_destroy(priv, event->hw.idx, event->hw.config_base);
+
+	kfree(event->pmu_private);
+}
+
+static bool fme_perf_fabric_conflict(struct perf_event *event,
+				     struct perf_event *other)
+{
+	return other != event && other->pmu == event->pmu &&
+	       other->hw.event_base == FME_EVTYPE_FABRIC &&
+	       other->hw.config_base != event->hw.config_base;
+}
+
+/*
+ * the fabric counters count for the whole fpga or one port at a time, so a
+ * group with fabric events of different ports could never be scheduled in.
+ */
+static int fme_perf_validate_group(struct perf_event *event)
+{
+	struct perf_event *leader = event->group_leader, *sibling;
+
+	if (event->hw.event_base != FME_EVTYPE_FABRIC)
+		return 0;
+
+	if (fme_perf_fabric_conflict(event, leader))
+		return -EINVAL;
+
+	for_each_sibling_event(sibling, leader) {
+		if (fme_perf_fabric_conflict(event, sibling))
+			return -EINVAL;
+	}
+
+	return 0;
 }
 
 static int fme_perf_event_init(struct perf_event *event)
@@ -795,7 +979,9 @@ static int fme_perf_event_init(struct perf_event *event)
 	struct fme_perf_priv *priv = to_fme_perf_priv(event->pmu);
 	struct hw_perf_event *hwc = &event->hw;
 	struct fme_perf_event_ops *ops;
+	struct fme_perf_counter *cntr;
 	u32 eventid, evtype, portid;
+	int ret;
 
 	/* test the event attr type check for PMU enumeration */
 	if (event->attr.type != event->pmu->type)
@@ -825,50 +1011,201 @@ static int fme_perf_event_init(struct perf_event *event)
 	hwc->idx = (int)eventid;
 	hwc->config_base = portid;
 
-	event->destroy = fme_perf_event_destroy;
-
 	dev_dbg(priv->dev, "%s event=0x%x, evtype=0x%x, portid=0x%x,\n",
 		__func__, eventid, evtype, portid);
 
+	ret = fme_perf_validate_group(event);
+	if (ret)
+		return ret;
+
 	ops = get_event_ops(evtype);
-	if (ops->event_init)
-		return ops->event_init(priv, eventid, portid);
+	if (ops->event_init) {
+		ret = ops->event_init(priv, eventid, portid);
+		if (ret)
+			return ret;
+	}
+
+	cntr = kzalloc(sizeof(*cntr), GFP_KERNEL);
+	if (!cntr) {
+		if (ops->event_destroy)
+			ops->event_destroy(priv, eventid, portid);
+		return -ENOMEM;
+	}
+
+	cntr->event = event;
+	event->pmu_private = cntr;
+	event->destroy = fme_perf_event_destroy;
 
 	return 0;
 }
 
+/*
+ * fold the hardware counter of an event into its pending count. The hardware
+ * counters are 48 or 60 bits wide, they are harvested often enough to wrap
+ * around at most once in between. If the baseline read of a started event
+ * times out, the next successful read becomes its baseline, and what the
+ * event counted in between is lost. Caller needs to hold priv->lock.
+ */
+static void fme_perf_harvest(struct fme_perf_priv *priv,
+			     struct fme_perf_counter *cntr, bool fold)
+{
+	struct hw_perf_event *hwc = &cntr->event->hw;
+	struct fme_perf_event_ops *ops = get_event_ops(hwc->event_base);
+	u64 hw;
+
+	if (!fold) {
+		cntr->hw_prev_valid = false;
+		cntr->pending = 0;
+	}
+
+	if (ops->read_counter(priv, (u32)hwc->idx, hwc->config_base, &hw))
+		return;
+
+	if (fold && cntr->hw_prev_valid)
+		cntr->pending += (hw - cntr->hw_prev) & ops->cntr_mask;
+	cntr->hw_prev = hw;
+	cntr->hw_prev_valid = true;
+}
+
+/* make the pending count of an event visible to perf, needs priv->lock */
+static void fme_perf_publish(struct fme_perf_counter *cntr)
+{
+	atomic64_add(cntr->pending, &cntr->count);
+	cntr->pending = 0;
+}
+
+/* no-op if the harvesting is already scheduled */
+static void fme_perf_harvest_schedule(struct fme_perf_priv *priv)
+{
+	unsigned int interval = READ_ONCE(priv->harvest_interval);
+
+	queue_delayed_work_on(priv->cpu, system_wq, &priv->harvest_work,
+			      msecs_to_jiffies(interval));
+}
+
+static void fme_perf_harvest_work(struct work_struct *work)
+{
+	struct fme_perf_priv *priv = container_of(to_delayed_work(work),
+						  struct fme_perf_priv,
+						  harvest_work);
+	struct fme_perf_counter *cntr;
+	unsigned int i, n, nr = 0;
+	unsigned long flags;
+	bool rearm;
+
+	/*
+	 * Reading a counter polls its event selector, so the lock is only held
+	 * with irqs disabled for PERF_HARVEST_BATCH counters at a time, and the
+	 * counters are only frozen while a batch is read. Harvested counters
+	 * are rotated to the tail of the list. What they counted stays pending
+	 * until the whole pass is harvested, and is then published to all
+	 * counts at once with irqs disabled. The work runs on the cpu the events
+	 * are bound to, where perf reads all events of a group with irqs
+	 * disabled, so a group read never sees the counts of two passes. The
+	 * counters of events started or stopped in between are harvested by
+	 * their start or stop.
+	 */
+	raw_spin_lock_irqsave(&priv->lock, flags);
+	list_for_each_entry(cntr, &priv->counters, node)
+		nr++;
+	raw_spin_unlock_irqrestore(&priv->lock, flags);
+
+	for (i = 0; i < nr; i += n) {
+		raw_spin_lock_irqsave(&priv->lock, flags);
+		fme_perf_freeze(priv);
+		for (n = 0; n < PERF_HARVEST_BATCH && i + n < nr &&
+		     !list_empty(&priv->counters); n++) {
+			cntr = list_first_entry(&priv->counters,
+						struct fme_perf_counter, node);
+			fme_perf_harvest(priv, cntr, true);
+			list_move_tail(&cntr->node, &priv->counters);
+		}
+		fme_perf_unfreeze(priv);
+		raw_spin_unlock_irqrestore(&priv->lock, flags);
+
+		if (!n)
+			break;
+	}
+
+	raw_spin_lock_irqsave(&priv->lock, flags);
+	list_for_each_entry(cntr, &priv->counters, node)
+		fme_perf_publish(cntr);
+	rearm = !list_empty(&priv->counters);
+	raw_spin_unlock_irqrestore(&priv->lock, flags);
+
+	if (rearm)
+		fme_perf_harvest_schedule(priv);
+}
+
+/* a lock free update of the perf count from the harvested count */
 static void fme_perf_event_update(struct perf_event *event)
 {
-	struct fme_perf_event_ops *ops = get_event_ops(event->hw.event_base);
-	struct fme_perf_priv *priv = to_fme_perf_priv(event->pmu);
+	struct fme_perf_counter *cntr = event->pmu_private;
 	struct hw_perf_event *hwc = &event->hw;
-	u64 now, prev, delta;
+	u64 now, prev;
 
-	now = ops->read_counter(priv, (u32)hwc->idx, hwc->config_base);
-	prev = local64_read(&hwc->prev_count);
-	delta = now - prev;
+	now = atomic64_read(&cntr->count);
+	prev = local64_xchg(&hwc->prev_count, now);
 
-	local64_add(delta, &event->count);
+	local64_add(now - prev, &event->count);
 }
 
 static void fme_perf_event_start(struct perf_event *event, int flags)
 {
-	struct fme_perf_event_ops *ops = get_event_ops(event->hw.event_base);
 	struct fme_perf_priv *priv = to_fme_perf_priv(event->pmu);
+	struct fme_perf_counter *cntr = event->pmu_private;
 	struct hw_perf_event *hwc = &event->hw;
-	u64 count;
+	unsigned long irqflags;
+
+	if (!(hwc->state & PERF_HES_STOPPED))
+		return;
+
+	raw_spin_lock_irqsave(&priv->lock, irqflags);
+	fme_perf_harvest(priv, cntr, false);
+	list_add_tail(&cntr->node, &priv->counters);
+	raw_spin_unlock_irqrestore(&priv->lock, irqflags);
+
+	local64_set(&hwc->prev_count, atomic64_read(&cntr->count));
+	hwc->state = 0;
 
-	count = ops->read_counter(priv, (u32)hwc->idx, hwc->config_base);
-	local64_set(&hwc->prev_count, count);
+	fme_perf_harvest_schedule(priv);
 }
 
 static void fme_perf_event_stop(struct perf_event *event, int flags)
 {
+	struct fme_perf_priv *priv = to_fme_perf_priv(event->pmu);
+	struct fme_perf_counter *cntr = event->pmu_private;
+	struct hw_perf_event *hwc = &event->hw;
+	unsigned long irqflags;
+
+	if (hwc->state & PERF_HES_STOPPED)
+		return;
+
+	raw_spin_lock_irqsave(&priv->lock, irqflags);
+	fme_perf_harvest(priv, cntr, true);
+	fme_perf_publish(cntr);
+	list_del(&cntr->node);
+	raw_spin_unlock_irqrestore(&priv->lock, irqflags);
+
 	fme_perf_event_update(event);
+	hwc->state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
 }
 
 static int fme_perf_event_add(struct perf_event *event, int flags)
 {
+	struct fme_perf_event_ops *ops = get_event_ops(event->hw.event_base);
+	struct fme_perf_priv *priv = to_fme_perf_priv(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	int ret;
+
+	if (ops->event_add) {
+		ret = ops->event_add(priv, (u32)hwc->idx, hwc->config_base);
+		if (ret)
+			return ret;
+	}
+
+	hwc->state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+
 	if (flags & PERF_EF_START)
 		fme_perf_event_start(event, flags);
 
@@ -877,7 +1214,14 @@ static int fme_perf_event_add(struct perf_event *event, int flags)
 
 static void fme_perf_event_del(struct perf_event *event, int flags)
 {
+	struct fme_perf_event_ops *ops = get_event_ops(event->hw.event_base);
+	struct fme_perf_priv *priv = to_fme_perf_priv(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+
 	fme_perf_event_stop(event, PERF_EF_UPDATE);
+
+	if (ops->event_del)
+		ops->event_del(priv, (u32)hwc->idx, hwc->config_base);
 }
 
 static void fme_perf_event_read(struct perf_event *event)
@@ -885,6 +1229,30 @@ static void fme_perf_event_read(struct perf_event *event)
 	fme_perf_event_update(event);
 }
 
+/*
+ * the counters are frozen while perf (re)schedules events, so all events of a
+ * group start and stop at the same snapshot.
+ */
+static void fme_perf_pmu_enable(struct pmu *pmu)
+{
+	struct fme_perf_priv *priv = to_fme_perf_priv(pmu);
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&priv->lock, flags);
+	fme_perf_unfreeze(priv);
+	raw_spin_unlock_irqrestore(&priv->lock, flags);
+}
+
+static void fme_perf_pmu_disable(struct pmu *pmu)
+{
+	struct fme_perf_priv *priv = to_fme_perf_priv(pmu);
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&priv->lock, flags);
+	fme_perf_freeze(priv);
+	raw_spin_unlock_irqrestore(&priv->lock, flags);
+}
+
 static void fme_perf_setup_hardware(struct fme_perf_priv *priv)
 {
 	void __iomem *base = priv->ioaddr;
@@ -906,7 +1274,10 @@ static int fme_perf_pmu_register(struct platform_device *pdev,
 	char *name;
 	int ret;
 
-	spin_lock_init(&priv->fab_lock);
+	raw_spin_lock_init(&priv->lock);
+	INIT_LIST_HEAD(&priv->counters);
+	INIT_DELAYED_WORK(&priv->harvest_work, fme_perf_harvest_work);
+	priv->harvest_interval = PERF_HARVEST_INTERVAL;
 
 	fme_perf_setup_hardware(priv);
 
@@ -919,6 +1290,8 @@ static int fme_perf_pmu_register(struct platform_device *pdev,
 	pmu->start =		fme_perf_event_start;
 	pmu->stop =		fme_perf_event_stop;
 	pmu->read =		fme_perf_event_read;
+	pmu->pmu_enable =	fme_perf_pmu_enable;
+	pmu->pmu_disable =	fme_perf_pmu_disable;
 	pmu->capabilities =	PERF_PMU_CAP_NO_INTERRUPT |
 				PERF_PMU_CAP_NO_EXCLUDE;
 
@@ -934,6 +1307,7 @@ static int fme_perf_pmu_register(struct platform_device *pdev,
 static void fme_perf_pmu_unregister(struct fme_perf_priv *priv)
 {
 	perf_pmu_unregister(&priv->pmu);
+	cancel_delayed_work_sync(&priv->harvest_work);
 }
 
 static int fme_perf_offline_cpu(unsigned int cpu, struct hlist_node *node)
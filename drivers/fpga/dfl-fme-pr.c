@@ -74,7 +74,7 @@ static int fme_pr(struct platform_device *pdev, unsigned long arg)
 	struct dfl_fme *fme;
 	unsigned long minsz;
 	void *buf = NULL;
-	int ret = 0;
+	int ret = 0, err;
 	u64 v;
 
 	minsz = offsetofend(struct dfl_fpga_fme_port_pr, buffer_address);
@@ -149,6 +149,16 @@ static int fme_pr(struct platform_device *pdev, unsigned long arg)
 	put_device(&region->dev);
 unlock_exit:
 	mutex_unlock(&fdata->lock);
+
+	/* only add and remove the dfl devices which the new AFU changed */
+	if (!ret) {
+		err = dfl_fpga_cdev_rescan_port_afu(fdata->dfl_cdev,
+						    port_pr.port_id);
+		if (err)
+			dev_warn(&pdev->dev,
+				 "failed to rescan AFU of port %u: %d\n",
+				 port_pr.port_id, err);
+	}
 free_exit:
 	vfree(buf);
 	return ret;
@@ -466,4 +476,6 @@ const struct dfl_feature_ops fme_pr_mgmt_ops = {
 	.init = pr_mgmt_init,
 	.uinit = pr_mgmt_uinit,
 	.ioctl = fme_pr_ioctl,
+	.ioctl_nr_base = DFL_FME_BASE + 0,
+	.ioctl_nr_count = 1,
 };
@@ -52,7 +52,7 @@ static void __iomem *cci_pci_ioremap_bar0(struct pci_dev *pcidev)
 
 static int cci_pci_alloc_irq(struct pci_dev *pcidev)
 {
-	int ret, nvec = pci_msix_vec_count(pcidev);
+	int i, ret, nvec = pci_msix_vec_count(pcidev);
 
 	if (nvec <= 0) {
 		dev_dbg(&pcidev->dev, "fpga interrupt not supported\n");
@@ -63,6 +63,15 @@ static int cci_pci_alloc_irq(struct pci_dev *pcidev)
 	if (ret < 0)
 		return ret;
 
+	/* spread the vectors over the CPUs of the node of the device */
+	for (i = 0; i < nvec; i++) {
+		ret = dfl_irq_set_default_affinity(pci_irq_vector(pcidev, i), i,
+						   dev_to_node(&pcidev->dev));
+		if (ret)
+			dev_dbg(&pcidev->dev, "fail to set irq %d affinity %d\n",
+				i, ret);
+	}
+
 	return nvec;
 }
 
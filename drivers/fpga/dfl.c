@@ -10,16 +10,79 @@
  *   Wu Hao <hao.wu@intel.com>
  *   Xiao Guangrong <guangrong.xiao@linux.intel.com>
  */
+#include <linux/anon_inodes.h>
+#include <linux/async.h>
+#include <linux/debugfs.h>
 #include <linux/dfl.h>
 #include <linux/fpga-dfl.h>
+#include <linux/irq.h>
+#include <linux/jump_label.h>
 #include <linux/minmax.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/overflow.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#endif
 
 #include "dfl.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/dfl.h>
+
+static bool shadow_dfl = true;
+module_param(shadow_dfl, bool, 0644);
+MODULE_PARM_DESC(shadow_dfl, "Parse device feature lists from a RAM shadow of the MMIO window");
+
+static bool async_enum;
+module_param(async_enum, bool, 0444);
+MODULE_PARM_DESC(async_enum, "Parse device feature lists and register feature devices asynchronously");
+
+static DEFINE_STATIC_KEY_FALSE(dfl_irq_latency_key);
+
+static int irq_latency_set(const char *val, const struct kernel_param *kp)
+{
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(val, &enable);
+	if (ret)
+		return ret;
+
+	if (enable)
+		static_branch_enable(&dfl_irq_latency_key);
+	else
+		static_branch_disable(&dfl_irq_latency_key);
+
+	return 0;
+}
+
+static int irq_latency_get(char *buf, const struct kernel_param *kp)
+{
+	return sprintf(buf, "%c\n",
+		       static_key_enabled(&dfl_irq_latency_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops irq_latency_ops = {
+	.set = irq_latency_set,
+	.get = irq_latency_get,
+};
+
+module_param_cb(irq_latency, &irq_latency_ops, NULL, 0644);
+MODULE_PARM_DESC(irq_latency, "Measure the latency of interrupts to the signals and reads of their eventfds");
+
+static struct dentry *dfl_debugfs_root;
+
+static ASYNC_DOMAIN_EXCLUSIVE(dfl_async_domain);
+
 static DEFINE_MUTEX(dfl_id_mutex);
 
 /*
@@ -386,9 +449,14 @@ static void release_dfl_dev(struct device *dev)
 	kfree(ddev);
 }
 
+/*
+ * add a dfl device for @feature. Its mmio resource is @mmio which is carved
+ * out of the feature's resource of the feature device, or the whole resource
+ * if @mmio is NULL.
+ */
 static struct dfl_device *
 dfl_dev_add(struct dfl_feature_dev_data *fdata,
-	    struct dfl_feature *feature)
+	    struct dfl_feature *feature, const struct resource *mmio)
 {
 	struct platform_device *pdev = fdata->dev;
 	struct resource *parent_res;
@@ -435,9 +503,11 @@ dfl_dev_add(struct dfl_feature_dev_data *fdata,
 
 	/* add mmio resource */
 	parent_res = &pdev->resource[feature->resource_index];
+	if (!mmio)
+		mmio = parent_res;
 	ddev->mmio_res.flags = IORESOURCE_MEM;
-	ddev->mmio_res.start = parent_res->start;
-	ddev->mmio_res.end = parent_res->end;
+	ddev->mmio_res.start = mmio->start;
+	ddev->mmio_res.end = mmio->end;
 	ddev->mmio_res.name = dev_name(&ddev->dev);
 	ret = insert_resource(parent_res, &ddev->mmio_res);
 	if (ret) {
@@ -474,10 +544,54 @@ put_dev:
 	return ERR_PTR(ret);
 }
 
+/**
+ * struct dfl_afu_feature - private feature found in the AFU region of a port
+ *
+ * @node: node in afu_features linked list of the port feature dev data.
+ * @mmio_res: mmio resource of this feature inside the AFU region.
+ * @feature: the feature, its dfl device included.
+ *
+ * The device feature list chained from the AFU header is replaced on every
+ * partial reconfiguration, so these features are kept apart from the fixed
+ * sub feature array of the port.
+ */
+struct dfl_afu_feature {
+	struct list_head node;
+	struct resource mmio_res;
+	struct dfl_feature feature;
+};
+
+static void dfl_afu_feature_free(struct dfl_afu_feature *afeature)
+{
+	if (afeature->feature.ddev)
+		device_unregister(&afeature->feature.ddev->dev);
+
+	kfree(afeature->feature.irq_ctx);
+	kfree(afeature->feature.params);
+	kfree(afeature);
+}
+
+static void dfl_afu_devs_remove(struct dfl_feature_dev_data *fdata)
+{
+	struct dfl_afu_feature *afeature, *tmp;
+	LIST_HEAD(afu_features);
+
+	mutex_lock(&fdata->lock);
+	list_splice_init(&fdata->afu_features, &afu_features);
+	mutex_unlock(&fdata->lock);
+
+	list_for_each_entry_safe(afeature, tmp, &afu_features, node) {
+		list_del(&afeature->node);
+		dfl_afu_feature_free(afeature);
+	}
+}
+
 static void dfl_devs_remove(struct dfl_feature_dev_data *fdata)
 {
 	struct dfl_feature *feature;
 
+	dfl_afu_devs_remove(fdata);
+
 	dfl_fpga_dev_for_each_feature(fdata, feature) {
 		if (feature->ddev) {
 			device_unregister(&feature->ddev->dev);
@@ -501,7 +615,7 @@ static int dfl_devs_add(struct dfl_feature_dev_data *fdata)
 			goto err;
 		}
 
-		ddev = dfl_dev_add(fdata, feature);
+		ddev = dfl_dev_add(fdata, feature, NULL);
 		if (IS_ERR(ddev)) {
 			ret = PTR_ERR(ddev);
 			goto err;
@@ -546,6 +660,64 @@ EXPORT_SYMBOL_GPL(dfl_dev_get_base_dev);
 
 #define is_header_feature(feature) ((feature)->id == FEATURE_ID_FIU_HEADER)
 
+static void dfl_irq_latency_show_vector(struct seq_file *s,
+					struct dfl_feature *feature,
+					unsigned int idx)
+{
+	struct dfl_feature_irq_ctx *ctx = &feature->irq_ctx[idx];
+	struct dfl_irq_latency *lat = &ctx->latency;
+	unsigned int i;
+
+	seq_printf(s, "feature 0x%x vector %u irq %d: irqs %llu signals %llu reads %llu\n",
+		   feature->id, idx, ctx->irq, lat->irqs, lat->signals,
+		   lat->reads);
+
+	for (i = 0; i < DFL_IRQ_LATENCY_BUCKETS; i++) {
+		if (!lat->signal_hist[i] && !lat->read_hist[i])
+			continue;
+
+		if (i < DFL_IRQ_LATENCY_BUCKETS - 1)
+			seq_printf(s, "  < %llu ns", 1ULL << i);
+		else
+			seq_printf(s, "  >= %llu ns", 1ULL << (i - 1));
+		seq_printf(s, ": signal %llu read %llu\n", lat->signal_hist[i],
+			   lat->read_hist[i]);
+	}
+}
+
+static int dfl_irq_latency_show(struct seq_file *s, void *unused)
+{
+	struct dfl_feature_dev_data *fdata = s->private;
+	struct dfl_feature *feature;
+	unsigned int i;
+
+	mutex_lock(&fdata->lock);
+	dfl_fpga_dev_for_each_feature(fdata, feature) {
+		for (i = 0; i < feature->nr_irqs; i++)
+			dfl_irq_latency_show_vector(s, feature, i);
+	}
+	mutex_unlock(&fdata->lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dfl_irq_latency);
+
+static void dfl_debugfs_add(struct dfl_feature_dev_data *fdata)
+{
+	struct dfl_feature *feature;
+
+	dfl_fpga_dev_for_each_feature(fdata, feature) {
+		if (!feature->nr_irqs)
+			continue;
+
+		fdata->debugfs = debugfs_create_dir(dev_name(&fdata->dev->dev),
+						    dfl_debugfs_root);
+		debugfs_create_file("irq_latency", 0444, fdata->debugfs, fdata,
+				    &dfl_irq_latency_fops);
+		return;
+	}
+}
+
 /**
  * dfl_fpga_dev_feature_uinit - uinit for sub features of dfl feature device
  * @pdev: feature device.
@@ -555,8 +727,14 @@ void dfl_fpga_dev_feature_uinit(struct platform_device *pdev)
 	struct dfl_feature_dev_data *fdata = to_dfl_feature_dev_data(&pdev->dev);
 	struct dfl_feature *feature;
 
+	debugfs_remove_recursive(fdata->debugfs);
+	fdata->debugfs = NULL;
+
 	dfl_devs_remove(fdata);
 
+	memset(fdata->ioctl_index, 0, sizeof(fdata->ioctl_index));
+	fdata->ioctl_unindexed = 0;
+
 	dfl_fpga_dev_for_each_feature(fdata, feature) {
 		if (feature->ops) {
 			if (feature->ops->uinit)
@@ -567,6 +745,149 @@ void dfl_fpga_dev_feature_uinit(struct platform_device *pdev)
 }
 EXPORT_SYMBOL_GPL(dfl_fpga_dev_feature_uinit);
 
+/*
+ * claim the ioctl command numbers of the ioctl range of a sub feature in the
+ * ioctl index of its feature dev.
+ */
+static void dfl_feature_ioctl_index_add(struct dfl_feature_dev_data *fdata,
+					struct dfl_feature *feature)
+{
+	const struct dfl_feature_ops *ops = feature->ops;
+	unsigned int idx = feature - fdata->features + 1;
+	unsigned int nr;
+
+	if (!ops->ioctl)
+		return;
+
+	if (!ops->ioctl_nr_count || idx > U8_MAX ||
+	    ops->ioctl_nr_base + ops->ioctl_nr_count > DFL_FEATURE_IOCTL_NR) {
+		fdata->ioctl_unindexed++;
+		return;
+	}
+
+	/* the first sub feature in the list wins, as with walking the list */
+	for (nr = ops->ioctl_nr_base;
+	     nr < ops->ioctl_nr_base + ops->ioctl_nr_count; nr++)
+		if (!fdata->ioctl_index[nr] || fdata->ioctl_index[nr] > idx)
+			fdata->ioctl_index[nr] = idx;
+}
+
+/**
+ * dfl_feature_dev_ioctl - dispatch an ioctl command to sub features
+ * @fdata: feature dev data.
+ * @cmd: ioctl command.
+ * @arg: ioctl argument.
+ *
+ * The sub feature which claimed the command number is found in the ioctl
+ * index of the feature dev. Only sub features without an ioctl range are
+ * offered the command one after another.
+ *
+ * Return: the return value of the sub feature's ioctl, or -EINVAL if no sub
+ * feature handled the command.
+ */
+long dfl_feature_dev_ioctl(struct dfl_feature_dev_data *fdata,
+			   unsigned int cmd, unsigned long arg)
+{
+	struct platform_device *pdev = fdata->dev;
+	struct dfl_feature *f, *indexed = NULL;
+	long ret;
+	u8 idx;
+
+	/*
+	 * Sub-feature's ioctl returns -ENODEV when cmd is not handled in
+	 * this sub feature, and returns 0 or other error code if cmd is
+	 * handled.
+	 */
+	if (_IOC_TYPE(cmd) == DFL_FPGA_MAGIC) {
+		idx = fdata->ioctl_index[_IOC_NR(cmd)];
+		if (idx) {
+			indexed = &fdata->features[idx - 1];
+			ret = indexed->ops->ioctl(pdev, indexed, cmd, arg);
+			if (ret != -ENODEV)
+				return ret;
+		}
+	}
+
+	if (!fdata->ioctl_unindexed)
+		return -EINVAL;
+
+	dfl_fpga_dev_for_each_feature(fdata, f) {
+		if (f != indexed && f->ops && f->ops->ioctl) {
+			ret = f->ops->ioctl(pdev, f, cmd, arg);
+			if (ret != -ENODEV)
+				return ret;
+		}
+	}
+
+	return -EINVAL;
+}
+EXPORT_SYMBOL_GPL(dfl_feature_dev_ioctl);
+
+#ifdef DFL_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define dfl_uring_cmd_payload(ioucmd)	io_uring_sqe_cmd((ioucmd)->sqe)
+#else
+#define dfl_uring_cmd_payload(ioucmd)	((ioucmd)->cmd)
+#endif
+
+/**
+ * dfl_fpga_uring_cmd - issue an io_uring command as an ioctl
+ * @ioucmd: io_uring command, its cmd_op is the ioctl number.
+ * @issue_flags: io_uring issue flags.
+ * @cmds: ioctl numbers which are taken as io_uring commands.
+ * @nr_cmds: number of @cmds.
+ * @ioctl: unlocked_ioctl of the device file.
+ *
+ * All these ioctls may block. If io_uring issues the command without
+ * blocking, it is handed back to be issued again from an io_uring worker,
+ * which completes it with the return value of the ioctl.
+ *
+ * Return: the return value of the ioctl, -EAGAIN to be issued again from a
+ * worker, or -ENOTTY if the ioctl is not taken as io_uring command.
+ */
+int dfl_fpga_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags,
+		       const unsigned int *cmds, unsigned int nr_cmds,
+		       long (*ioctl)(struct file *, unsigned int, unsigned long))
+{
+	const struct dfl_fpga_uring_cmd *cmd = dfl_uring_cmd_payload(ioucmd);
+	unsigned int i;
+
+	for (i = 0; i < nr_cmds; i++)
+		if (cmds[i] == ioucmd->cmd_op)
+			break;
+
+	if (i == nr_cmds)
+		return -ENOTTY;
+
+	if (issue_flags & IO_URING_F_NONBLOCK)
+		return -EAGAIN;
+
+	return ioctl(ioucmd->file, ioucmd->cmd_op, READ_ONCE(cmd->arg));
+}
+EXPORT_SYMBOL_GPL(dfl_fpga_uring_cmd);
+#endif /* DFL_URING_CMD */
+
+/*
+ * The whole AFU resource belongs to the port, but only its header is mapped,
+ * see PORT_AFU_HDR_SIZE.
+ */
+static void __iomem *dfl_afu_ioremap_header(struct platform_device *pdev,
+					    struct dfl_feature *feature)
+{
+	struct resource *res = &pdev->resource[feature->resource_index];
+	void __iomem *base;
+
+	if (!devm_request_mem_region(&pdev->dev, res->start, resource_size(res),
+				     dev_name(&pdev->dev)))
+		return IOMEM_ERR_PTR(-EBUSY);
+
+	base = devm_ioremap(&pdev->dev, res->start,
+			    min_t(resource_size_t, resource_size(res),
+				  PORT_AFU_HDR_SIZE));
+
+	return base ? base : IOMEM_ERR_PTR(-ENOMEM);
+}
+
 static int dfl_feature_instance_init(struct platform_device *pdev,
 				     struct dfl_feature *feature,
 				     struct dfl_feature_driver *drv)
@@ -575,8 +896,11 @@ static int dfl_feature_instance_init(struct platform_device *pdev,
 	int ret = 0;
 
 	if (!is_header_feature(feature)) {
-		base = devm_platform_ioremap_resource(pdev,
-						      feature->resource_index);
+		if (feature->id == FEATURE_ID_AFU)
+			base = dfl_afu_ioremap_header(pdev, feature);
+		else
+			base = devm_platform_ioremap_resource(pdev,
+							      feature->resource_index);
 		if (IS_ERR(base)) {
 			dev_err(&pdev->dev,
 				"ioremap failed for feature 0x%x!\n",
@@ -594,6 +918,8 @@ static int dfl_feature_instance_init(struct platform_device *pdev,
 	}
 
 	feature->ops = drv->ops;
+	dfl_feature_ioctl_index_add(to_dfl_feature_dev_data(&pdev->dev),
+				    feature);
 
 	return ret;
 }
@@ -648,6 +974,8 @@ int dfl_fpga_dev_feature_init(struct platform_device *pdev,
 	if (ret)
 		goto exit;
 
+	dfl_debugfs_add(fdata);
+
 	return 0;
 exit:
 	dfl_fpga_dev_feature_uinit(pdev);
@@ -735,6 +1063,25 @@ void dfl_fpga_dev_ops_unregister(struct platform_device *pdev)
 }
 EXPORT_SYMBOL_GPL(dfl_fpga_dev_ops_unregister);
 
+#define DFL_SHADOW_CHUNK_SIZE	SZ_4K
+#define DFL_SHADOW_CHUNK_QWORDS	(DFL_SHADOW_CHUNK_SIZE / sizeof(u64))
+
+/**
+ * struct dfl_shadow_chunk - RAM shadow of one chunk of a DFL register region
+ *
+ * @valid: bitmap of qwords which have already been read from MMIO.
+ * @data: shadowed register values.
+ *
+ * Uncached MMIO reads are not combined, so bulk copying a whole region would
+ * cost far more reads than walking the list. Instead, every register is read
+ * from the device at most once and all further accesses during enumeration
+ * are served from RAM.
+ */
+struct dfl_shadow_chunk {
+	DECLARE_BITMAP(valid, DFL_SHADOW_CHUNK_QWORDS);
+	u64 data[DFL_SHADOW_CHUNK_QWORDS];
+};
+
 /**
  * struct build_feature_devs_info - info collected during feature dev build.
  *
@@ -747,8 +1094,15 @@ EXPORT_SYMBOL_GPL(dfl_fpga_dev_ops_unregister);
  * @ioaddr: header register region address of current FIU in enumeration.
  * @start: register resource start of current FIU.
  * @len: max register resource length of current FIU.
+ * @shadow: RAM shadow of the register region, one chunk pointer per
+ *	    DFL_SHADOW_CHUNK_SIZE bytes, or NULL if shadowing is disabled.
+ * @shadow_chunks: number of chunk pointers in @shadow.
+ * @mmio_reads: number of 64-bit MMIO reads issued during enumeration.
  * @sub_features: a sub features linked list for feature device in enumeration.
  * @feature_num: number of sub features for feature device in enumeration.
+ * @feature_devs: list of feature devices found, in order of discovery.
+ * @dfl: device feature list to parse in asynchronous enumeration.
+ * @ret: result of asynchronous parsing of @dfl.
  */
 struct build_feature_devs_info {
 	struct device *dev;
@@ -760,10 +1114,102 @@ struct build_feature_devs_info {
 	void __iomem *ioaddr;
 	resource_size_t start;
 	resource_size_t len;
+	struct dfl_shadow_chunk **shadow;
+	unsigned long shadow_chunks;
+	unsigned int mmio_reads;
+	struct list_head sub_features;
+	int feature_num;
+	struct list_head feature_devs;
+	struct dfl_fpga_enum_dfl *dfl;
+	int ret;
+};
+
+/**
+ * struct build_feature_dev - feature device found during enumeration
+ *
+ * @node: node in feature_devs linked list of build_feature_devs_info.
+ * @type: type of DFL FIU of the feature device.
+ * @sub_features: sub features linked list of the feature device.
+ * @feature_num: number of sub features of the feature device.
+ * @fdata: dfl enumeration data created for the feature device.
+ * @ret: result of the feature device registration.
+ */
+struct build_feature_dev {
+	struct list_head node;
+	enum dfl_id_type type;
 	struct list_head sub_features;
 	int feature_num;
+	struct dfl_feature_dev_data *fdata;
+	int ret;
 };
 
+static int dfl_shadow_alloc(struct build_feature_devs_info *binfo)
+{
+	if (!shadow_dfl)
+		return 0;
+
+	binfo->shadow_chunks = DIV_ROUND_UP(binfo->len, DFL_SHADOW_CHUNK_SIZE);
+	binfo->shadow = kvcalloc(binfo->shadow_chunks, sizeof(*binfo->shadow),
+				 GFP_KERNEL);
+	if (!binfo->shadow)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void dfl_shadow_free(struct build_feature_devs_info *binfo)
+{
+	unsigned long i;
+
+	if (!binfo->shadow)
+		return;
+
+	for (i = 0; i < binfo->shadow_chunks; i++)
+		kfree(binfo->shadow[i]);
+
+	kvfree(binfo->shadow);
+	binfo->shadow = NULL;
+	binfo->shadow_chunks = 0;
+}
+
+/*
+ * read a 64-bit register at @ofst of the register region in enumeration,
+ * from the RAM shadow if it has been read before.
+ */
+static u64 dfl_readq(struct build_feature_devs_info *binfo,
+		     resource_size_t ofst)
+{
+	struct dfl_shadow_chunk *chunk;
+	unsigned long idx, bit;
+
+	if (!binfo->shadow || !IS_ALIGNED(ofst, sizeof(u64)) ||
+	    ofst + sizeof(u64) > binfo->len)
+		goto read_mmio;
+
+	idx = ofst / DFL_SHADOW_CHUNK_SIZE;
+	bit = (ofst % DFL_SHADOW_CHUNK_SIZE) / sizeof(u64);
+
+	chunk = binfo->shadow[idx];
+	if (!chunk) {
+		chunk = kzalloc(sizeof(*chunk), GFP_KERNEL);
+		if (!chunk)
+			goto read_mmio;
+		binfo->shadow[idx] = chunk;
+	}
+
+	if (!test_bit(bit, chunk->valid)) {
+		chunk->data[bit] = readq(binfo->ioaddr + ofst);
+		binfo->mmio_reads++;
+		__set_bit(bit, chunk->valid);
+	}
+
+	return chunk->data[bit];
+
+read_mmio:
+	binfo->mmio_reads++;
+	return readq(binfo->ioaddr + ofst);
+}
+
 /**
  * struct dfl_feature_info - sub feature info collected during feature dev build
  *
@@ -817,10 +1263,60 @@ static void dfl_id_free_action(void *arg)
 	dfl_id_free(fdata->type, fdata->pdev_id);
 }
 
+static void dfl_irq_latency_account(u64 *hist, u64 ns)
+{
+	hist[min_t(unsigned int, fls64(ns), DFL_IRQ_LATENCY_BUCKETS - 1)]++;
+}
+
+/* signal the eventfd of a vector, with the moderation lock held */
+static void dfl_irq_deliver(struct dfl_feature_irq_ctx *ctx)
+{
+	struct dfl_irq_latency *lat = &ctx->latency;
+	u64 ns;
+
+	/* irq_ts is only set while latencies are measured */
+	if (unlikely(lat->irq_ts)) {
+		ns = ktime_get_ns() - lat->irq_ts;
+		lat->irq_ts = 0;
+		lat->signals++;
+		dfl_irq_latency_account(lat->signal_hist, ns);
+		trace_dfl_irq_signal(ctx->irq, ns);
+	}
+
+	ctx->delivered++;
+	eventfd_signal(ctx->trigger);
+}
+
+/* signal the eventfd of a vector for the interrupts suppressed by moderation */
+static enum hrtimer_restart dfl_irq_moderation_timer(struct hrtimer *timer)
+{
+	struct dfl_feature_irq_ctx *ctx =
+		container_of(timer, struct dfl_feature_irq_ctx, timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	ctx->pending = false;
+	ctx->last = ktime_get();
+	if (ctx->trigger)
+		dfl_irq_deliver(ctx);
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void dfl_feature_irq_ctx_init(struct dfl_feature_irq_ctx *ctx, int irq)
+{
+	ctx->irq = irq;
+	spin_lock_init(&ctx->lock);
+	hrtimer_setup(&ctx->timer, dfl_irq_moderation_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+}
+
 static struct dfl_feature_dev_data *
-binfo_create_feature_dev_data(struct build_feature_devs_info *binfo)
+binfo_create_feature_dev_data(struct build_feature_devs_info *binfo,
+			      struct build_feature_dev *bdev)
 {
-	enum dfl_id_type type = binfo->type;
+	enum dfl_id_type type = bdev->type;
 	struct dfl_feature_info *finfo, *p;
 	struct dfl_feature_dev_data *fdata;
 	int ret, index = 0, res_idx = 0;
@@ -832,12 +1328,12 @@ binfo_create_feature_dev_data(struct build_feature_devs_info *binfo)
 	if (!fdata)
 		return ERR_PTR(-ENOMEM);
 
-	fdata->features = devm_kcalloc(binfo->dev, binfo->feature_num,
+	fdata->features = devm_kcalloc(binfo->dev, bdev->feature_num,
 				       sizeof(*fdata->features), GFP_KERNEL);
 	if (!fdata->features)
 		return ERR_PTR(-ENOMEM);
 
-	fdata->resources = devm_kcalloc(binfo->dev, binfo->feature_num,
+	fdata->resources = devm_kcalloc(binfo->dev, bdev->feature_num,
 					sizeof(*fdata->resources), GFP_KERNEL);
 	if (!fdata->resources)
 		return ERR_PTR(-ENOMEM);
@@ -853,10 +1349,12 @@ binfo_create_feature_dev_data(struct build_feature_devs_info *binfo)
 		return ERR_PTR(ret);
 
 	fdata->pdev_name = dfl_devs[type].name;
-	fdata->num = binfo->feature_num;
+	fdata->num = bdev->feature_num;
+	INIT_LIST_HEAD(&fdata->afu_features);
 	fdata->dfl_cdev = binfo->cdev;
 	fdata->id = FEATURE_DEV_ID_UNUSED;
 	mutex_init(&fdata->lock);
+	mutex_init(&fdata->reset_lock);
 	lockdep_set_class_and_name(&fdata->lock, &dfl_pdata_keys[type],
 				   dfl_pdata_key_strings[type]);
 
@@ -869,7 +1367,7 @@ binfo_create_feature_dev_data(struct build_feature_devs_info *binfo)
 	WARN_ON(fdata->disable_count);
 
 	/* fill features and resource information for feature dev */
-	list_for_each_entry_safe(finfo, p, &binfo->sub_features, node) {
+	list_for_each_entry_safe(finfo, p, &bdev->sub_features, node) {
 		struct dfl_feature *feature = &fdata->features[index++];
 		struct dfl_feature_irq_ctx *ctx;
 		unsigned int i;
@@ -878,6 +1376,8 @@ binfo_create_feature_dev_data(struct build_feature_devs_info *binfo)
 		feature->id = finfo->fid;
 		feature->revision = finfo->revision;
 		feature->dfh_version = finfo->dfh_version;
+		feature->mmio_start = finfo->mmio_res.start;
+		feature->mmio_size = resource_size(&finfo->mmio_res);
 
 		if (finfo->param_size) {
 			feature->params = devm_kmemdup(binfo->dev,
@@ -916,11 +1416,12 @@ binfo_create_feature_dev_data(struct build_feature_devs_info *binfo)
 				return ERR_PTR(-ENOMEM);
 
 			for (i = 0; i < finfo->nr_irqs; i++)
-				ctx[i].irq =
-					binfo->irq_table[finfo->irq_base + i];
+				dfl_feature_irq_ctx_init(&ctx[i],
+					binfo->irq_table[finfo->irq_base + i]);
 
 			feature->irq_ctx = ctx;
 			feature->nr_irqs = finfo->nr_irqs;
+			feature->irq_base = finfo->irq_base;
 		}
 
 		list_del(&finfo->node);
@@ -929,13 +1430,21 @@ binfo_create_feature_dev_data(struct build_feature_devs_info *binfo)
 
 	fdata->resource_num = res_idx;
 
+	/*
+	 * index sub features by id. Adding them in reverse order keeps the
+	 * first one of sub features with the same id in front of its bucket.
+	 */
+	hash_init(fdata->feature_index);
+	for (index = fdata->num - 1; index >= 0; index--)
+		hash_add(fdata->feature_index,
+			 &fdata->features[index].index_node,
+			 fdata->features[index].id);
+
 	return fdata;
 }
 
 /*
- * register current feature device, it is called when we need to switch to
- * another feature parsing or we have parsed all features on given device
- * feature list.
+ * register a feature device as platform device under the container device.
  */
 static int feature_dev_register(struct dfl_feature_dev_data *fdata)
 {
@@ -995,76 +1504,159 @@ static void feature_dev_unregister(struct dfl_feature_dev_data *fdata)
 		feature->dev = NULL;
 }
 
+/*
+ * save the feature device found on the device feature list in enumeration, it
+ * is called when we need to switch to another feature parsing or we have
+ * parsed all features on given device feature list. The feature device is
+ * created and registered by build_info_create_devs() later.
+ */
 static int build_info_commit_dev(struct build_feature_devs_info *binfo)
 {
-	struct dfl_feature_dev_data *fdata;
-	int ret;
-
-	fdata = binfo_create_feature_dev_data(binfo);
-	if (IS_ERR(fdata))
-		return PTR_ERR(fdata);
+	struct build_feature_dev *bdev;
 
-	ret = feature_dev_register(fdata);
-	if (ret)
-		return ret;
+	bdev = kzalloc(sizeof(*bdev), GFP_KERNEL);
+	if (!bdev)
+		return -ENOMEM;
 
-	if (binfo->type == PORT_ID)
-		dfl_fpga_cdev_add_port_data(binfo->cdev, fdata);
-	else if (binfo->type == PRIV_FEAT_ID)
-		dfl_fpga_cdev_add_priv_feat_data(binfo->cdev, fdata);
-	else
-		binfo->cdev->fme_dev = get_device(&fdata->dev->dev);
+	bdev->type = binfo->type;
+	bdev->feature_num = binfo->feature_num;
+	INIT_LIST_HEAD(&bdev->sub_features);
+	list_splice_init(&binfo->sub_features, &bdev->sub_features);
+	list_add_tail(&bdev->node, &binfo->feature_devs);
 
 	/* reset the binfo for next FIU */
 	binfo->type = DFL_ID_MAX;
+	binfo->feature_num = 0;
 
 	return 0;
 }
 
-static void build_info_free(struct build_feature_devs_info *binfo)
+static void build_feature_dev_free(struct build_feature_dev *bdev)
 {
 	struct dfl_feature_info *finfo, *p;
 
-	if (!list_empty(&binfo->sub_features)) {
-		list_for_each_entry_safe(finfo, p, &binfo->sub_features, node) {
-			list_del(&finfo->node);
-			kfree(finfo);
-		}
+	list_for_each_entry_safe(finfo, p, &bdev->sub_features, node) {
+		list_del(&finfo->node);
+		kfree(finfo);
 	}
 
-	devm_kfree(binfo->dev, binfo);
+	list_del(&bdev->node);
+	kfree(bdev);
 }
 
-static inline u32 feature_size(void __iomem *dfh_ioaddr, void __iomem *end, u64 value)
+static void feature_dev_register_async(void *data, async_cookie_t cookie)
 {
-	u32 ofst = FIELD_GET(DFH_NEXT_HDR_OFST, value);
-	/* workaround for private features with invalid size, use 4K instead */
-	if (!ofst)
-		return 4096;
+	struct build_feature_dev *bdev = data;
 
-	if (value & DFH_EOL)
-		return ofst;
+	bdev->ret = feature_dev_register(bdev->fdata);
+}
 
-	do {
-		value = readq(dfh_ioaddr + ofst);
+/*
+ * create and register all feature devices found in enumeration. The ids of
+ * the feature devices are allocated in order of discovery before any of them
+ * is registered, so they do not depend on the order in which device feature
+ * lists are parsed or feature devices are registered.
+ */
+static int build_info_create_devs(struct build_feature_devs_info *binfo)
+{
+	struct build_feature_dev *bdev;
+	int ret = 0;
 
-		if (FIELD_GET(DFH_TYPE, value) != DFH_TYPE_INTERFACE)
-			return ofst;
+	list_for_each_entry(bdev, &binfo->feature_devs, node) {
+		bdev->fdata = binfo_create_feature_dev_data(binfo, bdev);
+		if (IS_ERR(bdev->fdata))
+			return PTR_ERR(bdev->fdata);
+	}
 
-		ofst += FIELD_GET(DFH_NEXT_HDR_OFST, value);
+	list_for_each_entry(bdev, &binfo->feature_devs, node) {
+		if (async_enum) {
+			async_schedule_domain(feature_dev_register_async, bdev,
+					      &dfl_async_domain);
+			continue;
+		}
 
-		if (value & DFH_EOL)
-			return ofst;
+		bdev->ret = feature_dev_register(bdev->fdata);
+		if (bdev->ret)
+			return bdev->ret;
+	}
 
-	} while ((dfh_ioaddr + ofst) < end);
+	if (async_enum)
+		async_synchronize_full_domain(&dfl_async_domain);
 
-	return 0;
-}
+	list_for_each_entry(bdev, &binfo->feature_devs, node) {
+		struct dfl_feature_dev_data *fdata = bdev->fdata;
 
-static u16 feature_id(u64 value)
-{
-	u16 id = FIELD_GET(DFH_ID, value);
-	u8 type = FIELD_GET(DFH_TYPE, value);
+		if (bdev->ret) {
+			ret = ret ? ret : bdev->ret;
+			continue;
+		}
+
+		if (fdata->type == PORT_ID)
+			dfl_fpga_cdev_add_port_data(binfo->cdev, fdata);
+		else if (fdata->type == PRIV_FEAT_ID)
+			dfl_fpga_cdev_add_priv_feat_data(binfo->cdev, fdata);
+		else
+			binfo->cdev->fme_dev = get_device(&fdata->dev->dev);
+	}
+
+	return ret;
+}
+
+static void build_info_release(struct build_feature_devs_info *binfo)
+{
+	struct build_feature_dev *bdev, *tmp;
+	struct dfl_feature_info *finfo, *p;
+
+	if (!list_empty(&binfo->sub_features)) {
+		list_for_each_entry_safe(finfo, p, &binfo->sub_features, node) {
+			list_del(&finfo->node);
+			kfree(finfo);
+		}
+	}
+
+	list_for_each_entry_safe(bdev, tmp, &binfo->feature_devs, node)
+		build_feature_dev_free(bdev);
+
+	dfl_shadow_free(binfo);
+}
+
+static void build_info_free(struct build_feature_devs_info *binfo)
+{
+	build_info_release(binfo);
+	devm_kfree(binfo->dev, binfo);
+}
+
+static u32 feature_size(struct build_feature_devs_info *binfo,
+			resource_size_t dfh_ofst, u64 value)
+{
+	u32 ofst = FIELD_GET(DFH_NEXT_HDR_OFST, value);
+	/* workaround for private features with invalid size, use 4K instead */
+	if (!ofst)
+		return 4096;
+
+	if (value & DFH_EOL)
+		return ofst;
+
+	do {
+		value = dfl_readq(binfo, dfh_ofst + ofst);
+
+		if (FIELD_GET(DFH_TYPE, value) != DFH_TYPE_INTERFACE)
+			return ofst;
+
+		ofst += FIELD_GET(DFH_NEXT_HDR_OFST, value);
+
+		if (value & DFH_EOL)
+			return ofst;
+
+	} while (dfh_ofst + ofst < binfo->len);
+
+	return 0;
+}
+
+static u16 feature_id(u64 value)
+{
+	u16 id = FIELD_GET(DFH_ID, value);
+	u8 type = FIELD_GET(DFH_TYPE, value);
 
 	if (type == DFH_TYPE_FIU)
 		return FEATURE_ID_FIU_HEADER;
@@ -1130,7 +1722,6 @@ EXPORT_SYMBOL_GPL(dfh_find_param);
 static int parse_feature_irqs(struct build_feature_devs_info *binfo,
 			      resource_size_t ofst, struct dfl_feature_info *finfo)
 {
-	void __iomem *base = binfo->ioaddr + ofst;
 	unsigned int i, ibase, inr = 0;
 	void *params = finfo->params;
 	enum dfl_id_type type;
@@ -1151,12 +1742,12 @@ static int parse_feature_irqs(struct build_feature_devs_info *binfo,
 		if (type == PORT_ID) {
 			switch (fid) {
 			case PORT_FEATURE_ID_UINT:
-				v = readq(base + PORT_UINT_CAP);
+				v = dfl_readq(binfo, ofst + PORT_UINT_CAP);
 				ibase = FIELD_GET(PORT_UINT_CAP_FST_VECT, v);
 				inr = FIELD_GET(PORT_UINT_CAP_INT_NUM, v);
 				break;
 			case PORT_FEATURE_ID_ERROR:
-				v = readq(base + PORT_ERROR_CAP);
+				v = dfl_readq(binfo, ofst + PORT_ERROR_CAP);
 				ibase = FIELD_GET(PORT_ERROR_CAP_INT_VECT, v);
 				inr = FIELD_GET(PORT_ERROR_CAP_SUPP_INT, v);
 				break;
@@ -1164,7 +1755,7 @@ static int parse_feature_irqs(struct build_feature_devs_info *binfo,
 		} else if (type == FME_ID) {
 			switch (fid) {
 			case FME_FEATURE_ID_GLOBAL_ERR:
-				v = readq(base + FME_ERROR_CAP);
+				v = dfl_readq(binfo, ofst + FME_ERROR_CAP);
 				ibase = FIELD_GET(FME_ERROR_CAP_INT_VECT, v);
 				inr = FIELD_GET(FME_ERROR_CAP_SUPP_INT, v);
 				break;
@@ -1222,17 +1813,18 @@ static int parse_feature_irqs(struct build_feature_devs_info *binfo,
 	return 0;
 }
 
-static int dfh_get_param_size(void __iomem *dfh_base, resource_size_t max)
+static int dfh_get_param_size(struct build_feature_devs_info *binfo,
+			      resource_size_t dfh_ofst, resource_size_t max)
 {
 	int size = 0;
 	u64 v, next;
 
 	if (!FIELD_GET(DFHv1_CSR_SIZE_GRP_HAS_PARAMS,
-		       readq(dfh_base + DFHv1_CSR_SIZE_GRP)))
+		       dfl_readq(binfo, dfh_ofst + DFHv1_CSR_SIZE_GRP)))
 		return 0;
 
 	while (size + DFHv1_PARAM_HDR < max) {
-		v = readq(dfh_base + DFHv1_PARAM_HDR + size);
+		v = dfl_readq(binfo, dfh_ofst + DFHv1_PARAM_HDR + size);
 
 		next = FIELD_GET(DFHv1_PARAM_HDR_NEXT_OFFSET, v);
 		if (!next) {
@@ -1262,6 +1854,26 @@ static void backport_memcpy_fromio(u64 *to, const volatile void __iomem *from, s
 #define memcpy_fromio backport_memcpy_fromio
 #endif
 
+/*
+ * copy @size bytes of registers at @ofst of the register region in
+ * enumeration. Registers which are already in the RAM shadow are not read
+ * from the device again.
+ */
+static void dfl_read_block(struct build_feature_devs_info *binfo,
+			   resource_size_t ofst, u64 *to, size_t size)
+{
+	size_t i;
+
+	if (!binfo->shadow) {
+		memcpy_fromio(to, binfo->ioaddr + ofst, size);
+		binfo->mmio_reads += DIV_ROUND_UP(size, sizeof(u64));
+		return;
+	}
+
+	for (i = 0; i < size / sizeof(u64); i++)
+		to[i] = dfl_readq(binfo, ofst + i * sizeof(u64));
+}
+
 /*
  * when create sub feature instances, for private features, it doesn't need
  * to provide resource size and feature id as they could be read from DFH
@@ -1284,20 +1896,19 @@ create_feature_instance(struct build_feature_devs_info *binfo,
 	int ret;
 
 	if (fid != FEATURE_ID_AFU) {
-		v = readq(binfo->ioaddr + ofst);
+		v = dfl_readq(binfo, ofst);
 		revision = FIELD_GET(DFH_REVISION, v);
 		dfh_ver = FIELD_GET(DFH_VERSION, v);
 
 		/* read feature size and id if inputs are invalid */
-		size = size ? size : feature_size(binfo->ioaddr + ofst,
-						  binfo->ioaddr + binfo->len, v);
+		size = size ? size : feature_size(binfo, ofst, v);
 		if (!size) {
 			dev_err(binfo->dev, "illegal feature with size of 0\n");
 			return -EINVAL;
 		}
 		fid = fid ? fid : feature_id(v);
 		if (dfh_ver == 1) {
-			dfh_psize = dfh_get_param_size(binfo->ioaddr + ofst, size);
+			dfh_psize = dfh_get_param_size(binfo, ofst, size);
 			if (dfh_psize < 0) {
 				dev_err(binfo->dev,
 					"failed to read size of DFHv1 parameters %d\n",
@@ -1315,14 +1926,14 @@ create_feature_instance(struct build_feature_devs_info *binfo,
 	if (!finfo)
 		return -ENOMEM;
 
-	memcpy_fromio(finfo->params, binfo->ioaddr + ofst + DFHv1_PARAM_HDR, dfh_psize);
+	dfl_read_block(binfo, ofst + DFHv1_PARAM_HDR, finfo->params, dfh_psize);
 	finfo->param_size = dfh_psize;
 
 	finfo->fid = fid;
 	finfo->revision = revision;
 	finfo->dfh_version = dfh_ver;
 	if (dfh_ver == 1) {
-		v = readq(binfo->ioaddr + ofst + DFHv1_CSR_ADDR);
+		v = dfl_readq(binfo, ofst + DFHv1_CSR_ADDR);
 		addr_off = FIELD_GET(DFHv1_CSR_ADDR_MASK, v) << 1;
 
 		if (FIELD_GET(DFHv1_CSR_ADDR_REL, v)) {
@@ -1333,7 +1944,7 @@ create_feature_instance(struct build_feature_devs_info *binfo,
 			rel_addr = true;
 		}
 
-		v = readq(binfo->ioaddr + ofst + DFHv1_CSR_SIZE_GRP);
+		v = dfl_readq(binfo, ofst + DFHv1_CSR_SIZE_GRP);
 		csr_size = FIELD_GET(DFHv1_CSR_SIZE_GRP_SIZE, v);
 		end = csr_size ? (start + csr_size - 1) : start;
 
@@ -1350,8 +1961,8 @@ create_feature_instance(struct build_feature_devs_info *binfo,
 			return 0;
 		}
 
-		guid_l = readq(binfo->ioaddr + ofst + GUID_L);
-		guid_h = readq(binfo->ioaddr + ofst + GUID_H);
+		guid_l = dfl_readq(binfo, ofst + GUID_L);
+		guid_h = dfl_readq(binfo, ofst + GUID_H);
 
 		if (guid_l || guid_h) {
 			dev_dbg(binfo->dev, "dfl: GUID_H = 0x%llx , GUID_L = 0x%llx\n",
@@ -1392,7 +2003,7 @@ create_feature_instance(struct build_feature_devs_info *binfo,
 static int parse_feature_port_afu(struct build_feature_devs_info *binfo,
 				  resource_size_t ofst)
 {
-	u64 v = readq(binfo->ioaddr + PORT_HDR_CAP);
+	u64 v = dfl_readq(binfo, PORT_HDR_CAP);
 	u32 size = FIELD_GET(PORT_CAP_MMIO_SIZE, v) << 10;
 
 	WARN_ON(!size);
@@ -1443,11 +2054,12 @@ static int build_info_prepare(struct build_feature_devs_info *binfo,
 	binfo->len = len;
 	binfo->ioaddr = ioaddr;
 
-	return 0;
+	return dfl_shadow_alloc(binfo);
 }
 
 static void build_info_complete(struct build_feature_devs_info *binfo)
 {
+	dfl_shadow_free(binfo);
 	devm_iounmap(binfo->dev, binfo->ioaddr);
 	devm_release_mem_region(binfo->dev, binfo->start, binfo->len);
 }
@@ -1474,7 +2086,7 @@ static int parse_feature_fiu(struct build_feature_devs_info *binfo,
 			return ret;
 	}
 
-	v = readq(binfo->ioaddr + DFH);
+	v = dfl_readq(binfo, DFH);
 	id = FIELD_GET(DFH_ID, v);
 
 	type = dfh_id_to_type(id);
@@ -1492,7 +2104,7 @@ static int parse_feature_fiu(struct build_feature_devs_info *binfo,
 	 * find and parse FIU's child AFU via its NEXT_AFU register.
 	 * please note that only Port has valid NEXT_AFU pointer per spec.
 	 */
-	v = readq(binfo->ioaddr + NEXT_AFU);
+	v = dfl_readq(binfo, NEXT_AFU);
 
 	offset = FIELD_GET(NEXT_AFU_NEXT_DFH_OFST, v);
 	if (offset)
@@ -1509,12 +2121,12 @@ static int parse_feature_private(struct build_feature_devs_info *binfo,
 	u8 dfh_ver;
 	u64 v;
 
-	v = readq(binfo->ioaddr + DFH);
+	v = dfl_readq(binfo, DFH);
 	dfh_ver = FIELD_GET(DFH_VERSION, v);
 
 	if (dfh_ver == 0 && !is_feature_dev_detected(binfo)) {
 		dev_err(binfo->dev, "the private feature 0x%x does not belong to any AFU.\n",
-			feature_id(readq(binfo->ioaddr + ofst)));
+			feature_id(dfl_readq(binfo, ofst)));
 		return -EINVAL;
 	}
 
@@ -1536,7 +2148,7 @@ static int parse_feature(struct build_feature_devs_info *binfo,
 	u64 v;
 	u32 type;
 
-	v = readq(binfo->ioaddr + ofst + DFH);
+	v = dfl_readq(binfo, ofst + DFH);
 	type = FIELD_GET(DFH_TYPE, v);
 
 	switch (type) {
@@ -1579,7 +2191,7 @@ static int parse_feature_list(struct build_feature_devs_info *binfo,
 		if (ret)
 			return ret;
 
-		v = readq(binfo->ioaddr + start - binfo->start + DFH);
+		v = dfl_readq(binfo, start - binfo->start + DFH);
 		ofst = FIELD_GET(DFH_NEXT_HDR_OFST, v);
 
 		/* stop parsing if EOL(End of List) is set or offset is 0 */
@@ -1596,6 +2208,70 @@ static int parse_feature_list(struct build_feature_devs_info *binfo,
 	return ret;
 }
 
+static void parse_feature_list_async(void *data, async_cookie_t cookie)
+{
+	struct build_feature_devs_info *binfo = data;
+
+	binfo->ret = parse_feature_list(binfo, binfo->dfl->start,
+					binfo->dfl->len);
+}
+
+/*
+ * parse all device feature lists of the enumeration info at the same time,
+ * each with its own build info. The feature devices found are then gathered
+ * in @binfo in the order of the device feature lists, the same order as
+ * sequential parsing would find them.
+ */
+static int parse_feature_lists_async(struct build_feature_devs_info *binfo,
+				     struct dfl_fpga_enum_info *info)
+{
+	struct build_feature_devs_info *binfos, *b;
+	struct dfl_fpga_enum_dfl *dfl;
+	unsigned int i, num = 0;
+	int ret = 0;
+
+	list_for_each_entry(dfl, &info->dfls, node)
+		num++;
+
+	if (!num)
+		return 0;
+
+	binfos = kcalloc(num, sizeof(*binfos), GFP_KERNEL);
+	if (!binfos)
+		return -ENOMEM;
+
+	b = binfos;
+	list_for_each_entry(dfl, &info->dfls, node) {
+		b->type = DFL_ID_MAX;
+		b->dev = binfo->dev;
+		b->cdev = binfo->cdev;
+		b->nr_irqs = binfo->nr_irqs;
+		b->irq_table = binfo->irq_table;
+		b->dfl = dfl;
+		INIT_LIST_HEAD(&b->sub_features);
+		INIT_LIST_HEAD(&b->feature_devs);
+
+		async_schedule_domain(parse_feature_list_async, b,
+				      &dfl_async_domain);
+		b++;
+	}
+
+	async_synchronize_full_domain(&dfl_async_domain);
+
+	for (i = 0, b = binfos; i < num; i++, b++) {
+		if (b->ret && !ret)
+			ret = b->ret;
+
+		binfo->mmio_reads += b->mmio_reads;
+		list_splice_tail_init(&b->feature_devs, &binfo->feature_devs);
+		build_info_release(b);
+	}
+
+	kfree(binfos);
+
+	return ret;
+}
+
 struct dfl_fpga_enum_info *dfl_fpga_enum_info_alloc(struct device *dev)
 {
 	struct dfl_fpga_enum_info *info;
@@ -1755,6 +2431,18 @@ dfl_fpga_feature_devs_enumerate(struct dfl_fpga_enum_info *info)
 
 	INIT_LIST_HEAD(&cdev->priv_feat_dev_list);
 
+	/* keep the irq table for features found in AFUs after enumeration */
+	if (info->nr_irqs) {
+		cdev->irq_table = devm_kmemdup(info->dev, info->irq_table,
+					       sizeof(int) * info->nr_irqs,
+					       GFP_KERNEL);
+		if (!cdev->irq_table) {
+			ret = -ENOMEM;
+			goto free_cdev_exit;
+		}
+		cdev->nr_irqs = info->nr_irqs;
+	}
+
 	cdev->region = fpga_region_register(info->dev, NULL, NULL);
 	if (IS_ERR(cdev->region)) {
 		ret = PTR_ERR(cdev->region);
@@ -1772,6 +2460,7 @@ dfl_fpga_feature_devs_enumerate(struct dfl_fpga_enum_info *info)
 	binfo->dev = info->dev;
 	binfo->cdev = cdev;
 	INIT_LIST_HEAD(&binfo->sub_features);
+	INIT_LIST_HEAD(&binfo->feature_devs);
 
 	binfo->nr_irqs = info->nr_irqs;
 	if (info->nr_irqs)
@@ -1781,17 +2470,29 @@ dfl_fpga_feature_devs_enumerate(struct dfl_fpga_enum_info *info)
 	 * start enumeration for all feature devices based on Device Feature
 	 * Lists.
 	 */
-	if (!list_empty(&info->dfls)) {
+	if (async_enum) {
+		ret = parse_feature_lists_async(binfo, info);
+	} else {
 		list_for_each_entry(dfl, &info->dfls, node) {
 			ret = parse_feature_list(binfo, dfl->start, dfl->len);
-			if (ret) {
-				remove_feature_devs(cdev);
-				build_info_free(binfo);
-				goto unregister_region_exit;
-			}
+			if (ret)
+				break;
 		}
 	}
 
+	if (!ret)
+		ret = build_info_create_devs(binfo);
+
+	if (ret) {
+		remove_feature_devs(cdev);
+		build_info_free(binfo);
+		goto unregister_region_exit;
+	}
+
+	cdev->enum_mmio_reads = binfo->mmio_reads;
+	dev_dbg(info->dev, "enumeration done with %u MMIO reads%s\n",
+		cdev->enum_mmio_reads, shadow_dfl ? " (shadowed)" : "");
+
 	build_info_free(binfo);
 
 	return cdev;
@@ -1869,9 +2570,12 @@ static int __init dfl_fpga_init(void)
 	if (ret) {
 		dfl_ids_destroy();
 		bus_unregister(&dfl_bus_type);
+		return ret;
 	}
 
-	return ret;
+	dfl_debugfs_root = debugfs_create_dir("dfl", NULL);
+
+	return 0;
 }
 
 /**
@@ -1957,175 +2661,843 @@ unlock_exit:
 }
 EXPORT_SYMBOL_GPL(dfl_fpga_cdev_assign_port);
 
-static void config_port_access_mode(struct device *fme_dev, int port_id,
-				    bool is_vf)
+/*
+ * walk the device feature list chained from the AFU header at the start of
+ * the AFU region, and collect its private features in @binfo.
+ */
+static int parse_afu_feature_list(struct build_feature_devs_info *binfo)
 {
-	struct dfl_feature_dev_data *fdata = to_dfl_feature_dev_data(fme_dev);
-	void __iomem *base;
+	resource_size_t ofst = 0;
+	u32 next;
+	int ret;
 	u64 v;
 
-	base = dfl_get_feature_ioaddr_by_id(fdata, FME_FEATURE_ID_HEADER);
+	v = dfl_readq(binfo, DFH);
+	if (FIELD_GET(DFH_TYPE, v) != DFH_TYPE_AFU) {
+		dev_dbg(binfo->dev, "no AFU header found in AFU region\n");
+		return 0;
+	}
 
-	v = readq(base + FME_HDR_PORT_OFST(port_id));
+	for (;;) {
+		next = FIELD_GET(DFH_NEXT_HDR_OFST, v);
 
-	v &= ~FME_PORT_OFST_ACC_CTRL;
-	v |= FIELD_PREP(FME_PORT_OFST_ACC_CTRL,
-			is_vf ? FME_PORT_OFST_ACC_VF : FME_PORT_OFST_ACC_PF);
+		/* stop parsing if EOL(End of List) is set or offset is 0 */
+		if ((v & DFH_EOL) || !next)
+			break;
 
-	writeq(v, base + FME_HDR_PORT_OFST(port_id));
+		ofst += next;
+		if (ofst + DFH_SIZE > binfo->len) {
+			dev_err(binfo->dev, "AFU feature list exceeds AFU region\n");
+			return -EINVAL;
+		}
+
+		v = dfl_readq(binfo, ofst + DFH);
+		if (FIELD_GET(DFH_TYPE, v) != DFH_TYPE_PRIVATE)
+			continue;
+
+		ret = create_feature_instance(binfo, ofst, 0, 0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
 }
 
-#define config_port_vf_mode(dev, id) config_port_access_mode(dev, id, true)
-#define config_port_pf_mode(dev, id) config_port_access_mode(dev, id, false)
+static bool dfl_afu_feature_match(struct dfl_afu_feature *afeature,
+				  struct dfl_feature_info *finfo)
+{
+	struct dfl_feature *feature = &afeature->feature;
 
-/**
- * dfl_fpga_cdev_config_ports_pf - configure ports to PF access mode
- *
- * @cdev: parent container device.
- *
- * This function is needed in sriov configuration routine. It could be used to
- * configure the all released ports from VF access mode to PF.
- */
-void dfl_fpga_cdev_config_ports_pf(struct dfl_fpga_cdev *cdev)
+	return feature->id == finfo->fid &&
+	       feature->revision == finfo->revision &&
+	       feature->dfh_version == finfo->dfh_version &&
+	       guid_equal(&feature->guid, &finfo->guid) &&
+	       afeature->mmio_res.start == finfo->mmio_res.start &&
+	       afeature->mmio_res.end == finfo->mmio_res.end &&
+	       feature->nr_irqs == finfo->nr_irqs &&
+	       feature->param_size == finfo->param_size &&
+	       !memcmp(feature->params, finfo->params, finfo->param_size);
+}
+
+static struct dfl_feature_info *
+dfl_afu_feature_find(struct build_feature_devs_info *binfo,
+		     struct dfl_afu_feature *afeature)
 {
-	struct dfl_feature_dev_data *fdata;
+	struct dfl_feature_info *finfo;
 
-	mutex_lock(&cdev->lock);
-	list_for_each_entry(fdata, &cdev->port_dev_list, node) {
-		if (fdata->dev)
-			continue;
+	list_for_each_entry(finfo, &binfo->sub_features, node)
+		if (dfl_afu_feature_match(afeature, finfo))
+			return finfo;
 
-		config_port_pf_mode(cdev->fme_dev, fdata->id);
+	return NULL;
+}
+
+static struct dfl_afu_feature *
+dfl_afu_feature_add(struct dfl_feature_dev_data *fdata,
+		    struct dfl_feature *afu, struct dfl_feature_info *finfo)
+{
+	struct dfl_fpga_cdev *cdev = fdata->dfl_cdev;
+	struct dfl_afu_feature *afeature;
+	struct dfl_feature *feature;
+	struct dfl_device *ddev;
+	unsigned int i;
+
+	afeature = kzalloc(sizeof(*afeature), GFP_KERNEL);
+	if (!afeature)
+		return ERR_PTR(-ENOMEM);
+
+	afeature->mmio_res.flags = IORESOURCE_MEM;
+	afeature->mmio_res.start = finfo->mmio_res.start;
+	afeature->mmio_res.end = finfo->mmio_res.end;
+
+	feature = &afeature->feature;
+	feature->dev = fdata->dev;
+	feature->id = finfo->fid;
+	feature->revision = finfo->revision;
+	feature->dfh_version = finfo->dfh_version;
+	feature->resource_index = afu->resource_index;
+	feature->mmio_start = finfo->mmio_res.start;
+	feature->mmio_size = resource_size(&finfo->mmio_res);
+	guid_copy(&feature->guid, &finfo->guid);
+
+	if (finfo->param_size) {
+		feature->params = kmemdup(finfo->params, finfo->param_size,
+					  GFP_KERNEL);
+		if (!feature->params)
+			goto free_exit;
+		feature->param_size = finfo->param_size;
 	}
-	mutex_unlock(&cdev->lock);
+
+	if (finfo->nr_irqs) {
+		feature->irq_ctx = kcalloc(finfo->nr_irqs,
+					   sizeof(*feature->irq_ctx),
+					   GFP_KERNEL);
+		if (!feature->irq_ctx)
+			goto free_exit;
+
+		for (i = 0; i < finfo->nr_irqs; i++)
+			dfl_feature_irq_ctx_init(&feature->irq_ctx[i],
+				cdev->irq_table[finfo->irq_base + i]);
+
+		feature->nr_irqs = finfo->nr_irqs;
+		feature->irq_base = finfo->irq_base;
+	}
+
+	ddev = dfl_dev_add(fdata, feature, &afeature->mmio_res);
+	if (IS_ERR(ddev)) {
+		dfl_afu_feature_free(afeature);
+		return ERR_CAST(ddev);
+	}
+
+	feature->ddev = ddev;
+
+	return afeature;
+
+free_exit:
+	dfl_afu_feature_free(afeature);
+	return ERR_PTR(-ENOMEM);
 }
-EXPORT_SYMBOL_GPL(dfl_fpga_cdev_config_ports_pf);
 
 /**
- * dfl_fpga_cdev_config_ports_vf - configure ports to VF access mode
+ * __dfl_fpga_port_afu_rescan - re-enumerate private features of a port's AFU
  *
- * @cdev: parent container device.
- * @num_vfs: VF device number.
+ * @fdata: port feature dev data.
  *
- * This function is needed in sriov configuration routine. It could be used to
- * configure the released ports from PF access mode to VF.
+ * Walk the device feature list of the AFU currently loaded into the port and
+ * compare the private features found against the ones enumerated before, by
+ * feature id, GUID, revision and register location. Only the dfl devices of
+ * features which are gone are removed, and only those of new features are
+ * added, so drivers bound to features untouched by a partial reconfiguration
+ * stay bound.
+ *
+ * This function needs to be invoked with the device lock of the port platform
+ * device held, and the port driver bound.
  *
  * Return: 0 on success, negative error code otherwise.
  */
-int dfl_fpga_cdev_config_ports_vf(struct dfl_fpga_cdev *cdev, int num_vfs)
+int __dfl_fpga_port_afu_rescan(struct dfl_feature_dev_data *fdata)
 {
-	struct dfl_feature_dev_data *fdata;
-	int ret = 0, port_count = 0;
+	struct dfl_afu_feature *afeature, *tmp;
+	struct build_feature_devs_info *binfo;
+	struct dfl_feature_info *finfo, *p;
+	struct platform_device *pdev = fdata->dev;
+	unsigned int added = 0, removed = 0;
+	struct dfl_feature *afu;
+	struct resource *res;
+	int ret;
 
-	mutex_lock(&cdev->lock);
-	if (list_empty(&cdev->port_dev_list))
-		goto done;
+	afu = dfl_get_feature_by_id(fdata, PORT_FEATURE_ID_AFU);
+	if (!afu || !afu->ioaddr)
+		return -ENODEV;
 
-	list_for_each_entry(fdata, &cdev->port_dev_list, node) {
-		if (fdata->dev)
-			continue;
-		port_count++;
-	}
+	res = &pdev->resource[afu->resource_index];
 
-	/*
-	 * can't turn multiple ports into 1 VF device, only 1 port for 1 VF
-	 * device, so if released port number doesn't match VF device number,
-	 * then reject the request with -EINVAL error code.
-	 */
-	if (port_count && (cdev->released_port_num != num_vfs)) {
-		ret = -EINVAL;
-		goto done;
-	}
+	binfo = kzalloc(sizeof(*binfo), GFP_KERNEL);
+	if (!binfo)
+		return -ENOMEM;
 
-	list_for_each_entry(fdata, &cdev->port_dev_list, node) {
-		if (fdata->dev)
-			continue;
+	binfo->type = PORT_ID;
+	binfo->dev = &pdev->dev;
+	binfo->cdev = fdata->dfl_cdev;
+	binfo->nr_irqs = fdata->dfl_cdev->nr_irqs;
+	binfo->irq_table = fdata->dfl_cdev->irq_table;
+	binfo->start = res->start;
+	binfo->len = resource_size(res);
+	INIT_LIST_HEAD(&binfo->sub_features);
+	INIT_LIST_HEAD(&binfo->feature_devs);
 
-		config_port_vf_mode(cdev->fme_dev, fdata->id);
+	/* the port only keeps the AFU header mapped, see PORT_AFU_HDR_SIZE */
+	binfo->ioaddr = ioremap(binfo->start, binfo->len);
+	if (!binfo->ioaddr) {
+		ret = -ENOMEM;
+		goto free_exit;
 	}
-done:
-	mutex_unlock(&cdev->lock);
-	return ret;
-}
-EXPORT_SYMBOL_GPL(dfl_fpga_cdev_config_ports_vf);
 
-static irqreturn_t dfl_irq_handler(int irq, void *arg)
-{
-	struct eventfd_ctx *trigger = arg;
+	ret = dfl_shadow_alloc(binfo);
+	if (ret)
+		goto free_exit;
 
-	eventfd_signal(trigger);
-	return IRQ_HANDLED;
-}
+	ret = parse_afu_feature_list(binfo);
+	if (ret)
+		goto free_exit;
 
-static int do_set_irq_trigger(struct dfl_feature *feature, unsigned int idx,
-			      int fd)
-{
-	struct platform_device *pdev = feature->dev;
-	struct eventfd_ctx *trigger;
-	int irq, ret;
+	/* keep the dfl devices of features which are still there */
+	list_for_each_entry_safe(afeature, tmp, &fdata->afu_features, node) {
+		finfo = dfl_afu_feature_find(binfo, afeature);
+		if (finfo) {
+			list_del(&finfo->node);
+			kfree(finfo);
+			continue;
+		}
 
-	irq = feature->irq_ctx[idx].irq;
+		mutex_lock(&fdata->lock);
+		list_del(&afeature->node);
+		mutex_unlock(&fdata->lock);
 
-	if (feature->irq_ctx[idx].trigger) {
-		free_irq(irq, feature->irq_ctx[idx].trigger);
-		kfree(feature->irq_ctx[idx].name);
-		eventfd_ctx_put(feature->irq_ctx[idx].trigger);
-		feature->irq_ctx[idx].trigger = NULL;
+		dfl_afu_feature_free(afeature);
+		removed++;
 	}
 
-	if (fd < 0)
-		return 0;
-
-	feature->irq_ctx[idx].name =
-		kasprintf(GFP_KERNEL, "fpga-irq[%u](%s-%x)", idx,
-			  dev_name(&pdev->dev), feature->id);
-	if (!feature->irq_ctx[idx].name)
-		return -ENOMEM;
-
-	trigger = eventfd_ctx_fdget(fd);
-	if (IS_ERR(trigger)) {
-		ret = PTR_ERR(trigger);
-		goto free_name;
-	}
+	list_for_each_entry_safe(finfo, p, &binfo->sub_features, node) {
+		afeature = dfl_afu_feature_add(fdata, afu, finfo);
+		if (IS_ERR(afeature)) {
+			ret = PTR_ERR(afeature);
+			break;
+		}
 
-	ret = request_irq(irq, dfl_irq_handler, 0,
-			  feature->irq_ctx[idx].name, trigger);
-	if (!ret) {
-		feature->irq_ctx[idx].trigger = trigger;
-		return ret;
+		mutex_lock(&fdata->lock);
+		list_add_tail(&afeature->node, &fdata->afu_features);
+		mutex_unlock(&fdata->lock);
+		added++;
 	}
 
-	eventfd_ctx_put(trigger);
-free_name:
-	kfree(feature->irq_ctx[idx].name);
+	dev_dbg(&pdev->dev, "AFU rescan: %u added, %u removed, %u MMIO reads\n",
+		added, removed, binfo->mmio_reads);
 
+free_exit:
+	build_info_release(binfo);
+	if (binfo->ioaddr)
+		iounmap(binfo->ioaddr);
+	kfree(binfo);
 	return ret;
 }
+EXPORT_SYMBOL_GPL(__dfl_fpga_port_afu_rescan);
 
 /**
- * dfl_fpga_set_irq_triggers - set eventfd triggers for dfl feature interrupts
+ * dfl_fpga_cdev_rescan_port_afu - re-enumerate private features of a port's AFU
  *
- * @feature: dfl sub feature.
- * @start: start of irq index in this dfl sub feature.
- * @count: number of irqs.
- * @fds: eventfds to bind with irqs. unbind related irq if fds[n] is negative.
- *	 unbind "count" specified number of irqs if fds ptr is NULL.
+ * @cdev: parent container device.
+ * @port_id: id of the port platform device.
  *
- * Bind given eventfds with irqs in this dfl sub feature. Unbind related irq if
- * fds[n] is negative. Unbind "count" specified number of irqs if fds ptr is
- * NULL.
+ * This function is called after partial reconfiguration of a port, to add
+ * and remove the dfl devices of the private features which the new AFU
+ * changed. See __dfl_fpga_port_afu_rescan().
  *
  * Return: 0 on success, negative error code otherwise.
  */
-int dfl_fpga_set_irq_triggers(struct dfl_feature *feature, unsigned int start,
-			      unsigned int count, int32_t *fds)
+int dfl_fpga_cdev_rescan_port_afu(struct dfl_fpga_cdev *cdev, int port_id)
 {
-	unsigned int i;
+	struct dfl_feature_dev_data *fdata;
 	int ret = 0;
 
-	/* overflow */
-	if (unlikely(start + count < start))
-		return -EINVAL;
+	mutex_lock(&cdev->lock);
+	fdata = __dfl_fpga_cdev_find_port_data(cdev, &port_id,
+					       dfl_fpga_check_port_id);
+	if (!fdata) {
+		ret = -ENODEV;
+		goto unlock_exit;
+	}
+
+	/* a released or unbound port enumerates its AFU when probed again */
+	if (!fdata->dev)
+		goto unlock_exit;
+
+	device_lock(&fdata->dev->dev);
+	if (fdata->dev->dev.driver)
+		ret = __dfl_fpga_port_afu_rescan(fdata);
+	device_unlock(&fdata->dev->dev);
+unlock_exit:
+	mutex_unlock(&cdev->lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(dfl_fpga_cdev_rescan_port_afu);
+
+/**
+ * struct dfl_feature_tree_buf - buffer for a feature tree snapshot
+ *
+ * @data: buffer, or NULL to only count the size of the snapshot.
+ * @size: size of @data.
+ * @len: size of the snapshot taken so far, which may exceed @size.
+ */
+struct dfl_feature_tree_buf {
+	void *data;
+	size_t size;
+	size_t len;
+};
+
+/* reserve @n bytes of the snapshot, return NULL if they do not fit */
+static void *dfl_feature_tree_reserve(struct dfl_feature_tree_buf *tb,
+				      size_t n)
+{
+	void *p = NULL;
+
+	if (tb->data && tb->len + n <= tb->size)
+		p = tb->data + tb->len;
+
+	tb->len += n;
+
+	return p;
+}
+
+static void dfl_feature_tree_add_feature(struct dfl_feature_tree_buf *tb,
+					 struct dfl_feature *feature)
+{
+	struct dfl_fpga_feature_tree_feature *tf;
+
+	tf = dfl_feature_tree_reserve(tb, sizeof(*tf) + feature->param_size);
+	if (!tf)
+		return;
+
+	tf->id = feature->id;
+	tf->revision = feature->revision;
+	tf->dfh_version = feature->dfh_version;
+	tf->param_size = feature->param_size;
+	tf->mmio_start = feature->mmio_start;
+	tf->mmio_size = feature->mmio_size;
+	tf->irq_base = feature->irq_base;
+	tf->nr_irqs = feature->nr_irqs;
+	memcpy(tf->guid, &feature->guid, sizeof(tf->guid));
+	memcpy(tf + 1, feature->params, feature->param_size);
+}
+
+static void dfl_feature_tree_add_dev(struct dfl_feature_tree_buf *tb,
+				     struct dfl_feature_dev_data *fdata)
+{
+	struct dfl_fpga_feature_tree_dev *td;
+	struct dfl_afu_feature *afeature;
+	struct dfl_feature *feature;
+	u32 num = 0;
+
+	td = dfl_feature_tree_reserve(tb, sizeof(*td));
+
+	dfl_fpga_dev_for_each_feature(fdata, feature) {
+		dfl_feature_tree_add_feature(tb, feature);
+		num++;
+	}
+
+	mutex_lock(&fdata->lock);
+	list_for_each_entry(afeature, &fdata->afu_features, node) {
+		dfl_feature_tree_add_feature(tb, &afeature->feature);
+		num++;
+	}
+	mutex_unlock(&fdata->lock);
+
+	if (!td)
+		return;
+
+	td->type = fdata->type;
+	td->id = fdata->pdev_id;
+	td->flags = fdata->dev ? 0 : DFL_FPGA_FEATURE_TREE_DEV_RELEASED;
+	td->num_features = num;
+}
+
+/*
+ * take a snapshot of all feature devices under the container device. This
+ * function needs to be invoked with cdev->lock held.
+ */
+static void dfl_feature_tree_fill(struct dfl_fpga_cdev *cdev,
+				  struct dfl_feature_tree_buf *tb)
+{
+	struct dfl_fpga_feature_tree_hdr *hdr;
+	struct dfl_feature_dev_data *fdata;
+	u32 num = 0;
+
+	tb->len = 0;
+	hdr = dfl_feature_tree_reserve(tb, sizeof(*hdr));
+
+	if (cdev->fme_dev) {
+		dfl_feature_tree_add_dev(tb, to_dfl_feature_dev_data(cdev->fme_dev));
+		num++;
+	}
+
+	list_for_each_entry(fdata, &cdev->port_dev_list, node) {
+		dfl_feature_tree_add_dev(tb, fdata);
+		num++;
+	}
+
+	list_for_each_entry(fdata, &cdev->priv_feat_dev_list, node) {
+		dfl_feature_tree_add_dev(tb, fdata);
+		num++;
+	}
+
+	if (!hdr)
+		return;
+
+	hdr->version = DFL_FPGA_FEATURE_TREE_VERSION;
+	hdr->size = tb->len;
+	hdr->dev_entry_size = sizeof(struct dfl_fpga_feature_tree_dev);
+	hdr->feature_entry_size = sizeof(struct dfl_fpga_feature_tree_feature);
+	hdr->num_devs = num;
+}
+
+/**
+ * dfl_fpga_ioctl_get_feature_tree - handle DFL_FPGA_GET_FEATURE_TREE ioctl
+ * @fdata: feature dev data of the file descriptor.
+ * @arg: user pointer to struct dfl_fpga_feature_tree.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+long dfl_fpga_ioctl_get_feature_tree(struct dfl_feature_dev_data *fdata,
+				     void __user *arg)
+{
+	struct dfl_fpga_cdev *cdev = fdata->dfl_cdev;
+	struct dfl_feature_tree_buf tb = { };
+	struct dfl_fpga_feature_tree tree;
+	unsigned long minsz;
+	long ret = 0;
+
+	minsz = offsetofend(struct dfl_fpga_feature_tree, tree_size);
+
+	if (copy_from_user(&tree, arg, minsz))
+		return -EFAULT;
+
+	if (tree.argsz < minsz || tree.flags)
+		return -EINVAL;
+
+	/*
+	 * the first pass only counts the size of the snapshot. Retry if AFU
+	 * features were added after the buffer was allocated.
+	 */
+	mutex_lock(&cdev->lock);
+	for (;;) {
+		dfl_feature_tree_fill(cdev, &tb);
+		if (tb.len <= tb.size || tb.len > tree.buffer_size)
+			break;
+
+		kvfree(tb.data);
+		tb.size = tb.len;
+		tb.data = kvzalloc(tb.size, GFP_KERNEL);
+		if (!tb.data) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	mutex_unlock(&cdev->lock);
+
+	if (ret)
+		return ret;
+
+	tree.tree_size = tb.len;
+	if (tb.len > tree.buffer_size)
+		ret = -ENOSPC;
+	else if (copy_to_user((void __user *)(unsigned long)tree.buffer_address,
+			      tb.data, tb.len))
+		ret = -EFAULT;
+
+	kvfree(tb.data);
+
+	if (copy_to_user(arg, &tree, minsz))
+		return -EFAULT;
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(dfl_fpga_ioctl_get_feature_tree);
+
+static void config_port_access_mode(struct device *fme_dev, int port_id,
+				    bool is_vf)
+{
+	struct dfl_feature_dev_data *fdata = to_dfl_feature_dev_data(fme_dev);
+	void __iomem *base;
+	u64 v;
+
+	base = dfl_get_feature_ioaddr_by_id(fdata, FME_FEATURE_ID_HEADER);
+
+	v = readq(base + FME_HDR_PORT_OFST(port_id));
+
+	v &= ~FME_PORT_OFST_ACC_CTRL;
+	v |= FIELD_PREP(FME_PORT_OFST_ACC_CTRL,
+			is_vf ? FME_PORT_OFST_ACC_VF : FME_PORT_OFST_ACC_PF);
+
+	writeq(v, base + FME_HDR_PORT_OFST(port_id));
+}
+
+#define config_port_vf_mode(dev, id) config_port_access_mode(dev, id, true)
+#define config_port_pf_mode(dev, id) config_port_access_mode(dev, id, false)
+
+/**
+ * dfl_fpga_cdev_config_ports_pf - configure ports to PF access mode
+ *
+ * @cdev: parent container device.
+ *
+ * This function is needed in sriov configuration routine. It could be used to
+ * configure the all released ports from VF access mode to PF.
+ */
+void dfl_fpga_cdev_config_ports_pf(struct dfl_fpga_cdev *cdev)
+{
+	struct dfl_feature_dev_data *fdata;
+
+	mutex_lock(&cdev->lock);
+	list_for_each_entry(fdata, &cdev->port_dev_list, node) {
+		if (fdata->dev)
+			continue;
+
+		config_port_pf_mode(cdev->fme_dev, fdata->id);
+	}
+	mutex_unlock(&cdev->lock);
+}
+EXPORT_SYMBOL_GPL(dfl_fpga_cdev_config_ports_pf);
+
+/**
+ * dfl_fpga_cdev_config_ports_vf - configure ports to VF access mode
+ *
+ * @cdev: parent container device.
+ * @num_vfs: VF device number.
+ *
+ * This function is needed in sriov configuration routine. It could be used to
+ * configure the released ports from PF access mode to VF.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+int dfl_fpga_cdev_config_ports_vf(struct dfl_fpga_cdev *cdev, int num_vfs)
+{
+	struct dfl_feature_dev_data *fdata;
+	int ret = 0, port_count = 0;
+
+	mutex_lock(&cdev->lock);
+	if (list_empty(&cdev->port_dev_list))
+		goto done;
+
+	list_for_each_entry(fdata, &cdev->port_dev_list, node) {
+		if (fdata->dev)
+			continue;
+		port_count++;
+	}
+
+	/*
+	 * can't turn multiple ports into 1 VF device, only 1 port for 1 VF
+	 * device, so if released port number doesn't match VF device number,
+	 * then reject the request with -EINVAL error code.
+	 */
+	if (port_count && (cdev->released_port_num != num_vfs)) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	list_for_each_entry(fdata, &cdev->port_dev_list, node) {
+		if (fdata->dev)
+			continue;
+
+		config_port_vf_mode(cdev->fme_dev, fdata->id);
+	}
+done:
+	mutex_unlock(&cdev->lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(dfl_fpga_cdev_config_ports_vf);
+
+/* limits of the number of entries of an interrupt ring */
+#define DFL_IRQ_RING_MIN_ENTRIES	64
+#define DFL_IRQ_RING_MAX_ENTRIES	SZ_64K
+
+/**
+ * struct dfl_irq_ring - shared memory ring of the interrupts of a sub feature
+ *
+ * @feature: sub feature whose interrupts are recorded.
+ * @file: device file the ring was created from, held to keep @feature.
+ * @hdr: ring header at the start of @buf, shared with userspace.
+ * @events: ring entries, shared with userspace.
+ * @buf: vmalloc_user() memory of the ring, mmapped by userspace.
+ * @size: size of @buf.
+ * @nr_entries: number of @events, a power of 2.
+ * @head: next entry to write. hdr->head is only a copy for userspace, which
+ *	  can write to it.
+ * @dropped: number of interrupts not recorded because the ring was full.
+ * @lock: serializes the interrupt handlers of the vectors of @feature.
+ * @wait: wait queue of poll().
+ */
+struct dfl_irq_ring {
+	struct dfl_feature *feature;
+	struct file *file;
+	struct dfl_fpga_irq_ring_hdr *hdr;
+	struct dfl_fpga_irq_event *events;
+	void *buf;
+	size_t size;
+	u32 nr_entries;
+	u32 head;
+	u64 dropped;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+};
+
+static void dfl_irq_ring_push(struct dfl_irq_ring *ring, unsigned int vector,
+			      u32 seq)
+{
+	struct dfl_fpga_irq_event *ev;
+	u32 tail;
+
+	spin_lock(&ring->lock);
+	tail = READ_ONCE(ring->hdr->tail);
+	if (ring->head - tail >= ring->nr_entries) {
+		WRITE_ONCE(ring->hdr->dropped, ++ring->dropped);
+	} else {
+		ev = &ring->events[ring->head & (ring->nr_entries - 1)];
+		ev->timestamp = ktime_get_ns();
+		ev->vector = vector;
+		ev->seq = seq;
+		/* publish the entry before the new head */
+		smp_store_release(&ring->hdr->head, ++ring->head);
+	}
+	spin_unlock(&ring->lock);
+
+	/* busy polling consumers never sleep, so they are never woken up */
+	if (wq_has_sleeper(&ring->wait))
+		wake_up_interruptible(&ring->wait);
+}
+
+/*
+ * signal the eventfd of a vector, at most once per min_interval. Interrupts
+ * arriving earlier are suppressed and signaled once by the moderation timer.
+ */
+static void dfl_irq_signal(struct dfl_feature_irq_ctx *ctx)
+{
+	ktime_t now, next;
+
+	spin_lock(&ctx->lock);
+	if (static_branch_unlikely(&dfl_irq_latency_key) &&
+	    !ctx->latency.irq_ts)
+		ctx->latency.irq_ts = ktime_get_ns();
+
+	if (ctx->pending) {
+		ctx->suppressed++;
+		goto unlock;
+	}
+
+	if (ctx->min_interval) {
+		now = ktime_get();
+		next = ktime_add_ns(ctx->last, ctx->min_interval);
+		if (ktime_before(now, next)) {
+			ctx->pending = true;
+			ctx->suppressed++;
+			hrtimer_start(&ctx->timer, next, HRTIMER_MODE_ABS);
+			goto unlock;
+		}
+		ctx->last = now;
+	}
+
+	dfl_irq_deliver(ctx);
+unlock:
+	spin_unlock(&ctx->lock);
+}
+
+static irqreturn_t dfl_irq_handler(int irq, void *arg)
+{
+	struct dfl_feature_irq_ctx *ctx = arg;
+	struct dfl_irq_ring *ring = smp_load_acquire(&ctx->ring);
+	u32 seq = ++ctx->seq;
+
+	trace_dfl_irq(ctx->irq, seq);
+	if (static_branch_unlikely(&dfl_irq_latency_key)) {
+		ctx->latency.irqs++;
+		if (ctx->latency.wqh)
+			atomic64_cmpxchg(&ctx->latency.unread_ts, 0,
+					 ktime_get_ns());
+	}
+
+	if (ring)
+		dfl_irq_ring_push(ring, ctx - ring->feature->irq_ctx, seq);
+	if (ctx->trigger)
+		dfl_irq_signal(ctx);
+
+	return IRQ_HANDLED;
+}
+
+/* request the irq of a vector if it has a trigger or a ring, and none yet */
+static int dfl_irq_request(struct dfl_feature *feature, unsigned int idx)
+{
+	struct dfl_feature_irq_ctx *ctx = &feature->irq_ctx[idx];
+	struct platform_device *pdev = feature->dev;
+	int ret;
+
+	if (ctx->name || (!ctx->trigger && !ctx->ring))
+		return 0;
+
+	ctx->name = kasprintf(GFP_KERNEL, "fpga-irq[%u](%s-%x)", idx,
+			      dev_name(&pdev->dev), feature->id);
+	if (!ctx->name)
+		return -ENOMEM;
+
+	ret = request_irq(ctx->irq, dfl_irq_handler, 0, ctx->name, ctx);
+	if (ret) {
+		kfree(ctx->name);
+		ctx->name = NULL;
+	}
+
+	return ret;
+}
+
+/* free the irq of a vector, the name is only set while it is requested */
+static void dfl_irq_free(struct dfl_feature *feature, unsigned int idx)
+{
+	struct dfl_feature_irq_ctx *ctx = &feature->irq_ctx[idx];
+
+	if (!ctx->name)
+		return;
+
+	free_irq(ctx->irq, ctx);
+	kfree(ctx->name);
+	ctx->name = NULL;
+
+	/* don't lose the interrupts suppressed by moderation */
+	if (hrtimer_cancel(&ctx->timer))
+		dfl_irq_moderation_timer(&ctx->timer);
+}
+
+/* eventfd wakes up its EPOLLOUT waiters when a read consumed its count */
+static int dfl_irq_latency_wake(wait_queue_entry_t *wait, unsigned int mode,
+				int sync, void *key)
+{
+	struct dfl_feature_irq_ctx *ctx =
+		container_of(wait, struct dfl_feature_irq_ctx, latency.wait);
+	struct dfl_irq_latency *lat = &ctx->latency;
+	u64 ts, ns;
+
+	if (!(key_to_poll(key) & EPOLLOUT))
+		return 0;
+
+	ts = atomic64_xchg(&lat->unread_ts, 0);
+	if (!ts)
+		return 0;
+
+	ns = ktime_get_ns() - ts;
+	lat->reads++;
+	dfl_irq_latency_account(lat->read_hist, ns);
+	trace_dfl_irq_read(ctx->irq, ns);
+
+	return 0;
+}
+
+static void dfl_irq_latency_queue(struct file *file, wait_queue_head_t *wqh,
+				  poll_table *pt)
+{
+	struct dfl_irq_latency *lat = container_of(pt, struct dfl_irq_latency,
+						   pt);
+
+	lat->wqh = wqh;
+	add_wait_queue(wqh, &lat->wait);
+}
+
+/* measure the reads of the eventfd of a vector */
+static void dfl_irq_latency_attach(struct dfl_feature_irq_ctx *ctx,
+				   struct file *file)
+{
+	struct dfl_irq_latency *lat = &ctx->latency;
+
+	init_waitqueue_func_entry(&lat->wait, dfl_irq_latency_wake);
+	init_poll_funcptr(&lat->pt, dfl_irq_latency_queue);
+	vfs_poll(file, &lat->pt);
+}
+
+static void dfl_irq_latency_detach(struct dfl_feature_irq_ctx *ctx)
+{
+	struct dfl_irq_latency *lat = &ctx->latency;
+
+	if (lat->wqh) {
+		remove_wait_queue(lat->wqh, &lat->wait);
+		lat->wqh = NULL;
+	}
+	atomic64_set(&lat->unread_ts, 0);
+	lat->irq_ts = 0;
+}
+
+static int do_set_irq_trigger(struct dfl_feature *feature, unsigned int idx,
+			      int fd)
+{
+	struct dfl_feature_irq_ctx *ctx = &feature->irq_ctx[idx];
+	struct eventfd_ctx *trigger = NULL;
+	struct file *file = NULL;
+	int ret;
+
+	if (fd >= 0) {
+		file = fget(fd);
+		if (!file)
+			return -EBADF;
+
+		trigger = eventfd_ctx_fileget(file);
+		if (IS_ERR(trigger)) {
+			fput(file);
+			return PTR_ERR(trigger);
+		}
+	}
+
+	dfl_irq_free(feature, idx);
+	if (ctx->trigger) {
+		dfl_irq_latency_detach(ctx);
+		eventfd_ctx_put(ctx->trigger);
+	}
+	ctx->trigger = trigger;
+
+	if (file) {
+		if (static_branch_unlikely(&dfl_irq_latency_key))
+			dfl_irq_latency_attach(ctx, file);
+		fput(file);
+	}
+
+	ret = dfl_irq_request(feature, idx);
+	if (ret && trigger) {
+		dfl_irq_latency_detach(ctx);
+		eventfd_ctx_put(trigger);
+		ctx->trigger = NULL;
+		/* keep recording to the ring of the vector */
+		dfl_irq_request(feature, idx);
+	}
+
+	return ret;
+}
+
+/**
+ * dfl_fpga_set_irq_triggers - set eventfd triggers for dfl feature interrupts
+ *
+ * @feature: dfl sub feature.
+ * @start: start of irq index in this dfl sub feature.
+ * @count: number of irqs.
+ * @fds: eventfds to bind with irqs. unbind related irq if fds[n] is negative.
+ *	 unbind "count" specified number of irqs if fds ptr is NULL.
+ *
+ * Bind given eventfds with irqs in this dfl sub feature. Unbind related irq if
+ * fds[n] is negative. Unbind "count" specified number of irqs if fds ptr is
+ * NULL.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+int dfl_fpga_set_irq_triggers(struct dfl_feature *feature, unsigned int start,
+			      unsigned int count, int32_t *fds)
+{
+	unsigned int i;
+	int ret = 0;
+
+	/* overflow */
+	if (unlikely(start + count < start))
+		return -EINVAL;
 
 	/* exceeds nr_irqs */
 	if (start + count > feature->nr_irqs)
@@ -2203,8 +3575,353 @@ long dfl_feature_ioctl_set_irq(struct platform_device *pdev,
 }
 EXPORT_SYMBOL_GPL(dfl_feature_ioctl_set_irq);
 
+/**
+ * dfl_feature_irq_affinity_show - show the CPUs of the irqs of a sub feature
+ * @feature: dfl sub feature.
+ * @buf: sysfs buffer.
+ *
+ * Return: number of bytes written to @buf, negative error code otherwise.
+ */
+ssize_t dfl_feature_irq_affinity_show(struct dfl_feature *feature, char *buf)
+{
+	const struct cpumask *affinity;
+	cpumask_var_t mask;
+	unsigned int i;
+	ssize_t ret;
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	for (i = 0; i < feature->nr_irqs; i++) {
+		affinity = irq_get_affinity_mask(feature->irq_ctx[i].irq);
+		if (affinity)
+			cpumask_or(mask, mask, affinity);
+	}
+
+	ret = cpumap_print_to_pagebuf(true, buf, mask);
+	free_cpumask_var(mask);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(dfl_feature_irq_affinity_show);
+
+/**
+ * dfl_feature_irq_affinity_store - set the CPUs of the irqs of a sub feature
+ * @feature: dfl sub feature.
+ * @buf: list of CPUs to run the interrupt handlers on, or "default" to spread
+ *	 the irqs over the CPUs of the NUMA node of the device again.
+ * @count: size of @buf.
+ *
+ * The affinity is kept by the irqs while they are freed and requested again,
+ * so it holds until the container device is removed.
+ *
+ * Return: @count on success, negative error code otherwise.
+ */
+ssize_t dfl_feature_irq_affinity_store(struct dfl_feature *feature,
+				       const char *buf, size_t count)
+{
+	struct dfl_feature_irq_ctx *ctx = feature->irq_ctx;
+	int node = dev_to_node(&feature->dev->dev);
+	cpumask_var_t mask;
+	unsigned int i;
+	int ret = 0;
+
+	if (!feature->nr_irqs)
+		return -ENOENT;
+
+	if (sysfs_streq(buf, "default")) {
+		for (i = 0; !ret && i < feature->nr_irqs; i++)
+			ret = dfl_irq_set_default_affinity(ctx[i].irq,
+							   feature->irq_base + i,
+							   node);
+		return ret ? ret : count;
+	}
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	ret = cpulist_parse(buf, mask);
+	if (!ret && !cpumask_intersects(mask, cpu_online_mask))
+		ret = -EINVAL;
+
+	for (i = 0; !ret && i < feature->nr_irqs; i++)
+		ret = irq_set_affinity(ctx[i].irq, mask);
+
+	free_cpumask_var(mask);
+
+	return ret ? ret : count;
+}
+EXPORT_SYMBOL_GPL(dfl_feature_irq_affinity_store);
+
+/* longest minimum interval between two eventfd signals of a vector */
+#define DFL_IRQ_MODERATION_MAX_INTERVAL		NSEC_PER_SEC
+
+/**
+ * dfl_feature_ioctl_irq_moderation - dfl feature _IRQ_MODERATION ioctl
+ *				      interface.
+ * @pdev: the feature device which has the sub feature
+ * @feature: the dfl sub feature
+ * @arg: ioctl argument
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+long dfl_feature_ioctl_irq_moderation(struct platform_device *pdev,
+				      struct dfl_feature *feature,
+				      unsigned long arg)
+{
+	struct dfl_fpga_irq_moderation mod;
+	struct dfl_feature_irq_ctx *ctx;
+	unsigned long minsz;
+
+	if (!feature->nr_irqs)
+		return -ENOENT;
+
+	minsz = offsetofend(struct dfl_fpga_irq_moderation, suppressed);
+
+	if (copy_from_user(&mod, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (mod.argsz < minsz || mod.flags & ~DFL_IRQ_MODERATION_SET ||
+	    mod.pad || mod.vector >= feature->nr_irqs)
+		return -EINVAL;
+
+	if (mod.flags & DFL_IRQ_MODERATION_SET &&
+	    mod.min_interval_ns > DFL_IRQ_MODERATION_MAX_INTERVAL)
+		return -EINVAL;
+
+	ctx = &feature->irq_ctx[mod.vector];
+
+	spin_lock_irq(&ctx->lock);
+	if (mod.flags & DFL_IRQ_MODERATION_SET) {
+		ctx->min_interval = mod.min_interval_ns;
+		ctx->delivered = 0;
+		ctx->suppressed = 0;
+	}
+	mod.min_interval_ns = ctx->min_interval;
+	mod.delivered = ctx->delivered;
+	mod.suppressed = ctx->suppressed;
+	spin_unlock_irq(&ctx->lock);
+
+	if (copy_to_user((void __user *)arg, &mod, minsz))
+		return -EFAULT;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dfl_feature_ioctl_irq_moderation);
+
+/*
+ * stop recording the interrupts of the sub feature to its ring. The irq of a
+ * vector with an eventfd trigger stays requested, so no interrupt of the
+ * trigger is missed, and the ring is only freed once no handler uses it.
+ */
+static void dfl_irq_ring_detach(struct dfl_irq_ring *ring)
+{
+	struct dfl_feature *feature = ring->feature;
+	struct dfl_feature_irq_ctx *ctx;
+	unsigned int i;
+
+	for (i = 0; i < feature->nr_irqs; i++) {
+		ctx = &feature->irq_ctx[i];
+		if (ctx->ring != ring)
+			continue;
+
+		WRITE_ONCE(ctx->ring, NULL);
+		if (ctx->trigger)
+			synchronize_irq(ctx->irq);
+		else
+			dfl_irq_free(feature, i);
+	}
+}
+
+/*
+ * start recording the interrupts of the sub feature to the ring. The ring is
+ * published to the handler of a vector whose irq is already requested for
+ * its eventfd trigger, the irq of any other vector is requested for it.
+ */
+static int dfl_irq_ring_attach(struct dfl_irq_ring *ring)
+{
+	struct dfl_feature *feature = ring->feature;
+	struct dfl_feature_irq_ctx *ctx;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < feature->nr_irqs; i++) {
+		if (feature->irq_ctx[i].ring)
+			return -EBUSY;
+	}
+
+	for (i = 0; i < feature->nr_irqs; i++) {
+		ctx = &feature->irq_ctx[i];
+		WRITE_ONCE(ctx->seq, 0);
+		smp_store_release(&ctx->ring, ring);
+
+		ret = dfl_irq_request(feature, i);
+		if (ret) {
+			WRITE_ONCE(ctx->ring, NULL);
+			dfl_irq_ring_detach(ring);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int dfl_irq_ring_release(struct inode *inode, struct file *filp)
+{
+	struct dfl_irq_ring *ring = filp->private_data;
+	struct dfl_feature_dev_data *fdata;
+
+	fdata = to_dfl_feature_dev_data(&ring->feature->dev->dev);
+
+	mutex_lock(&fdata->lock);
+	dfl_irq_ring_detach(ring);
+	mutex_unlock(&fdata->lock);
+
+	fput(ring->file);
+	vfree(ring->buf);
+	kfree(ring);
+
+	return 0;
+}
+
+static __poll_t dfl_irq_ring_poll(struct file *filp, poll_table *wait)
+{
+	struct dfl_irq_ring *ring = filp->private_data;
+
+	poll_wait(filp, &ring->wait, wait);
+
+	if (READ_ONCE(ring->head) != READ_ONCE(ring->hdr->tail))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static int dfl_irq_ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct dfl_irq_ring *ring = filp->private_data;
+
+	if (!(vma->vm_flags & VM_SHARED) || vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->buf, 0);
+}
+
+static const struct file_operations dfl_irq_ring_fops = {
+	.owner = THIS_MODULE,
+	.release = dfl_irq_ring_release,
+	.poll = dfl_irq_ring_poll,
+	.mmap = dfl_irq_ring_mmap,
+};
+
+/**
+ * dfl_feature_ioctl_irq_ring - dfl feature _IRQ_RING ioctl interface.
+ * @filp: the device file of the feature device which has the sub feature
+ * @feature: the dfl sub feature
+ * @arg: ioctl argument
+ *
+ * Create a ring for all interrupts of the sub feature and return a file
+ * descriptor to mmap and poll it. The ring holds a reference to @filp, so the
+ * interrupts are recorded until the ring file is closed.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+long dfl_feature_ioctl_irq_ring(struct file *filp, struct dfl_feature *feature,
+				unsigned long arg)
+{
+	struct dfl_feature_dev_data *fdata;
+	struct dfl_fpga_irq_ring_create create;
+	struct dfl_irq_ring *ring;
+	unsigned long minsz;
+	struct file *file;
+	int fd, ret;
+
+	if (!feature->nr_irqs)
+		return -ENOENT;
+
+	minsz = offsetofend(struct dfl_fpga_irq_ring_create, fd);
+
+	if (copy_from_user(&create, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (create.argsz < minsz || create.flags ||
+	    create.nr_entries < DFL_IRQ_RING_MIN_ENTRIES ||
+	    create.nr_entries > DFL_IRQ_RING_MAX_ENTRIES ||
+	    !is_power_of_2(create.nr_entries))
+		return -EINVAL;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->feature = feature;
+	ring->nr_entries = create.nr_entries;
+	ring->size = PAGE_SIZE +
+		     PAGE_ALIGN(create.nr_entries * sizeof(*ring->events));
+	spin_lock_init(&ring->lock);
+	init_waitqueue_head(&ring->wait);
+
+	ring->buf = vmalloc_user(ring->size);
+	if (!ring->buf) {
+		ret = -ENOMEM;
+		goto free_ring;
+	}
+
+	ring->hdr = ring->buf;
+	ring->hdr->nr_entries = ring->nr_entries;
+	ring->hdr->entry_offset = PAGE_SIZE;
+	ring->events = ring->buf + PAGE_SIZE;
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto free_buf;
+	}
+
+	file = anon_inode_getfile("[dfl-irq-ring]", &dfl_irq_ring_fops, ring,
+				  O_RDWR);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto put_fd;
+	}
+
+	ring->file = get_file(filp);
+
+	fdata = to_dfl_feature_dev_data(&feature->dev->dev);
+	mutex_lock(&fdata->lock);
+	ret = dfl_irq_ring_attach(ring);
+	mutex_unlock(&fdata->lock);
+	if (ret)
+		goto put_file;
+
+	create.fd = fd;
+	if (copy_to_user((void __user *)arg, &create, minsz)) {
+		ret = -EFAULT;
+		goto put_file;
+	}
+
+	fd_install(fd, file);
+
+	return 0;
+
+put_file:
+	/* the release of the ring file detaches and frees the ring */
+	fput(file);
+	put_unused_fd(fd);
+	return ret;
+put_fd:
+	put_unused_fd(fd);
+free_buf:
+	vfree(ring->buf);
+free_ring:
+	kfree(ring);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(dfl_feature_ioctl_irq_ring);
+
 static void __exit dfl_fpga_exit(void)
 {
+	debugfs_remove_recursive(dfl_debugfs_root);
 	dfl_chardev_uinit();
 	dfl_ids_destroy();
 	bus_unregister(&dfl_bus_type);
@@ -20,13 +20,17 @@
 #include <linux/dfl.h>
 #include <linux/eventfd.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
 #include <linux/interrupt.h>
 #include <linux/iopoll.h>
 #include <linux/io-64-nonatomic-lo-hi.h>
 #include <linux/mod_devicetable.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/uuid.h>
+#include <linux/version.h>
 #include <linux/fpga/fpga-region.h>
 
 /* maximum supported number of ports */
@@ -34,6 +38,11 @@
 /* plus one for fme device */
 #define MAX_DFL_FEATURE_DEV_NUM    (MAX_DFL_FPGA_PORT_NUM + 1)
 
+/* character devices take io_uring commands since 5.19 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define DFL_URING_CMD
+#endif
+
 /* Reserved 0xfe for Header Group Register and 0xff for AFU */
 #define FEATURE_ID_FIU_HEADER		0xfe
 #define FEATURE_ID_AFU			0xff
@@ -54,6 +63,13 @@
 #define PORT_FEATURE_ID_UINT		0x12
 #define PORT_FEATURE_ID_STP		0x13
 
+/*
+ * The kernel only maps the header of the AFU feature. A kernel mapping sets
+ * the memory type of its range, e.g. with x86 PAT, so the rest of the AFU is
+ * left to userspace mappings, which can then be write-combined.
+ */
+#define PORT_AFU_HDR_SIZE		PAGE_SIZE
+
 /*
  * Device Feature Header Register Set
  *
@@ -256,17 +272,73 @@ struct dfl_feature_driver {
 	const struct dfl_feature_ops *ops;
 };
 
+struct dfl_irq_ring;
+
+/* log2 buckets of the interrupt latency histograms in ns, the last is open */
+#define DFL_IRQ_LATENCY_BUCKETS	32
+
+/**
+ * struct dfl_irq_latency - interrupt latency instrumentation of a vector
+ *
+ * @irqs: number of interrupts.
+ * @signals: number of measured signals of the eventfd.
+ * @reads: number of measured reads of the eventfd.
+ * @irq_ts: time of the oldest interrupt not signaled yet, 0 if none.
+ * @unread_ts: time of the oldest interrupt not read from the eventfd yet,
+ *	       0 if none.
+ * @signal_hist: log2 histogram of the time from interrupt to eventfd signal.
+ * @read_hist: log2 histogram of the time from interrupt to eventfd read.
+ * @pt: poll table to queue @wait on the eventfd.
+ * @wait: woken up by the eventfd when it is read.
+ * @wqh: wait queue head of the eventfd, NULL if @wait is not queued.
+ */
+struct dfl_irq_latency {
+	u64 irqs;
+	u64 signals;
+	u64 reads;
+	u64 irq_ts;
+	atomic64_t unread_ts;
+	u64 signal_hist[DFL_IRQ_LATENCY_BUCKETS];
+	u64 read_hist[DFL_IRQ_LATENCY_BUCKETS];
+	poll_table pt;
+	wait_queue_entry_t wait;
+	wait_queue_head_t *wqh;
+};
+
 /**
  * struct dfl_feature_irq_ctx - dfl private feature interrupt context
  *
  * @irq: Linux IRQ number of this interrupt.
  * @trigger: eventfd context to signal when interrupt happens.
- * @name: irq name needed when requesting irq.
+ * @name: irq name needed when requesting irq, only set while it is requested.
+ * @ring: shared memory ring to record the interrupt in, NULL if none. It is
+ *	  published to the irq handler with release semantics.
+ * @seq: sequence number of the last interrupt since @ring was attached.
+ * @lock: protects the moderation state below against @timer.
+ * @min_interval: minimum time between two signals of @trigger, 0 if not
+ *		  moderated.
+ * @last: time of the last signal of @trigger.
+ * @pending: an interrupt was suppressed, @timer signals @trigger for it.
+ * @timer: signals @trigger once @min_interval has passed since @last.
+ * @delivered: number of signals of @trigger.
+ * @suppressed: number of interrupts merged into a later signal.
+ * @latency: latency instrumentation, only updated while the irq_latency
+ *	     module parameter is set.
  */
 struct dfl_feature_irq_ctx {
 	int irq;
 	struct eventfd_ctx *trigger;
 	char *name;
+	struct dfl_irq_ring *ring;
+	u32 seq;
+	spinlock_t lock;
+	u64 min_interval;
+	ktime_t last;
+	bool pending;
+	struct hrtimer timer;
+	u64 delivered;
+	u64 suppressed;
+	struct dfl_irq_latency latency;
 };
 
 /**
@@ -281,6 +353,9 @@ struct dfl_feature_irq_ctx {
  * @ioaddr: mapped mmio resource address.
  * @irq_ctx: interrupt context list.
  * @nr_irqs: number of interrupt contexts.
+ * @irq_base: local irq index of the first interrupt of this sub feature.
+ * @mmio_start: physical start address of the registers of this sub feature.
+ * @mmio_size: size of the registers of this sub feature.
  * @ops: ops of this sub feature.
  * @ddev: ptr to the dfl device of this sub feature.
  * @priv: priv data of this feature.
@@ -288,6 +363,7 @@ struct dfl_feature_irq_ctx {
  * @param_size: size of dfh parameters
  * @params: point to memory copy of dfh parameters
  * @guid: unique dfl private guid.
+ * @index_node: node in the feature id index of the feature dev data.
  */
 struct dfl_feature {
 	struct platform_device *dev;
@@ -297,6 +373,9 @@ struct dfl_feature {
 	void __iomem *ioaddr;
 	struct dfl_feature_irq_ctx *irq_ctx;
 	unsigned int nr_irqs;
+	unsigned int irq_base;
+	resource_size_t mmio_start;
+	resource_size_t mmio_size;
 	const struct dfl_feature_ops *ops;
 	struct dfl_device *ddev;
 	void *priv;
@@ -304,10 +383,16 @@ struct dfl_feature {
 	unsigned int param_size;
 	void *params;
 	guid_t guid;
+	struct hlist_node index_node;
 };
 
 #define FEATURE_DEV_ID_UNUSED	(-1)
 
+/* number of hash bits of the feature id index of a feature dev */
+#define DFL_FEATURE_INDEX_BITS	4
+/* number of ioctl command numbers of the ioctl index of a feature dev */
+#define DFL_FEATURE_IOCTL_NR	(_IOC_NRMASK + 1)
+
 /**
  * struct dfl_feature_dev_data - dfl enumeration data for dfl feature dev.
  *
@@ -320,6 +405,9 @@ struct dfl_feature {
  * @dfl_cdev: ptr to container device.
  * @id: id used for the feature device.
  * @disable_count: count for port disable.
+ * @reset_lock: mutex to protect @disable_count and the port reset. Unlike
+ *		@lock, it is never held while memory is allocated, so the port
+ *		can be quiesced from an mmu notifier.
  * @excl_open: set on feature device exclusive open.
  * @open_count: count for feature device open.
  * @num: number for sub features.
@@ -327,6 +415,14 @@ struct dfl_feature {
  * @features: sub features for the feature dev.
  * @resource_num: number of resources for the feature dev.
  * @resources: resources for the feature dev.
+ * @afu_features: private features found in the AFU region of a port. Changes
+ *		  are made with the device lock of the feature dev and @lock
+ *		  held.
+ * @feature_index: sub features hashed by feature id.
+ * @ioctl_index: index plus one of the sub feature handling each ioctl command
+ *		 number, or 0 if none.
+ * @ioctl_unindexed: number of sub features with an ioctl but no ioctl range.
+ * @debugfs: debugfs directory of the feature dev, NULL if none.
  */
 struct dfl_feature_dev_data {
 	struct list_head node;
@@ -338,6 +434,7 @@ struct dfl_feature_dev_data {
 	struct dfl_fpga_cdev *dfl_cdev;
 	int id;
 	unsigned int disable_count;
+	struct mutex reset_lock;
 	bool excl_open;
 	int open_count;
 	void *private;
@@ -345,6 +442,11 @@ struct dfl_feature_dev_data {
 	struct dfl_feature *features;
 	int resource_num;
 	struct resource *resources;
+	struct list_head afu_features;
+	DECLARE_HASHTABLE(feature_index, DFL_FEATURE_INDEX_BITS);
+	u8 ioctl_index[DFL_FEATURE_IOCTL_NR];
+	unsigned int ioctl_unindexed;
+	struct dentry *debugfs;
 };
 
 /**
@@ -406,12 +508,25 @@ void *dfl_fpga_fdata_get_private(struct dfl_feature_dev_data *fdata)
 	return fdata->private;
 }
 
+/**
+ * struct dfl_feature_ops - ops of a sub feature driver
+ *
+ * @init: init the sub feature.
+ * @uinit: uinit the sub feature.
+ * @ioctl: handle the ioctl commands of the sub feature.
+ * @ioctl_nr_base: first DFL_FPGA_MAGIC ioctl command number handled by @ioctl.
+ * @ioctl_nr_count: number of ioctl command numbers handled by @ioctl, starting
+ *		    from @ioctl_nr_base. If 0, @ioctl is offered every command
+ *		    not handled by other sub features.
+ */
 struct dfl_feature_ops {
 	int (*init)(struct platform_device *pdev, struct dfl_feature *feature);
 	void (*uinit)(struct platform_device *pdev,
 		      struct dfl_feature *feature);
 	long (*ioctl)(struct platform_device *pdev, struct dfl_feature *feature,
 		      unsigned int cmd, unsigned long arg);
+	unsigned int ioctl_nr_base;
+	unsigned int ioctl_nr_count;
 };
 
 #define DFL_FPGA_FEATURE_DEV_FME		"dfl-fme"
@@ -446,7 +561,7 @@ dfl_get_feature_by_id(struct dfl_feature_dev_data *fdata, u16 id)
 {
 	struct dfl_feature *feature;
 
-	dfl_fpga_dev_for_each_feature(fdata, feature)
+	hash_for_each_possible(fdata->feature_index, feature, index_node, id)
 		if (feature->id == id)
 			return feature;
 
@@ -580,6 +695,10 @@ void dfl_fpga_enum_info_free(struct dfl_fpga_enum_info *info);
  * @lock: mutex lock to protect the port device list.
  * @port_dev_list: list of all port feature devices under this container device.
  * @released_port_num: released port number under this container device.
+ * @enum_mmio_reads: number of MMIO reads done by the last enumeration.
+ * @nr_irqs: number of irqs for all feature devices.
+ * @irq_table: Linux IRQ numbers for all irqs, indexed by local irq index of
+ *	       the parent device.
  */
 struct dfl_fpga_cdev {
 	struct device *parent;
@@ -589,6 +708,9 @@ struct dfl_fpga_cdev {
 	struct list_head port_dev_list;
 	struct list_head priv_feat_dev_list;
 	int released_port_num;
+	unsigned int enum_mmio_reads;
+	unsigned int nr_irqs;
+	int *irq_table;
 };
 
 struct dfl_fpga_cdev *
@@ -614,8 +736,20 @@ dfl_fpga_cdev_find_port_data(struct dfl_fpga_cdev *cdev, void *data,
 
 int dfl_fpga_cdev_release_port(struct dfl_fpga_cdev *cdev, int port_id);
 int dfl_fpga_cdev_assign_port(struct dfl_fpga_cdev *cdev, int port_id);
+int dfl_fpga_cdev_rescan_port_afu(struct dfl_fpga_cdev *cdev, int port_id);
+int __dfl_fpga_port_afu_rescan(struct dfl_feature_dev_data *fdata);
 void dfl_fpga_cdev_config_ports_pf(struct dfl_fpga_cdev *cdev);
 int dfl_fpga_cdev_config_ports_vf(struct dfl_fpga_cdev *cdev, int num_vf);
+long dfl_fpga_ioctl_get_feature_tree(struct dfl_feature_dev_data *fdata,
+				     void __user *arg);
+long dfl_feature_dev_ioctl(struct dfl_feature_dev_data *fdata,
+			   unsigned int cmd, unsigned long arg);
+#ifdef DFL_URING_CMD
+struct io_uring_cmd;
+int dfl_fpga_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags,
+		       const unsigned int *cmds, unsigned int nr_cmds,
+		       long (*ioctl)(struct file *, unsigned int, unsigned long));
+#endif
 int dfl_fpga_set_irq_triggers(struct dfl_feature *feature, unsigned int start,
 			      unsigned int count, int32_t *fds);
 long dfl_feature_ioctl_get_num_irqs(struct platform_device *pdev,
@@ -624,5 +758,34 @@ long dfl_feature_ioctl_get_num_irqs(struct platform_device *pdev,
 long dfl_feature_ioctl_set_irq(struct platform_device *pdev,
 			       struct dfl_feature *feature,
 			       unsigned long arg);
+long dfl_feature_ioctl_irq_ring(struct file *filp, struct dfl_feature *feature,
+				unsigned long arg);
+ssize_t dfl_feature_irq_affinity_show(struct dfl_feature *feature, char *buf);
+ssize_t dfl_feature_irq_affinity_store(struct dfl_feature *feature,
+				       const char *buf, size_t count);
+
+/**
+ * dfl_irq_set_default_affinity - set the default affinity of a dfl irq
+ * @irq: Linux IRQ number.
+ * @index: index of the irq in the irq table of the container device.
+ * @node: NUMA node of the container device.
+ *
+ * Spread the irqs of a container device one per CPU over the CPUs of its NUMA
+ * node first, the other CPUs only when the node has fewer CPUs than irqs. The
+ * affinity is not managed, so it can be changed later, e.g. to pin an irq to
+ * an isolated core.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+static inline int
+dfl_irq_set_default_affinity(int irq, unsigned int index, int node)
+{
+	return irq_set_affinity(irq, cpumask_of(cpumask_local_spread(index,
+								     node)));
+}
+
+long dfl_feature_ioctl_irq_moderation(struct platform_device *pdev,
+				      struct dfl_feature *feature,
+				      unsigned long arg);
 
 #endif /* __FPGA_DFL_H */
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2026 Intel Corporation
+ *
+ * This file contains macros for maintaining compatibility with older versions
+ * of the Linux kernel.
+ */
+
+#ifndef _BACKPORT_LINUX_DMA_BUF_H_
+#define _BACKPORT_LINUX_DMA_BUF_H_
+
+#include <linux/version.h>
+
+#include_next <linux/dma-buf.h>
+
+/*
+ * Since 6.2, dma_buf_map_attachment() expects the caller to hold the
+ * reservation lock of the dma-buf, and the _unlocked variants take it on
+ * behalf of the caller. Before, no lock was needed.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0) && RHEL_RELEASE_CODE < 0x903
+#define dma_buf_map_attachment_unlocked		dma_buf_map_attachment
+#define dma_buf_unmap_attachment_unlocked	dma_buf_unmap_attachment
+#endif
+
+#endif /* _BACKPORT_LINUX_DMA_BUF_H_ */
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2026 Intel Corporation
+ *
+ * This file contains macros for maintaining compatibility with older versions
+ * of the Linux kernel.
+ */
+
+#ifndef _BACKPORT_LINUX_HRTIMER_H_
+#define _BACKPORT_LINUX_HRTIMER_H_
+
+#include <linux/version.h>
+
+#include_next <linux/hrtimer.h>
+
+/* hrtimer_setup() replaced hrtimer_init() and setting the function in 6.13. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0) && RHEL_RELEASE_CODE < 0xa01
+static inline void
+hrtimer_setup(struct hrtimer *timer,
+	      enum hrtimer_restart (*function)(struct hrtimer *),
+	      clockid_t clock_id, enum hrtimer_mode mode)
+{
+	hrtimer_init(timer, clock_id, mode);
+	timer->function = function;
+}
+#endif
+
+#endif /* _BACKPORT_LINUX_HRTIMER_H_ */
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2026 Intel Corporation
+ *
+ * This file contains macros for maintaining compatibility with older versions
+ * of the Linux kernel.
+ */
+
+#ifndef _BACKPORT_LINUX_INTERRUPT_H_
+#define _BACKPORT_LINUX_INTERRUPT_H_
+
+#include <linux/version.h>
+
+#include_next <linux/interrupt.h>
+
+/*
+ * irq_set_affinity() is only exported to modules since 5.13. Before, set the
+ * affinity through irq_set_affinity_hint(), and drop the hint again right
+ * away, it would point to a cpumask which the caller may free.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 13, 0) && RHEL_RELEASE_CODE < 0x900
+static inline int
+backport_irq_set_affinity(unsigned int irq, const struct cpumask *cpumask)
+{
+	int ret;
+
+	ret = irq_set_affinity_hint(irq, cpumask);
+	irq_set_affinity_hint(irq, NULL);
+
+	return ret;
+}
+
+#define irq_set_affinity	backport_irq_set_affinity
+#endif
+
+#endif /* _BACKPORT_LINUX_INTERRUPT_H_ */
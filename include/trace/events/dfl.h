@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints of the interrupts of DFL private features
+ *
+ * Copyright (C) 2026 Intel Corporation, Inc.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dfl
+
+#if !defined(_TRACE_DFL_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_DFL_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(dfl_irq,
+
+	TP_PROTO(int irq, u32 seq),
+
+	TP_ARGS(irq, seq),
+
+	TP_STRUCT__entry(
+		__field(int, irq)
+		__field(u32, seq)
+	),
+
+	TP_fast_assign(
+		__entry->irq = irq;
+		__entry->seq = seq;
+	),
+
+	TP_printk("irq=%d seq=%u", __entry->irq, __entry->seq)
+);
+
+DECLARE_EVENT_CLASS(dfl_irq_latency,
+
+	TP_PROTO(int irq, u64 latency_ns),
+
+	TP_ARGS(irq, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(int, irq)
+		__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->irq = irq;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("irq=%d latency_ns=%llu", __entry->irq, __entry->latency_ns)
+);
+
+/* time from the oldest unsignaled interrupt to the signal of its eventfd */
+DEFINE_EVENT(dfl_irq_latency, dfl_irq_signal,
+
+	TP_PROTO(int irq, u64 latency_ns),
+
+	TP_ARGS(irq, latency_ns)
+);
+
+/* time from the oldest unread interrupt to the read of its eventfd */
+DEFINE_EVENT(dfl_irq_latency, dfl_irq_read,
+
+	TP_PROTO(int irq, u64 latency_ns),
+
+	TP_ARGS(irq, latency_ns)
+);
+
+#endif /* _TRACE_DFL_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -54,6 +54,92 @@
 
 #define DFL_FPGA_CHECK_EXTENSION	_IO(DFL_FPGA_MAGIC, DFL_FPGA_BASE + 1)
 
+/**
+ * DFL_FPGA_GET_FEATURE_TREE - _IOWR(DFL_FPGA_MAGIC, DFL_FPGA_BASE + 2,
+ *					struct dfl_fpga_feature_tree)
+ *
+ * Take a snapshot of all feature devices and their sub features under the
+ * FPGA container device of the file descriptor, as found by the driver during
+ * enumeration.
+ * Caller provides a buffer of buffer_size bytes at buffer_address. Driver
+ * always returns the size of the snapshot in tree_size, and copies the
+ * snapshot into the buffer only if it is large enough. buffer_size may be 0
+ * to query the size of the snapshot.
+ *
+ * The snapshot starts with struct dfl_fpga_feature_tree_hdr, followed by
+ * num_devs feature device entries. Each feature device entry is followed by
+ * its num_features sub feature entries, and each sub feature entry by its
+ * param_size bytes of DFHv1 parameters. Userspace must step over entries by
+ * the entry sizes in the header, as later versions may append fields.
+ * Return: 0 on success, -ENOSPC if the buffer is too small, -errno on
+ * other failures.
+ */
+struct dfl_fpga_feature_tree {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u64 buffer_address;	/* Userspace address of the buffer */
+	__u32 buffer_size;	/* Size of the buffer (bytes) */
+	/* Output */
+	__u32 tree_size;	/* Size of the snapshot (bytes) */
+};
+
+#define DFL_FPGA_FEATURE_TREE_VERSION	1
+
+struct dfl_fpga_feature_tree_hdr {
+	__u32 version;		/* DFL_FPGA_FEATURE_TREE_VERSION */
+	__u32 size;		/* Size of the snapshot (bytes) */
+	__u16 dev_entry_size;	/* Size of a feature device entry */
+	__u16 feature_entry_size; /* Size of a sub feature entry */
+	__u32 num_devs;		/* The number of feature devices */
+};
+
+struct dfl_fpga_feature_tree_dev {
+	__u32 type;		/* Type of the feature device */
+#define DFL_FPGA_FEATURE_TREE_FME	0
+#define DFL_FPGA_FEATURE_TREE_PORT	1
+#define DFL_FPGA_FEATURE_TREE_PRIV_FEAT	2
+	__s32 id;		/* Instance id, e.g. N of dfl-port.N */
+	__u32 flags;
+#define DFL_FPGA_FEATURE_TREE_DEV_RELEASED	(1 << 0) /* Port released */
+	__u32 num_features;	/* The number of sub features */
+};
+
+struct dfl_fpga_feature_tree_feature {
+	__u16 id;		/* Feature id */
+	__u8 revision;		/* Feature revision */
+	__u8 dfh_version;	/* DFH version */
+	__u32 param_size;	/* Size of DFHv1 parameters (bytes) */
+	__u64 mmio_start;	/* Physical address of the registers */
+	__u64 mmio_size;	/* Size of the registers (bytes) */
+	__u32 irq_base;		/* Index of the first irq of the device */
+	__u32 nr_irqs;		/* The number of irqs */
+	__u8 guid[16];		/* GUID for DFHv1, otherwise zero */
+};
+
+#define DFL_FPGA_GET_FEATURE_TREE	_IO(DFL_FPGA_MAGIC, DFL_FPGA_BASE + 2)
+
+/**
+ * struct dfl_fpga_uring_cmd - payload of io_uring commands
+ *
+ * The AFU and FME device fds take the ioctls below as IORING_OP_URING_CMD
+ * too, with cmd_op of the sqe set to the ioctl number and this payload in
+ * the command area of the sqe. The command completes with the return value
+ * of the ioctl. It may block, e.g. to pin a large buffer or to program a
+ * bitstream, so it is issued from an io_uring worker rather than from the
+ * submitting thread. Other ioctl numbers fail with -ENOTTY.
+ *
+ * AFU: DFL_FPGA_PORT_RESET, DFL_FPGA_PORT_DMA_MAP, DFL_FPGA_PORT_DMA_UNMAP,
+ * DFL_FPGA_PORT_DMA_MAP_BATCH, DFL_FPGA_PORT_DMA_UNMAP_BATCH,
+ * DFL_FPGA_PORT_DMA_ALLOC, DFL_FPGA_PORT_DMA_EXPORT, DFL_FPGA_PORT_DMA_IMPORT,
+ * DFL_FPGA_PORT_ERR_SET_IRQ and DFL_FPGA_PORT_UINT_SET_IRQ.
+ *
+ * FME: DFL_FPGA_FME_PORT_PR and DFL_FPGA_FME_ERR_SET_IRQ.
+ */
+struct dfl_fpga_uring_cmd {
+	__u64 arg;		/* Argument of the ioctl, e.g. user pointer */
+};
+
 /* IOCTLs for AFU file descriptor */
 
 /**
@@ -74,15 +160,20 @@
  *
  * Retrieve information about the fpga port.
  * Driver fills the info in provided struct dfl_fpga_port_info.
+ * DFL_PORT_INFO_SVA is set if an address space is bound to the device fd by
+ * DFL_FPGA_PORT_SVA_BIND, its PASID is then returned in pasid. pasid is only
+ * filled if argsz covers it.
  * Return: 0 on success, -errno on failure.
  */
 struct dfl_fpga_port_info {
 	/* Input */
 	__u32 argsz;		/* Structure length */
 	/* Output */
-	__u32 flags;		/* Zero for now */
+	__u32 flags;
+#define DFL_PORT_INFO_SVA	(1 << 0)	/* Address space is bound */
 	__u32 num_regions;	/* The number of supported regions */
 	__u32 num_umsgs;	/* The number of allocated umsgs */
+	__u32 pasid;		/* PASID of the bound address space */
 };
 
 #define DFL_FPGA_PORT_GET_INFO		_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 1)
@@ -94,6 +185,12 @@ struct dfl_fpga_port_info {
  * Retrieve information about a device memory region.
  * Caller provides struct dfl_fpga_port_region_info with index value set.
  * Driver returns the region info in other fields.
+ *
+ * A region with DFL_PORT_REGION_MMAP_WC can also be mmaped write-combined
+ * from wc_offset, e.g. for write-only descriptor rings, where consecutive
+ * stores may be merged into larger bus transactions. The first page of the
+ * AFU region, its header, can't be mapped write-combined. wc_offset is only
+ * filled if argsz covers it.
  * Return: 0 on success, -errno on failure.
  */
 struct dfl_fpga_port_region_info {
@@ -104,6 +201,7 @@ struct dfl_fpga_port_region_info {
 #define DFL_PORT_REGION_READ	(1 << 0)	/* Region is readable */
 #define DFL_PORT_REGION_WRITE	(1 << 1)	/* Region is writable */
 #define DFL_PORT_REGION_MMAP	(1 << 2)	/* Can be mmaped to userspace */
+#define DFL_PORT_REGION_MMAP_WC	(1 << 3)	/* Can be mmaped write-combined */
 	/* Input */
 	__u32 index;		/* Region index */
 #define DFL_PORT_REGION_INDEX_AFU	0	/* AFU */
@@ -112,6 +210,7 @@ struct dfl_fpga_port_region_info {
 	/* Output */
 	__u64 size;		/* Region size (bytes) */
 	__u64 offset;		/* Region offset from start of device fd */
+	__u64 wc_offset;	/* Write-combined offset from start of fd */
 };
 
 #define DFL_FPGA_PORT_GET_REGION_INFO	_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 2)
@@ -123,12 +222,38 @@ struct dfl_fpga_port_region_info {
  * Map the dma memory per user_addr and length which are provided by caller.
  * Driver fills the iova in provided struct afu_port_dma_map.
  * This interface only accepts page-size aligned user memory for dma mapping.
+ * The memory needn't be physically contiguous if the device is behind an
+ * IOMMU which maps it to contiguous iova, e.g. ordinary anonymous memory.
  *
  * Setting only one of DFL_DMA_MAP_FLAG_READ or WRITE limits FPGA-initiated
  * DMA requests to only reads or only writes. To be back-compatiable with
  * legacy driver, setting neither flag is equivalent to setting both flags:
  * both read and write are requests permitted.
  *
+ * The mapping belongs to the open device fd, only DFL_FPGA_PORT_DMA_UNMAP on
+ * the same fd finds it, and it is released when the fd is closed. The port is
+ * only held in reset for that if no other fd of the port is open, otherwise
+ * the AFU must have stopped using the mapping before the fd is closed.
+ *
+ * Setting DFL_DMA_MAP_FLAG_CACHE keeps the memory pinned and mapped after
+ * DFL_FPGA_PORT_DMA_UNMAP, so mapping the same user_addr, length and
+ * direction again returns the same iova without pinning the pages again.
+ * The cached mapping is released when the user address range changes, when
+ * the locked memory limit is reached, or when the fd is closed. Mapping the
+ * same range more than once shares the mapping, and each DMA_MAP needs a
+ * DMA_UNMAP. -EOPNOTSUPP is returned if the kernel doesn't support the cache.
+ *
+ * Setting DFL_DMA_MAP_FLAG_ONDEMAND maps the memory without pinning it or
+ * accounting it as locked memory. When the user address range is
+ * invalidated, the port is held in reset and the mapping is dropped before
+ * the invalidation completes, so the kernel can reclaim, compact or migrate
+ * the memory, and the range is faulted in and mapped again afterwards. If
+ * the new pages can't be mapped at the same iova, the port stays in reset
+ * until the mapping is released by DFL_FPGA_PORT_DMA_UNMAP. It can't be
+ * combined with DFL_DMA_MAP_FLAG_CACHE, and needs the device to be opened
+ * with O_EXCL, -EBUSY is returned otherwise.
+ * -EOPNOTSUPP is returned if the kernel doesn't support on-demand mappings.
+ *
  * Return: 0 on success, -errno on failure.
  */
 struct dfl_fpga_port_dma_map {
@@ -137,6 +262,8 @@ struct dfl_fpga_port_dma_map {
 	__u32 flags;
 #define DFL_DMA_MAP_FLAG_READ	(1 << 0)/* readable from device */
 #define DFL_DMA_MAP_FLAG_WRITE	(1 << 1)/* writable from device */
+#define DFL_DMA_MAP_FLAG_CACHE	(1 << 2)/* keep mapped after unmap */
+#define DFL_DMA_MAP_FLAG_ONDEMAND	(1 << 4)/* not pinned */
 	__u64 user_addr;        /* Process virtual address */
 	__u64 length;           /* Length of mapping (bytes)*/
 	/* Output */
@@ -161,6 +288,163 @@ struct dfl_fpga_port_dma_unmap {
 
 #define DFL_FPGA_PORT_DMA_UNMAP		_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 4)
 
+/**
+ * DFL_FPGA_PORT_DMA_MAP_BATCH - _IOWR(DFL_FPGA_MAGIC, DFL_PORT_BASE + 9,
+ *					struct dfl_fpga_port_dma_map_batch)
+ *
+ * Map count dma memory regions at once, each entry is handled as by
+ * DFL_FPGA_PORT_DMA_MAP and driver fills its iova. Either all entries are
+ * mapped or none: on failure, result of the entry which failed is its -errno
+ * and result of all other entries is -ECANCELED. argsz covers the entries,
+ * count is at most DFL_DMA_BATCH_MAX.
+ * Return: 0 on success, -errno on failure.
+ */
+struct dfl_fpga_port_dma_map_entry {
+	/* Input */
+	__u32 flags;		/* DFL_DMA_MAP_FLAG_* */
+	/* Output */
+	__s32 result;		/* 0 or -errno */
+	/* Input */
+	__u64 user_addr;	/* Process virtual address */
+	__u64 length;		/* Length of mapping (bytes)*/
+	/* Output */
+	__u64 iova;		/* IO virtual address */
+};
+
+struct dfl_fpga_port_dma_map_batch {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 count;		/* Number of entries */
+	__u32 padding;
+	struct dfl_fpga_port_dma_map_entry entries[];
+};
+
+#define DFL_DMA_BATCH_MAX		16384
+
+#define DFL_FPGA_PORT_DMA_MAP_BATCH	_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 9)
+
+/**
+ * DFL_FPGA_PORT_DMA_UNMAP_BATCH - _IOWR(DFL_FPGA_MAGIC, DFL_PORT_BASE + 10,
+ *					struct dfl_fpga_port_dma_unmap_batch)
+ *
+ * Unmap count dma memory regions at once, each entry is handled as by
+ * DFL_FPGA_PORT_DMA_UNMAP. Either all entries are unmapped or none, results
+ * are reported as for DFL_FPGA_PORT_DMA_MAP_BATCH.
+ * Return: 0 on success, -errno on failure.
+ */
+struct dfl_fpga_port_dma_unmap_entry {
+	/* Input */
+	__u64 iova;		/* IO virtual address */
+	/* Output */
+	__s32 result;		/* 0 or -errno */
+	__u32 padding;
+};
+
+struct dfl_fpga_port_dma_unmap_batch {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 count;		/* Number of entries */
+	__u32 padding;
+	struct dfl_fpga_port_dma_unmap_entry entries[];
+};
+
+#define DFL_FPGA_PORT_DMA_UNMAP_BATCH	_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 10)
+
+/**
+ * DFL_FPGA_PORT_DMA_ALLOC - _IOWR(DFL_FPGA_MAGIC, DFL_PORT_BASE + 11,
+ *						struct dfl_fpga_port_dma_alloc)
+ *
+ * Allocate a dma buffer of length bytes from the NUMA node of the device and
+ * map it for dma. Driver fills the iova, and the offset to mmap() the buffer
+ * from the port fd. Setting DFL_DMA_ALLOC_FLAG_CONTIG allocates the buffer in
+ * physically contiguous chunks of the PMD size, length must then be a multiple
+ * of the PMD size. This only reduces the number of dma segments, the buffer is
+ * still mmapped with base pages. DFL_DMA_MAP_FLAG_READ and WRITE are handled as for
+ * DFL_FPGA_PORT_DMA_MAP. The buffer is freed by DFL_FPGA_PORT_DMA_UNMAP of
+ * its iova, existing mmaps of it stay valid until they are unmapped.
+ * Return: 0 on success, -errno on failure.
+ */
+struct dfl_fpga_port_dma_alloc {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;
+#define DFL_DMA_ALLOC_FLAG_CONTIG	(1 << 3)/* PMD sized contiguous chunks */
+	__u64 length;		/* Length of buffer (bytes) */
+	/* Output */
+	__u64 iova;		/* IO virtual address */
+	__u64 offset;		/* Offset to mmap() from start of device fd */
+};
+
+#define DFL_FPGA_PORT_DMA_ALLOC		_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 11)
+
+/**
+ * DFL_FPGA_PORT_DMA_EXPORT - _IOWR(DFL_FPGA_MAGIC, DFL_PORT_BASE + 12,
+ *						struct dfl_fpga_port_dma_export)
+ *
+ * Export the dma region which starts at iova as a dma-buf, so it can be
+ * shared with other devices and processes. Driver fills the file descriptor
+ * of the dma-buf, which is opened with O_CLOEXEC. The dma-buf holds the pages
+ * of the region, it stays valid after the region is unmapped. A region of
+ * user memory can only be exported by the process which mapped it, its pages
+ * are pinned again and charged to RLIMIT_MEMLOCK of that process for the
+ * lifetime of the dma-buf. Regions imported by DFL_FPGA_PORT_DMA_IMPORT can't
+ * be exported.
+ * Return: 0 on success, -errno on failure.
+ */
+struct dfl_fpga_port_dma_export {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u64 iova;		/* IO virtual address of the region */
+	/* Output */
+	__s32 fd;		/* File descriptor of the dma-buf */
+	__u32 padding;
+};
+
+#define DFL_FPGA_PORT_DMA_EXPORT	_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 12)
+
+/**
+ * DFL_FPGA_PORT_DMA_IMPORT - _IOWR(DFL_FPGA_MAGIC, DFL_PORT_BASE + 13,
+ *						struct dfl_fpga_port_dma_import)
+ *
+ * Attach the dma-buf of fd to the device and map it for dma. Driver fills the
+ * iova and the length of the dma-buf. This only succeeds if the dma-buf is
+ * mapped to continuous IO virtual addresses. DFL_DMA_MAP_FLAG_READ and WRITE
+ * are handled as for DFL_FPGA_PORT_DMA_MAP. The dma-buf is detached by
+ * DFL_FPGA_PORT_DMA_UNMAP of its iova.
+ * Return: 0 on success, -errno on failure.
+ */
+struct dfl_fpga_port_dma_import {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;
+	__s32 fd;		/* File descriptor of the dma-buf */
+	__u32 padding;
+	/* Output */
+	__u64 iova;		/* IO virtual address */
+	__u64 length;		/* Length of the dma-buf (bytes) */
+};
+
+#define DFL_FPGA_PORT_DMA_IMPORT	_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 13)
+
+/**
+ * DFL_FPGA_PORT_SVA_BIND - _IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 14)
+ *
+ * Bind the address space of the caller to the device for shared virtual
+ * addressing. The AFU then accesses it by virtual address with the returned
+ * PASID, and DFL_FPGA_PORT_DMA_MAP and DFL_FPGA_PORT_DMA_MAP_BATCH of its
+ * memory return the user address as iova without pinning or mapping it. The
+ * binding is dropped when the device fd is closed. The port is held in reset
+ * until the PASID is released if no other fd of the port is open, otherwise
+ * the AFU must have stopped using the PASID. Only one address space can be
+ * bound to a device fd, binding the same one again returns its PASID.
+ * Return: PASID on success, -errno on failure.
+ */
+
+#define DFL_FPGA_PORT_SVA_BIND		_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 14)
+
 /**
  * struct dfl_fpga_irq_set - the argument for DFL_FPGA_XXX_SET_IRQ ioctl.
  *
@@ -220,6 +504,85 @@ struct dfl_fpga_irq_set {
 					     DFL_PORT_BASE + 8,	\
 					     struct dfl_fpga_irq_set)
 
+/**
+ * DFL_FPGA_PORT_UINT_IRQ_RING - _IOWR(DFL_FPGA_MAGIC, DFL_PORT_BASE + 15,
+ *					struct dfl_fpga_irq_ring_create)
+ *
+ * Create a shared memory ring which records every interrupt of the fpga AFU
+ * interrupt private feature, in addition to signaling its eventfd if one is
+ * set. Driver fills the file descriptor of the ring, which is opened with
+ * O_CLOEXEC. nr_entries must be a power of 2 from 64 to 65536.
+ *
+ * The ring file is mmapped shared and read-write from offset 0, with a size
+ * of one page plus the entries rounded up to pages. The mapping starts with
+ * struct dfl_fpga_irq_ring_hdr, the entries follow at entry_offset. The
+ * driver writes entries at head, userspace consumes them from tail and
+ * advances tail, both count entries and wrap around at 2^32. Interrupts which
+ * find the ring full are counted in dropped instead. poll() of the ring file
+ * reports EPOLLIN while head differs from tail, so userspace can busy poll
+ * head and only sleep in poll() when the ring is empty.
+ *
+ * Only one ring can be created at a time, -EBUSY is returned otherwise. The
+ * ring keeps the device fd open until the ring file is closed.
+ * Return: 0 on success, -errno on failure.
+ */
+struct dfl_fpga_irq_ring_create {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 nr_entries;	/* Number of entries of the ring */
+	/* Output */
+	__s32 fd;		/* File descriptor of the ring */
+};
+
+struct dfl_fpga_irq_ring_hdr {
+	__u32 head;		/* Next entry written by the driver */
+	__u32 tail;		/* Next entry read by userspace */
+	__u32 nr_entries;	/* Number of entries of the ring */
+	__u32 entry_offset;	/* Offset of the entries in the mapping */
+	__u64 dropped;		/* Interrupts dropped since the ring was full */
+};
+
+struct dfl_fpga_irq_event {
+	__u64 timestamp;	/* CLOCK_MONOTONIC time of the interrupt (ns) */
+	__u32 vector;		/* Index of the irq in the private feature */
+	__u32 seq;		/* Sequence number of the irq on its vector */
+};
+
+#define DFL_FPGA_PORT_UINT_IRQ_RING	_IO(DFL_FPGA_MAGIC, DFL_PORT_BASE + 15)
+
+/**
+ * DFL_FPGA_PORT_UINT_IRQ_MODERATION - _IOWR(DFL_FPGA_MAGIC, DFL_PORT_BASE + 16,
+ *					struct dfl_fpga_irq_moderation)
+ *
+ * Moderate the eventfd signals of one interrupt of the fpga AFU interrupt
+ * private feature. If DFL_IRQ_MODERATION_SET is set in flags, min_interval_ns
+ * becomes the minimum time between two signals of the eventfd of the vector
+ * and its counters are cleared, 0 disables moderation. A maximum rate of N
+ * signals per second is a min_interval_ns of 1000000000 / N. Interrupts which
+ * arrive earlier are suppressed, and a timer signals the eventfd once for
+ * them when the interval has passed, so no interrupt is left unsignaled.
+ * Driver always fills the current min_interval_ns and the counters of the
+ * vector. The interrupt ring records every interrupt regardless.
+ * Return: 0 on success, -errno on failure.
+ */
+struct dfl_fpga_irq_moderation {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;
+#define DFL_IRQ_MODERATION_SET	(1 << 0)	/* Set min_interval_ns */
+	__u32 vector;		/* Index of the irq in the private feature */
+	__u32 pad;		/* Zero */
+	/* Input/Output */
+	__u64 min_interval_ns;	/* Minimum time between two signals (ns) */
+	/* Output */
+	__u64 delivered;	/* Eventfd signals */
+	__u64 suppressed;	/* Interrupts merged into a later signal */
+};
+
+#define DFL_FPGA_PORT_UINT_IRQ_MODERATION	_IO(DFL_FPGA_MAGIC, \
+						    DFL_PORT_BASE + 16)
+
 /* IOCTLs for FME file descriptor */
 
 /**